@@ -3,13 +3,18 @@
 
 #include "stdafx.h"
 
+#include <chrono>
+#include <climits>
 #include <fstream>
+#include <set>
 
 #include "../Pinocchio/skeleton.h"
 #include "../Pinocchio/utils.h"
 #include "../Pinocchio/debugging.h"
 #include "../Pinocchio/attachment.h"
 #include "../Pinocchio/pinocchioApi.h"
+#include "../Pinocchio/threadpool.h"
+#include "../Pinocchio/pointcache.h"
 
 using namespace std;
 using namespace Pinocchio;
@@ -18,7 +23,8 @@ struct ArgData
 {
   ArgData() :
   stopAtMesh(false), stopAfterCircles(false), skelScale(1.), noFit(true),
-    skeleton(HumanSkeleton()), stiffness(1.),
+    skeleton(HumanSkeleton()), stiffness(1.), pcg(false), tolerance(1e-6),
+    maxInfluences(0), benchSkin(false), selfCheck(false),
     skelOutName("skeleton.out"), weightOutName("attachment.out")
   {
   }
@@ -32,8 +38,14 @@ struct ArgData
   Skeleton skeleton;
   string skeletonname;
   double stiffness;
+  bool pcg;
+  double tolerance;
+  int maxInfluences;
+  bool benchSkin;
+  bool selfCheck;
   string skelOutName;
   string weightOutName;
+  string binaryWeightOutName;
 };
 
 void printUsageAndExit()
@@ -41,8 +53,10 @@ void printUsageAndExit()
   cout << "Usage: attachWeights filename.{obj | ply | off | gts | stl}" << endl;
   cout << "              [-skel skelname] [-rot x y z deg]* [-scale s]" << endl;
   cout << "              [-meshonly | -mo] [-circlesonly | -co]" << endl;
-  cout << "              [-fit] [-stiffness s]" << endl;
+  cout << "              [-fit] [-stiffness s] [-pcg] [-tolerance t]" << endl;
+  cout << "              [-maxInfluences k] [-benchSkin] [-selfCheck]" << endl;
   cout << "              [-skelOut skelOutFile] [-weightOut weightOutFile]" << endl;
+  cout << "              [-binaryWeightOut binaryWeightFile]" << endl;
 
   exit(0);
 }
@@ -133,6 +147,41 @@ ArgData processArgs(const vector<string> &args)
       sscanf(args[cur++].c_str(), "%lf", &out.stiffness);
       continue;
     }
+    if(curStr == string("-pcg"))
+    {
+      out.pcg = true;
+      continue;
+    }
+    if(curStr == string("-tolerance"))
+    {
+      if(cur >= num)
+      {
+        cout << "No tolerance provided; exiting." << endl;
+        printUsageAndExit();
+      }
+      sscanf(args[cur++].c_str(), "%lf", &out.tolerance);
+      continue;
+    }
+    if(curStr == string("-maxInfluences"))
+    {
+      if(cur >= num)
+      {
+        cout << "No influence count provided; exiting." << endl;
+        printUsageAndExit();
+      }
+      sscanf(args[cur++].c_str(), "%d", &out.maxInfluences);
+      continue;
+    }
+    if(curStr == string("-benchSkin"))
+    {
+      out.benchSkin = true;
+      continue;
+    }
+    if(curStr == string("-selfCheck"))
+    {
+      out.selfCheck = true;
+      continue;
+    }
     if(curStr == string("-skelOut"))
     {
       if(cur == num)
@@ -155,6 +204,17 @@ ArgData processArgs(const vector<string> &args)
       out.weightOutName = curStr;
       continue;
     }
+    if(curStr == string("-binaryWeightOut"))
+    {
+      if(cur == num)
+      {
+        cout << "No binary weight output specified; ignoring." << endl;
+        continue;
+      }
+      curStr = args[cur++];
+      out.binaryWeightOutName = curStr;
+      continue;
+    }
     cout << "Unrecognized option: " << curStr << endl;
     printUsageAndExit();
   }
@@ -163,6 +223,752 @@ ArgData processArgs(const vector<string> &args)
 }
 
 
+//times frames of skinning with the given kernel and prints the vertices
+//(or, for a crowd, the instances) per second
+template<class F> void benchOne(const char *name, int vertices, F frame, int instances = 0)
+{
+  int frames = 0;
+  frame();
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  double elapsed = 0.;
+  while(elapsed < 0.5)
+  {
+    for(int i = 0; i < 10; ++i)
+      frame();
+    frames += 10;
+    elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  }
+  cout << "  " << name << ": " << elapsed * 1000. / frames << " ms/frame, ";
+  if(instances > 0)
+    cout << instances * frames / elapsed << " instances/s" << endl;
+  else
+    cout << vertices * frames / elapsed / 1e6 << "M vertices/s" << endl;
+}
+
+
+//how far the float32 path (PackedSkin, with skinned normals) strays from
+//skinning in double: position errors in units of the normalized mesh and
+//the normal error in radians
+void floatError(const Mesh &rest, const Attachment &attachment, const PackedSkin &packed,
+  const SkinningContext &context, int kernel, double &maxError, double &rmsError, double &maxAngle)
+{
+  int i;
+  int nv = (int)rest.vertices.size();
+  SkinningContext skinned = context;
+  skinned.setNormalMode(SkinningContext::SKINNED_NORMALS);
+  Mesh out = rest;
+  DeformTarget target(out);
+  skin(rest, attachment.getSkinWeights(), skinned, target);
+
+  vector<float> x(nv), y(nv), z(nv), nx(nv), ny(nv), nz(nv);
+  packed.deform(context, &x[0], &y[0], &z[0], &nx[0], &ny[0], &nz[0], kernel);
+  double sumSq = 0.;
+  maxError = maxAngle = 0.;
+  for(i = 0; i < nv; ++i)
+  {
+    double error = (Vector3(x[i], y[i], z[i]) - out.vertices[i].pos).length();
+    maxError = max(maxError, error);
+    sumSq += error * error;
+    //atan2 stays accurate for tiny angles, unlike acos
+    Vector3 n(nx[i], ny[i], nz[i]);
+    maxAngle = max(maxAngle, atan2((n % out.vertices[i].normal).length(), n * out.vertices[i].normal));
+  }
+  rmsError = sqrt(sumSq / max(nv, 1));
+}
+
+
+void reportFloatError(const Mesh &rest, const Attachment &attachment, const PackedSkin &packed,
+  const SkinningContext &context)
+{
+  double maxError, rmsError, maxAngle;
+  floatError(rest, attachment, packed, context, PackedSkin::AUTO, maxError, rmsError, maxAngle);
+  cout << "  float32 vs double: max position error " << maxError << ", rms "
+       << rmsError << ", max normal error " << maxAngle * 180. / M_PI << " deg" << endl;
+}
+
+
+//turns bone i about its joint by angle + 0.05 * i around the x, y or z axis
+vector<Transform<> > bendBones(const Skeleton &skeleton, const vector<Vector3> &embedding, double angle)
+{
+  int i;
+  int bones = (int)embedding.size() - 1;
+  vector<Transform<> > transforms(bones);
+  for(i = 0; i < bones; ++i)
+  {
+    Vector3 pivot = embedding[skeleton.fPrev()[i + 1]];
+    Quaternion<> rot(Vector3(i % 3 == 0, i % 3 == 1, i % 3 == 2), angle + 0.05 * i);
+    transforms[i] = Transform<>(pivot) * Transform<>(rot) * Transform<>(-pivot);
+  }
+  return transforms;
+}
+
+
+//skins the mesh with every kernel, bending each bone about its joint, first
+//on one thread and then split across the global pool
+void benchSkinning(const Mesh &m, const Skeleton &skeleton, const vector<Vector3> &embedding, const Attachment &attachment)
+{
+  int i, a;
+  int bones = (int)embedding.size() - 1;
+  int nv = (int)m.vertices.size();
+
+  vector<Transform<> > transforms = bendBones(skeleton, embedding, 0.3);
+  SkinningContext context, pooled;
+  context.setTransforms(transforms);
+  context.setParallelThreshold(INT_MAX);
+  pooled.setTransforms(transforms);
+  pooled.setParallelThreshold(0);
+
+  cout << "Skinning " << nv << " vertices, " << bones << " bones, "
+       << ThreadPool::global().size() << " pool threads"
+       << (PackedSkin::hasAVX2() ? "" : " (no AVX2 on this CPU)") << endl;
+
+  const char *algoNames[2] = { "LBS", "DQS" };
+  int algos[2] = { Mesh::LBS, Mesh::DQS };
+  for(a = 0; a < 2; ++a)
+  {
+    Mesh rest = m;
+    rest.algo = algos[a];
+    Mesh out = rest;
+    DeformTarget target(out);
+    PackedSkin packed(rest, attachment.getSkinWeights());
+    vector<float> x(nv), y(nv), z(nv), nx(nv), ny(nv), nz(nv);
+
+    cout << algoNames[a] << ":" << endl;
+    reportFloatError(rest, attachment, packed, context);
+    benchOne("deform (copying)", nv, [&]() { Mesh d = attachment.deform(rest, transforms); });
+    benchOne("skin (double)", nv, [&]() { skin(rest, attachment.getSkinWeights(), context, target); });
+    benchOne("packed scalar", nv, [&]() { packed.deform(context, &x[0], &y[0], &z[0], PackedSkin::SCALAR); });
+    if(PackedSkin::hasAVX2())
+      benchOne("packed AVX2", nv, [&]() { packed.deform(context, &x[0], &y[0], &z[0], PackedSkin::AVX2); });
+    benchOne("packed with normals", nv, [&]() { packed.deform(context, &x[0], &y[0], &z[0], &nx[0], &ny[0], &nz[0]); });
+    benchOne("skin (double, pool)", nv, [&]() { skin(rest, attachment.getSkinWeights(), pooled, target); });
+    benchOne("packed (pool)", nv, [&]() { packed.deform(pooled, &x[0], &y[0], &z[0]); });
+  }
+
+  //a crowd, every instance with the pose turned a little further
+  const int instances = 256;
+  vector<SkinningContext> poses(instances), pooledPoses(instances);
+  vector<Transform<> > instanceTransforms(bones);
+  for(a = 0; a < instances; ++a)
+  {
+    for(i = 0; i < bones; ++i)
+      instanceTransforms[i] = Transform<>(Quaternion<>(Vector3(0., 1., 0.), 0.01 * a)) * transforms[i];
+    poses[a].setTransforms(instanceTransforms);
+    poses[a].setParallelThreshold(INT_MAX);
+    pooledPoses[a].setTransforms(instanceTransforms);
+    pooledPoses[a].setParallelThreshold(0);
+  }
+
+  Mesh rest = m;
+  rest.algo = Mesh::LBS;
+  vector<Mesh> copies(instances);
+  vector<double> buffer((size_t)instances * 3 * nv);
+  vector<DeformTarget> targets(instances);
+  for(a = 0; a < instances; ++a)
+  {
+    targets[a].x = &buffer[(size_t)a * 3 * nv];
+    targets[a].y = targets[a].x + nv;
+    targets[a].z = targets[a].y + nv;
+  }
+  PackedSkin packed(rest, attachment.getSkinWeights());
+  vector<float> packedBuffer((size_t)instances * 3 * nv);
+
+  cout << "Crowd of " << instances << " LBS instances, positions only:" << endl;
+  benchOne("deform per instance (copying, with normals)", nv, [&]()
+  {
+    for(int c = 0; c < instances; ++c)
+      copies[c] = attachment.deform(rest, instanceTransforms);
+  }, instances);
+  benchOne("deformInstances (double)", nv, [&]() { attachment.deformInstances(rest, poses, targets); }, instances);
+  benchOne("packed deform per instance", nv, [&]()
+  {
+    for(int c = 0; c < instances; ++c)
+    {
+      float *out = &packedBuffer[(size_t)c * 3 * nv];
+      packed.deform(poses[c], out, out + nv, out + 2 * nv);
+    }
+  }, instances);
+  benchOne("packed deformInstances", nv, [&]() { packed.deformInstances(poses, &packedBuffer[0]); }, instances);
+  benchOne("deformInstances (double, pool)", nv, [&]() { attachment.deformInstances(rest, pooledPoses, targets); }, instances);
+  benchOne("packed deformInstances (pool)", nv, [&]() { packed.deformInstances(pooledPoses, &packedBuffer[0]); }, instances);
+}
+
+
+//the self check prints one line per comparison of a path with its
+//reference and counts the ones over their limit (NaN counts as over)
+static int checkFailures = 0;
+
+void checkResult(const char *name, double difference, double limit)
+{
+  bool ok = difference <= limit;
+  if(!ok)
+    ++checkFailures;
+  cout << (ok ? "  ok     " : "  FAILED ") << name << ": " << difference << " (limit " << limit << ")" << endl;
+}
+
+
+double maxDifference(const vector<Vector3> &v1, const vector<Vector3> &v2)
+{
+  double out = 0.;
+  for(int i = 0; i < (int)v1.size(); ++i)
+    out = max(out, (v1[i] - v2[i]).length());
+  return v1.size() == v2.size() ? out : HUGE_VAL;
+}
+
+
+//largest difference of the positions and of the normals
+void meshDifference(const Mesh &m1, const Mesh &m2, double &positions, double &normals)
+{
+  positions = normals = 0.;
+  for(int i = 0; i < (int)m1.vertices.size(); ++i)
+  {
+    positions = max(positions, (m1.vertices[i].pos - m2.vertices[i].pos).length());
+    normals = max(normals, (m1.vertices[i].normal - m2.vertices[i].normal).length());
+  }
+}
+
+
+double weightDifference(const Attachment &a1, const Attachment &a2, int vertices)
+{
+  double out = 0.;
+  for(int i = 0; i < vertices; ++i)
+  {
+    WeightRow w1 = a1.getWeights(i), w2 = a2.getWeights(i);
+    for(int j = 0; j < max(w1.size(), w2.size()); ++j)
+      out = max(out, fabs((j < w1.size() ? w1[j] : 0.) - (j < w2.size() ? w2[j] : 0.)));
+  }
+  return out;
+}
+
+
+//half the spacing of float16 values around v, the most rounding can move it
+double halfUlp(double v)
+{
+  int e;
+  if(fabs(v) < ldexp(1., -14))
+    return ldexp(1., -25);
+  frexp(v, &e);
+  return ldexp(1., e - 12);
+}
+
+
+//L-BFGS and the incremental evaluation against the original descent and the
+//full error sums, and the hand-written gradient against forward mode
+void checkRefinement(TreeType *distanceField, const Skeleton &skeleton, const vector<Vector3> &embedding)
+{
+  int i;
+  vector<Sphere> medialSurface = sampleMedialSurface(distanceField);
+  vector<Vector3> medialCenters(medialSurface.size());
+  for(i = 0; i < (int)medialSurface.size(); ++i)
+    medialCenters[i] = medialSurface[i].center;
+
+  //start a little off the embedding so that there is something to refine
+  vector<Vector3> initial = embedding;
+  for(i = 0; i < (int)initial.size(); ++i)
+    initial[i] += Vector3(sin(i * 1.7), cos(i * 2.3), sin(i * 0.9)) * 0.01;
+
+  RefineOptions options;
+  RefineStats lbfgs, lbfgsFull, descent, descentFull, medial;
+  options.method = RefineOptions::LBFGS;
+  options.checkGradient = true;
+  vector<Vector3> lbfgsOut = refineEmbedding(distanceField, medialCenters, initial, skeleton, options, &lbfgs);
+  options.checkGradient = false;
+  options.incremental = false;
+  vector<Vector3> lbfgsFullOut = refineEmbedding(distanceField, medialCenters, initial, skeleton, options, &lbfgsFull);
+  options.method = RefineOptions::DESCENT;
+  vector<Vector3> descentFullOut = refineEmbedding(distanceField, medialCenters, initial, skeleton, options, &descentFull);
+  options.incremental = true;
+  vector<Vector3> descentOut = refineEmbedding(distanceField, medialCenters, initial, skeleton, options, &descent);
+  options.method = RefineOptions::LBFGS;
+  options.medialField = true;
+  options.checkMedial = true;
+  refineEmbedding(distanceField, medialCenters, initial, skeleton, options, &medial);
+
+  cout << "Refinement (E = " << lbfgs.initialError << " at the start):" << endl;
+  checkResult("gradient vs forward mode derivatives (relative)", lbfgs.gradientError, 1e-9);
+  checkResult("L-BFGS E over the starting E", lbfgs.error - lbfgs.initialError, 0.);
+  checkResult("descent E over the starting E", descent.error - descent.initialError, 0.);
+  //not a check: L-BFGS can stop a little above descent, which is why
+  //descent is the default
+  cout << "  (L-BFGS E over descent E (relative): " << (lbfgs.error - descent.error) / descent.error << ")" << endl;
+  checkResult("L-BFGS incremental vs full sums (joints)", maxDifference(lbfgsOut, lbfgsFullOut), 1e-9);
+  checkResult("descent incremental vs full sums (joints)", maxDifference(descentOut, descentFullOut), 1e-9);
+  checkResult("medial field vs exact projection", medial.medialFieldError, 2. * options.medialTol);
+  checkResult("L-BFGS E with the medial field over E without (relative)", (medial.error - lbfgs.error) / lbfgs.error, 0.05);
+}
+
+
+//the supernodal factorization and its orderings against a dense Cholesky
+//factorization, the residual and each other, and PCG against them
+void checkSolvers(const Mesh &m)
+{
+  int i, j, k, c;
+  int nv = (int)m.vertices.size();
+
+  //the graph Laplacian of the mesh plus a little of the identity, lower
+  //triangle by rows
+  vector<set<int> > below(nv);
+  for(i = 0; i < (int)m.edges.size(); ++i)
+  {
+    int v1 = m.edges[m.edges[i].prev].vertex, v2 = m.edges[i].vertex;
+    below[max(v1, v2)].insert(min(v1, v2));
+  }
+  vector<double> degree(nv, 0.1);
+  for(i = 0; i < nv; ++i)
+    for(set<int>::iterator it = below[i].begin(); it != below[i].end(); ++it)
+      { degree[i] += 1.; degree[*it] += 1.; }
+  vector<vector<pair<int, double> > > rows(nv);
+  for(i = 0; i < nv; ++i)
+  {
+    for(set<int>::iterator it = below[i].begin(); it != below[i].end(); ++it)
+      rows[i].push_back(make_pair(*it, -1.));
+    rows[i].push_back(make_pair(i, degree[i]));
+  }
+
+  vector<double> b(nv);
+  for(i = 0; i < nv; ++i)
+    b[i] = 1. + sin(i * 0.37);
+  double bNorm = 0., xMax = 0.;
+  for(i = 0; i < nv; ++i)
+    bNorm += b[i] * b[i];
+  bNorm = sqrt(bNorm);
+
+  LLTMatrix *amd = SPDMatrix(rows).factor();
+  LLTMatrix *mmd = SPDMatrix(rows, SPDMatrix::ORDER_MMD).factor();
+  vector<double> x = b, xMMD = b;
+  amd->solve(x);
+  mmd->solve(xMMD);
+
+  vector<double> residual(b);
+  for(i = 0; i < nv; ++i)
+  {
+    for(j = 0; j < (int)rows[i].size(); ++j)
+    {
+      int col = rows[i][j].first;
+      residual[i] -= rows[i][j].second * x[col];
+      if(col != i)
+        residual[col] -= rows[i][j].second * x[i];
+    }
+  }
+  double rNorm = 0., mmdDiff = 0.;
+  for(i = 0; i < nv; ++i)
+  {
+    rNorm += residual[i] * residual[i];
+    mmdDiff = max(mmdDiff, fabs(x[i] - xMMD[i]));
+    xMax = max(xMax, fabs(x[i]));
+  }
+
+  cout << "Solvers (" << nv << " unknowns):" << endl;
+  checkResult("AMD factor residual (relative)", sqrt(rNorm) / bNorm, 1e-12);
+  checkResult("MMD vs AMD solution (relative)", mmdDiff / xMax, 1e-12);
+
+  //a corner of the matrix against a dense Cholesky factorization
+  int n = min(nv, 300);
+  vector<vector<pair<int, double> > > corner(n);
+  vector<double> dense(n * n, 0.), y(n);
+  for(i = 0; i < n; ++i)
+  {
+    for(j = 0; j < (int)rows[i].size(); ++j)
+    {
+      if(rows[i][j].first < n)
+      {
+        corner[i].push_back(rows[i][j]);
+        dense[i * n + rows[i][j].first] = rows[i][j].second;
+      }
+    }
+    y[i] = b[i];
+  }
+  for(j = 0; j < n; ++j)
+  {
+    for(k = 0; k < j; ++k)
+      dense[j * n + j] -= dense[j * n + k] * dense[j * n + k];
+    dense[j * n + j] = sqrt(dense[j * n + j]);
+    for(i = j + 1; i < n; ++i)
+    {
+      for(k = 0; k < j; ++k)
+        dense[i * n + j] -= dense[i * n + k] * dense[j * n + k];
+      dense[i * n + j] /= dense[j * n + j];
+    }
+  }
+  for(i = 0; i < n; ++i)
+  {
+    for(k = 0; k < i; ++k)
+      y[i] -= dense[i * n + k] * y[k];
+    y[i] /= dense[i * n + i];
+  }
+  for(i = n - 1; i >= 0; --i)
+  {
+    for(k = i + 1; k < n; ++k)
+      y[i] -= dense[k * n + i] * y[k];
+    y[i] /= dense[i * n + i];
+  }
+  LLTMatrix *cornerFactor = SPDMatrix(corner).factor();
+  vector<double> yCorner(b.begin(), b.begin() + n);
+  cornerFactor->solve(yCorner);
+  double denseDiff = 0., yMax = 0.;
+  for(i = 0; i < n; ++i)
+  {
+    denseDiff = max(denseDiff, fabs(y[i] - yCorner[i]));
+    yMax = max(yMax, fabs(y[i]));
+  }
+  checkResult("sparse vs dense Cholesky on a corner (relative)", denseDiff / yMax, 1e-12);
+  delete cornerFactor;
+
+  //several right hand sides at once against one at a time
+  const int rhs = 3;
+  vector<double> many(nv * rhs), one;
+  for(i = 0; i < nv; ++i)
+    for(c = 0; c < rhs; ++c)
+      many[i * rhs + c] = sin(i * (c + 1) * 0.1);
+  amd->solveMany(many, rhs);
+  double manyDiff = 0.;
+  for(c = 0; c < rhs; ++c)
+  {
+    one.resize(nv);
+    for(i = 0; i < nv; ++i)
+      one[i] = sin(i * (c + 1) * 0.1);
+    amd->solve(one);
+    for(i = 0; i < nv; ++i)
+      manyDiff = max(manyDiff, fabs(one[i] - many[i * rhs + c]));
+  }
+  checkResult("solveMany vs solve", manyDiff, 1e-14);
+
+  //the same pattern with other values, reusing the analysis
+  vector<vector<pair<int, double> > > shifted = rows;
+  for(i = 0; i < nv; ++i)
+    shifted[i].back().second += 1. + (i % 3);
+  SymbolicFactor *symbolic = SPDMatrix(rows).analyze();
+  LLTMatrix *reused = SPDMatrix(shifted).factor(*symbolic);
+  LLTMatrix *fresh = SPDMatrix(shifted).factor();
+  vector<double> xReused = b, xFresh = b;
+  reused->solve(xReused);
+  fresh->solve(xFresh);
+  double reuseDiff = 0.;
+  for(i = 0; i < nv; ++i)
+    reuseDiff = max(reuseDiff, fabs(xReused[i] - xFresh[i]));
+  checkResult("reused analysis vs new factorization", reuseDiff, 1e-14);
+  delete reused;
+  delete fresh;
+  delete symbolic;
+
+  const char *names[2] = { "PCG (IC0) vs factor (relative)", "PCG (Jacobi) vs factor (relative)" };
+  int preconditioners[2] = { PCGSolver::IC0, PCGSolver::JACOBI };
+  for(c = 0; c < 2; ++c)
+  {
+    PCGSolver pcg(SparseLower(rows), preconditioners[c]);
+    vector<double> xPCG(nv, 0.);
+    double pcgDiff = HUGE_VAL;
+    if(pcg.solve(b, xPCG, 1e-12, 10000) >= 0)
+    {
+      pcgDiff = 0.;
+      for(i = 0; i < nv; ++i)
+        pcgDiff = max(pcgDiff, fabs(x[i] - xPCG[i]));
+    }
+    checkResult(names[c], pcgDiff / xMax, 1e-9);
+  }
+
+  delete amd;
+  delete mmd;
+}
+
+
+//PCG, Attachment::update, the weight file and limitInfluences against
+//weights computed directly
+void checkWeights(const Mesh &m, const Skeleton &skeleton, const vector<Vector3> &embedding,
+  const VisibilityTester *tester, const Attachment &direct, const AttachmentParams &directParams)
+{
+  int i, j;
+  int nv = (int)m.vertices.size();
+  cout << "Attachment weights:" << endl;
+
+  AttachmentParams params = directParams;
+  params.solver = AttachmentParams::PCG;
+  params.tolerance = 1e-10;
+  params.maxIterations = 10000;
+  Attachment pcg(m, skeleton, embedding, tester, params);
+  checkResult("PCG vs direct", weightDifference(pcg, direct, nv), 1e-5);
+
+  //move a joint in the middle of the skeleton and one of its children
+  int joint = (int)embedding.size() / 2, child = -1;
+  for(i = joint + 1; i < (int)embedding.size() && child < 0; ++i)
+    if(skeleton.fPrev()[i] == joint)
+      child = i;
+  vector<int> changed(1, joint);
+  vector<Vector3> moved = embedding;
+  moved[joint] += Vector3(0.005, -0.003, 0.002);
+  if(child >= 0)
+  {
+    changed.push_back(child);
+    moved[child] += Vector3(-0.004, 0.002, 0.003);
+  }
+  params = directParams;
+  params.updatable = true;
+  Attachment updated(m, skeleton, embedding, tester, params);
+  bool ok = updated.update(changed, moved, tester);
+  Attachment recomputed(m, skeleton, moved, tester, directParams);
+  checkResult("update vs new attachment", ok ? weightDifference(updated, recomputed, nv) : HUGE_VAL, 1e-9);
+
+  const string filename = "selfcheck.weights";
+  double mismatches = HUGE_VAL;
+  if(direct.writeWeights(filename, m))
+  {
+    Attachment loaded(m, filename);
+    SkinWeights w1 = direct.getSkinWeights(), w2 = loaded.getSkinWeights();
+    if(w1.vertices == w2.vertices && w1.bones == w2.bones)
+    {
+      mismatches = 0.;
+      for(i = 0; i <= w1.vertices; ++i)
+        mismatches += w1.offsets[i] != w2.offsets[i];
+      for(i = 0; mismatches == 0. && i < (int)w1.offsets[w1.vertices]; ++i)
+        mismatches += w1.boneIds[i] != w2.boneIds[i] || w1.weights[i] != w2.weights[i];
+    }
+  }
+  remove(filename.c_str());
+  checkResult("weight file round trip (mismatches)", mismatches, 0.);
+
+  const int cap = 4;
+  Attachment limited = direct;
+  limited.limitInfluences(cap);
+  SkinWeights w = limited.getSkinWeights();
+  double over = 0., sumError = 0.;
+  for(i = 0; i < w.vertices; ++i)
+  {
+    double sum = 0.;
+    for(j = w.offsets[i]; j < (int)w.offsets[i + 1]; ++j)
+      sum += w.weights[j];
+    over += (int)(w.offsets[i + 1] - w.offsets[i]) > cap;
+    if(w.offsets[i + 1] > w.offsets[i])
+      sumError = max(sumError, fabs(sum - 1.));
+  }
+  checkResult("limitInfluences vertices over the cap", over, 0.);
+  checkResult("limitInfluences weight sums", sumError, 1e-6);
+}
+
+
+//skin, its pooled, dirty range and crowd versions, the float32 kernels and
+//the point cache against straightforward per-vertex skinning
+void checkSkinning(const Mesh &m, const Skeleton &skeleton, const vector<Vector3> &embedding,
+  const Attachment &attachment)
+{
+  int i, j, a, f;
+  int nv = (int)m.vertices.size();
+  SkinWeights w = attachment.getSkinWeights();
+  vector<Transform<> > transforms = bendBones(skeleton, embedding, 0.3);
+  double positions, normals, positions2, normals2;
+  cout << "Skinning:" << endl;
+
+  Mesh rest = m;
+  rest.algo = Mesh::LBS;
+  Mesh reference = rest;
+  for(i = 0; i < nv; ++i)
+  {
+    Vector3 p;
+    for(j = w.offsets[i]; j < (int)w.offsets[i + 1]; ++j)
+      p += (transforms[w.boneIds[j]] * rest.vertices[i].pos) * w.weights[j];
+    reference.vertices[i].pos = p;
+  }
+  reference.computeVertexNormals();
+
+  SkinningContext context(transforms), pooled(transforms);
+  context.setParallelThreshold(INT_MAX);
+  pooled.setParallelThreshold(0);
+  Mesh out = rest, outPooled = rest;
+  skin(rest, w, context, DeformTarget(out));
+  skin(rest, w, pooled, DeformTarget(outPooled));
+  meshDifference(out, reference, positions, normals);
+  checkResult("skin LBS vs per-vertex sums (positions)", positions, 1e-12);
+  checkResult("skin LBS vs computeVertexNormals (normals)", normals, 1e-12);
+  meshDifference(out, outPooled, positions, normals);
+  checkResult("skin on the pool vs one thread", max(positions, normals), 1e-12);
+
+  //a frame that moves two bones, redone from the dirty ranges
+  SkinningContext posing;
+  posing.setInfluences(rest, w);
+  posing.setParallelThreshold(INT_MAX);
+  posing.setTransforms(transforms);
+  Mesh changedOut;
+  attachment.deformChanged(rest, posing, changedOut);
+  vector<Transform<> > next = transforms;
+  for(i = 0; i < (int)next.size() && i < 2; ++i)
+    next[i * (next.size() / 2)] = Transform<>(Quaternion<>(Vector3(0., 1., 0.), 0.2)) * next[i * (next.size() / 2)];
+  posing.setTransforms(next);
+  attachment.deformChanged(rest, posing, changedOut);
+  context.setTransforms(next);
+  skin(rest, w, context, DeformTarget(out));
+  meshDifference(changedOut, out, positions, normals);
+  checkResult("deformChanged vs skin", max(positions, normals), 1e-12);
+
+  //a crowd against one instance at a time
+  const int instances = 8;
+  vector<SkinningContext> poses(instances);
+  vector<Mesh> crowd(instances, rest);
+  vector<DeformTarget> targets(instances);
+  for(a = 0; a < instances; ++a)
+  {
+    vector<Transform<> > pose = bendBones(skeleton, embedding, 0.1 * a);
+    poses[a].setTransforms(pose);
+    poses[a].setParallelThreshold(0);
+    targets[a] = DeformTarget(crowd[a]);
+  }
+  attachment.deformInstances(rest, poses, targets);
+  positions = normals = 0.;
+  for(a = 0; a < instances; ++a)
+  {
+    context.setTransforms(bendBones(skeleton, embedding, 0.1 * a));
+    skin(rest, w, context, DeformTarget(out));
+    meshDifference(crowd[a], out, positions2, normals2);
+    positions = max(positions, positions2);
+    normals = max(normals, normals2);
+  }
+  checkResult("deformInstances vs skin", max(positions, normals), 1e-12);
+
+  //the float32 kernels against skinned normals in double
+  context.setTransforms(transforms);
+  const char *algoNames[3] = { "LBS", "DQS", "MIX" };
+  int algos[3] = { Mesh::LBS, Mesh::DQS, Mesh::MIX };
+  for(a = 0; a < 3; ++a)
+  {
+    Mesh algoRest = rest;
+    algoRest.algo = algos[a];
+    algoRest.blendWeight = 0.5f;
+    PackedSkin packed(algoRest, w);
+    double maxError, rmsError, maxAngle;
+    string name = string("packed ") + algoNames[a] + " scalar vs double";
+    floatError(algoRest, attachment, packed, context, PackedSkin::SCALAR, maxError, rmsError, maxAngle);
+    checkResult((name + " (positions)").c_str(), maxError, 1e-5);
+    checkResult((name + " (normals, radians)").c_str(), maxAngle, 1e-5);
+
+    vector<float> scalar(6 * nv), simd(6 * nv);
+    packed.deform(context, &scalar[0], &scalar[nv], &scalar[2 * nv], &scalar[3 * nv], &scalar[4 * nv],
+      &scalar[5 * nv], PackedSkin::SCALAR);
+    if(PackedSkin::hasAVX2())
+    {
+      packed.deform(context, &simd[0], &simd[nv], &simd[2 * nv], &simd[3 * nv], &simd[4 * nv],
+        &simd[5 * nv], PackedSkin::AVX2);
+      double simdDiff = 0.;
+      for(i = 0; i < 6 * nv; ++i)
+        simdDiff = max(simdDiff, fabs((double)scalar[i] - simd[i]));
+      checkResult((string("packed ") + algoNames[a] + " AVX2 vs scalar").c_str(), simdDiff, 1e-6);
+    }
+
+    vector<float> instancesOut((size_t)instances * 3 * nv), instanceNormals((size_t)instances * 3 * nv);
+    packed.deformInstances(poses, &instancesOut[0], &instanceNormals[0]);
+    double instanceDiff = 0.;
+    for(j = 0; j < instances; ++j)
+    {
+      float *p = &instancesOut[(size_t)j * 3 * nv], *n = &instanceNormals[(size_t)j * 3 * nv];
+      packed.deform(poses[j], &scalar[0], &scalar[nv], &scalar[2 * nv], &scalar[3 * nv], &scalar[4 * nv],
+        &scalar[5 * nv]);
+      for(i = 0; i < 3 * nv; ++i)
+        instanceDiff = max(instanceDiff, max(fabs((double)p[i] - scalar[i]), fabs((double)n[i] - scalar[3 * nv + i])));
+    }
+    checkResult((string("packed ") + algoNames[a] + " deformInstances vs deform").c_str(), instanceDiff, 0.);
+  }
+
+  //a clip baked as float, half and half deltas, read back against skin
+  const int frames = 12;
+  vector<vector<Transform<> > > clip(frames);
+  vector<vector<float> > expected(frames, vector<float>(6 * nv));
+  for(f = 0; f < frames; ++f)
+  {
+    clip[f] = bendBones(skeleton, embedding, 0.03 * f);
+    context.setTransforms(clip[f]);
+    skin(rest, w, context, DeformTarget(out));
+    for(i = 0; i < nv; ++i)
+    {
+      for(j = 0; j < 3; ++j)
+      {
+        expected[f][i * 3 + j] = (float)out.vertices[i].pos[j];
+        expected[f][3 * nv + i * 3 + j] = (float)out.vertices[i].normal[j];
+      }
+    }
+  }
+  const string filename = "selfcheck.pinc";
+  const char *cacheNames[3] = { "point cache float vs skin", "point cache half vs skin (over half an ulp)",
+    "point cache half deltas vs skin (over half an ulp)" };
+  int cacheFlags[3] = { 0, PointCacheWriter::HALF, PointCacheWriter::HALF | PointCacheWriter::DELTA };
+  for(a = 0; a < 3; ++a)
+  {
+    double excess = HUGE_VAL;
+    if(bakePointCache(filename, rest, attachment, clip, cacheFlags[a] | PointCacheWriter::NORMALS))
+    {
+      PointCache cache;
+      vector<float> decoded(6 * nv), previous;
+      if(cache.open(filename, &rest) && cache.frames() == frames)
+      {
+        excess = 0.;
+        for(f = 0; f < frames; ++f)
+        {
+          cache.readFrame(f, &decoded[0], &decoded[3 * nv]);
+          for(i = 0; i < 6 * nv; ++i)
+          {
+            double value = expected[f][i], bound = 0.;
+            if(cacheFlags[a] & PointCacheWriter::HALF)
+              bound = halfUlp(value);
+            //a delta is rounded from the float difference to the last frame read
+            if((cacheFlags[a] & PointCacheWriter::DELTA) && f > 0 && i < 3 * nv)
+              bound = halfUlp(value - previous[i]) + fabs(value) * ldexp(1., -23);
+            excess = max(excess, fabs(decoded[i] - value) - bound);
+          }
+          previous = decoded;
+        }
+      }
+    }
+    remove(filename.c_str());
+    checkResult(cacheNames[a], excess, 0.);
+  }
+
+  //float16 rounding over the whole range, positive and negative
+  int count = 3 * nv;
+  vector<float> values(count), decoded(count);
+  for(i = 0; i < count; ++i)
+    values[i] = (float)((i % 2 ? -1. : 1.) * exp2(-26. + 41.9 * i / count));
+  double excess = HUGE_VAL;
+  {
+    PointCacheWriter writer;
+    if(writer.open(filename, rest, PointCacheWriter::HALF) && writer.writeFrame(&values[0]) && writer.close())
+    {
+      PointCache cache;
+      if(cache.open(filename, &rest) && cache.readFrame(0, &decoded[0]))
+      {
+        excess = 0.;
+        for(i = 0; i < count; ++i)
+          excess = max(excess, fabs((double)decoded[i] - values[i]) - halfUlp(values[i]));
+      }
+    }
+  }
+  remove(filename.c_str());
+  checkResult("float16 round trip (over half an ulp)", excess, 0.);
+}
+
+
+//runs every check, returns false if any of them failed
+bool selfCheck(const Mesh &m, const Skeleton &skeleton, const vector<Vector3> &embedding, double stiffness)
+{
+  checkFailures = 0;
+  TreeType *distanceField = constructDistanceField(m);
+  VisTester<TreeType> *tester = new VisTester<TreeType>(distanceField);
+
+  checkRefinement(distanceField, skeleton, embedding);
+  checkSolvers(m);
+
+  AttachmentParams params;
+  params.heatWeight = stiffness;
+  Attachment direct(m, skeleton, embedding, tester, params);
+  checkWeights(m, skeleton, embedding, tester, direct, params);
+  checkSkinning(m, skeleton, embedding, direct);
+
+  delete tester;
+  delete distanceField;
+
+  if(checkFailures > 0)
+    cout << checkFailures << " self checks FAILED" << endl;
+  else
+    cout << "All self checks passed" << endl;
+  return checkFailures == 0;
+}
+
+
 void process(const vector<string> &args)
 {
   int i;
@@ -208,7 +1014,12 @@ void process(const vector<string> &args)
     for(i = 0; i < (int)o.embedding.size(); ++i)
       o.embedding[i] = m.toAdd + o.embedding[i] * m.scale;
 
-    o.attachment = new Attachment(m, a.skeleton, o.embedding, tester, a.stiffness);
+    AttachmentParams params;
+    params.heatWeight = a.stiffness;
+    if(a.pcg)
+      params.solver = AttachmentParams::PCG;
+    params.tolerance = a.tolerance;
+    o.attachment = new Attachment(m, a.skeleton, o.embedding, tester, params);
 
     delete tester;
     delete distanceField;
@@ -221,6 +1032,7 @@ void process(const vector<string> &args)
   }
 
   //output skeleton embedding
+  vector<Vector3> meshEmbedding = o.embedding;
   for(i = 0; i < (int)o.embedding.size(); ++i)
     o.embedding[i] = (o.embedding[i] - m.toAdd) / m.scale;
   ofstream os(a.skelOutName.c_str());
@@ -230,11 +1042,23 @@ void process(const vector<string> &args)
       " " << o.embedding[i][2] << " " << a.skeleton.fPrev()[i] << endl;
   }
 
+  if(a.maxInfluences > 0)
+    o.attachment->limitInfluences(a.maxInfluences);
+
+  if(a.benchSkin)
+    benchSkinning(m, a.skeleton, meshEmbedding, *o.attachment);
+
+  if(a.selfCheck && !selfCheck(m, given, meshEmbedding, a.stiffness))
+  {
+    delete o.attachment;
+    exit(1);
+  }
+
   //output attachment
   std::ofstream astrm(a.weightOutName.c_str());
   for(i = 0; i < (int)m.vertices.size(); ++i)
   {
-    Vector<double, -1> v = o.attachment->getWeights(i);
+    WeightRow v = o.attachment->getWeights(i);
     for(int j = 0; j < v.size(); ++j)
     {
       double d = floor(0.5 + v[j] * 10000.) / 10000.;
@@ -243,6 +1067,9 @@ void process(const vector<string> &args)
     astrm << endl;
   }
 
+  if(a.binaryWeightOutName.size() > 0 && !o.attachment->writeWeights(a.binaryWeightOutName, m))
+    cout << "Could not write " << a.binaryWeightOutName << endl;
+
   delete o.attachment;
 }
 
@@ -24,6 +24,7 @@ THE SOFTWARE.
 #define DISPLAYMESH_H_CCB0E12A_4190_11E9_BF66_EB91561F8FE5
 
 #include "pin_mesh.h"
+#include "pointcache.h"
 
 class DisplayMesh
 {
@@ -45,4 +46,53 @@ class StaticDisplayMesh : public DisplayMesh
     Pinocchio::Mesh m;
 };
 
+//plays back a baked point cache: the frames are copied into the mesh as
+//they are, without any skinning
+class CachedDisplayMesh : public DisplayMesh
+{
+  public:
+    CachedDisplayMesh(const Pinocchio::Mesh &inM, const std::string &filename) : m(inM), frame(-1)
+    {
+      if(cache.open(filename, &m))
+      {
+        positions.resize(m.vertices.size() * 3);
+        normals.resize(cache.flags() & Pinocchio::PointCacheWriter::NORMALS ? positions.size() : 0);
+      }
+    }
+
+    bool isOpen() const { return cache.frames() > 0; }
+
+    virtual const Pinocchio::Mesh &getMesh(int &framenum)
+    {
+      int i;
+      if(!isOpen())
+        return m;
+      frame = (frame + 1) % cache.frames();
+      framenum = frame;
+
+      //key frames of float caches are used straight from the file
+      const float *p = cache.positions(frame), *n = cache.normals(frame);
+      if(p == NULL || (n == NULL && !normals.empty()))
+      {
+        cache.readFrame(frame, &positions[0], normals.empty() ? NULL : &normals[0]);
+        p = &positions[0];
+        n = normals.empty() ? NULL : &normals[0];
+      }
+      for(i = 0; i < (int)m.vertices.size(); ++i)
+        m.vertices[i].pos = Vector3(p[i * 3], p[i * 3 + 1], p[i * 3 + 2]);
+      if(n)
+        for(i = 0; i < (int)m.vertices.size(); ++i)
+          m.vertices[i].normal = Vector3(n[i * 3], n[i * 3 + 1], n[i * 3 + 2]);
+      else
+        m.computeVertexNormals();
+      return m;
+    }
+  private:
+
+    Pinocchio::Mesh m;
+    Pinocchio::PointCache cache;
+    std::vector<float> positions, normals;
+    int frame;
+};
+
 #endif // DISPLAYMESH_H_CCB0E12A_4190_11E9_BF66_EB91561F8FE5
@@ -23,6 +23,7 @@ THE SOFTWARE.
 #include "defmesh.h"
 #include "motion.h"
 #include "../Pinocchio/intersector.h"
+#include "../Pinocchio/pointcache.h"
 
 using namespace Pinocchio;
 
@@ -81,7 +82,7 @@ std::vector<Transform<> > DefMesh::computeTransforms() const
 
 bool reallyDeform = true;
 
-void DefMesh::updateMesh(int &framenum) const
+std::vector<Transform<> > DefMesh::poseTransforms(int &framenum, MotionFilter &stepFilter) const
 {
   std::vector<Transform<> > t = computeTransforms();
 
@@ -140,9 +141,21 @@ void DefMesh::updateMesh(int &framenum) const
     Debugging::drawLine(feet[1], feet[1] - offs2, QPen(Qt::red));
     #endif
 
-    filter.step(t, feet);
+    stepFilter.step(t, feet);
+    return stepFilter.getTransforms();
+  }
+  return t;
+}
+
+
+void DefMesh::updateMesh(int &framenum) const
+{
+  std::vector<Transform<> > t = poseTransforms(framenum, filter);
+
+  if(motion)
+  {
     if(reallyDeform)
-      curMesh = attachment.deform(origMesh, filter.getTransforms());
+      attachment.deform(origMesh, t, curMesh);
 
     #if 0
     static int period = 1;
@@ -158,7 +171,29 @@ void DefMesh::updateMesh(int &framenum) const
     #endif
   }
   else
-    curMesh = attachment.deform(origMesh, t);
+    attachment.deform(origMesh, t, curMesh);
+}
+
+
+bool DefMesh::bake(const std::string &filename, int flags) const
+{
+  if(!motion)
+    return false;
+
+  //the filter carries over from frame to frame, so the poses are worked out
+  //in order before the frames are skinned all at once.  They go through a
+  //filter of their own, which leaves the one being played back alone.
+  int framenum;
+  MotionFilter bakeFilter(match, origSkel.fPrev());
+  std::vector<std::vector<Transform<> > > frames(motion->getData().size());
+  for(int i = 0; i < (int)frames.size(); ++i)
+  {
+    motion->setFixedFrame(i);
+    frames[i] = poseTransforms(framenum, bakeFilter);
+  }
+  motion->setFixedFrame(-1);
+
+  return bakePointCache(filename, origMesh, attachment, frames, flags);
 }
 
 
@@ -49,6 +49,10 @@ class DefMesh : public DisplayMesh
 
     const Pinocchio::Attachment &getAttachment() const { return attachment; }
 
+    //skins every frame of the motion into a point cache file (see
+    //pointcache.h), returns false without a motion or on error
+    bool bake(const std::string &filename, int flags) const;
+
     const Pinocchio::Mesh &getMesh(int &framenum) {
       updateMesh(framenum);
       return curMesh;
@@ -57,6 +61,9 @@ class DefMesh : public DisplayMesh
   private:
     double getLegRatio() const;
     std::vector<Pinocchio::Transform<> > computeTransforms() const;
+    //the transforms to deform with for the current frame, stepping
+    //stepFilter with a motion
+    std::vector<Pinocchio::Transform<> > poseTransforms(int &framenum, MotionFilter &stepFilter) const;
     void updateMesh(int &framenum) const;
 
     Pinocchio::Skeleton origSkel;
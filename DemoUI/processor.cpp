@@ -29,6 +29,7 @@ THE SOFTWARE.
 #include "../Pinocchio/debugging.h"
 #include "../Pinocchio/attachment.h"
 #include "../Pinocchio/pinocchioApi.h"
+#include "../Pinocchio/pointcache.h"
 #include "defmesh.h"
 #include "motion.h"
 
@@ -37,7 +38,7 @@ using namespace Pinocchio;
 struct ArgData {
   ArgData() :
   stopAtMesh(false), stopAfterCircles(false), skelScale(1.), noFit(false),
-    skeleton(HumanSkeleton())
+    skeleton(HumanSkeleton()), cacheFlags(PointCacheWriter::NORMALS)
   {
   }
 
@@ -54,6 +55,10 @@ struct ArgData {
   int skinAlgorithm;
   // Indicates the blending weight for MIX algorithm
   float blendWeight;
+  // Point cache to bake the motion into, or to play instead of rigging
+  std::string bakename;
+  std::string playname;
+  int cacheFlags;
 };
 
 
@@ -63,6 +68,7 @@ void printUsageAndExit() {
   std::cout << "              [-meshonly | -mo] [-circlesonly | -co]" << std::endl;
   std::cout << "              [-motion motionname] [-nofit]" << std::endl;
   std::cout << "              [-algo skinning_algorithm [blend_weight]]" << std::endl;
+  std::cout << "              [-bake cachename [-half] [-delta]] [-play cachename]" << std::endl;
 
   exit(0);
 }
@@ -150,6 +156,26 @@ ArgData processArgs(const std::vector<std::string> &args)
       }
       out.motionname = args[cur++];
     }
+    else if(curStr == std::string("-bake") || curStr == std::string("-play"))
+    {
+      if(cur == num)
+      {
+        std::cout << "No point cache filename specified; ignoring." << std::endl;
+        continue;
+      }
+      if(curStr == std::string("-bake"))
+        out.bakename = args[cur++];
+      else
+        out.playname = args[cur++];
+    }
+    else if(curStr == std::string("-half"))
+    {
+      out.cacheFlags |= PointCacheWriter::HALF;
+    }
+    else if(curStr == std::string("-delta"))
+    {
+      out.cacheFlags |= PointCacheWriter::DELTA;
+    }
     else if (curStr == std::string("-algo"))
     {
       /*  Option to use a different skinning algorithm than the
@@ -219,6 +245,19 @@ void process(const std::vector<std::string> &args, MyWindow *w)
     return;
   }
 
+  //play a baked motion back without rigging
+  if(a.playname.size() > 0)
+  {
+    CachedDisplayMesh *cached = new CachedDisplayMesh(m, a.playname);
+    if(!cached->isOpen())
+    {
+      std::cout << "Error reading point cache.  Aborting." << std::endl;
+      exit(0);
+    }
+    w->addMesh(cached);
+    return;
+  }
+
   PinocchioOutput o;
   //do everything
   if(!a.noFit)
@@ -249,8 +288,16 @@ void process(const std::vector<std::string> &args, MyWindow *w)
 
   if(a.motionname.size() > 0)
   {
-    w->addMesh(new DefMesh(m, given, o.embedding, *(o.attachment),
-      new Motion(a.motionname)));
+    DefMesh *defMesh = new DefMesh(m, given, o.embedding, *(o.attachment),
+      new Motion(a.motionname));
+    if(a.bakename.size() > 0)
+    {
+      if(defMesh->bake(a.bakename, a.cacheFlags))
+        std::cout << "Baked the motion into " << a.bakename << std::endl;
+      else
+        std::cout << "Error baking the motion" << std::endl;
+    }
+    w->addMesh(defMesh);
   }
   else
   {
@@ -276,7 +323,7 @@ void process(const std::vector<std::string> &args, MyWindow *w)
   std::ofstream astrm("attachment.out");
   for(i = 0; i < (int)m.vertices.size(); ++i)
   {
-    Vector<double, -1> v = o.attachment->getWeights(i);
+    WeightRow v = o.attachment->getWeights(i);
     for(int j = 0; j < v.size(); ++j)
     {
       double d = floor(0.5 + v[j] * 10000.) / 10000.;
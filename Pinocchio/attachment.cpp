@@ -18,9 +18,16 @@
 
 #include <fstream>
 #include <sstream>
+#include <chrono>
+#include <cstring>
 #include "attachment.h"
 #include "vecutils.h"
 #include "lsqSolver.h"
+#include "threadpool.h"
+#include "meshcache.h"
+#include "meshoperators.h"
+#include "mappedfile.h"
+#include "debugging.h"
 
 namespace Pinocchio {
 
@@ -29,411 +36,865 @@ class AttachmentPrivate
   public:
     AttachmentPrivate() {}
     virtual ~AttachmentPrivate() {}
-    virtual Mesh deform(const Mesh &mesh,
-      const std::vector<Transform<> > &transforms) const = 0;
-    virtual Vector<double, -1> getWeights(int i) const = 0;
+    virtual SkinWeights getSkinWeights() const = 0;
+    virtual void limitInfluences(int maxInfluences) = 0;
+    virtual bool update(const std::vector<int> &changedJoints,
+      const std::vector<Vector3> &newEmbedding, const VisibilityTester *tester) = 0;
     virtual AttachmentPrivate *clone() const = 0;
 };
 
-bool vectorInCone(const Vector3 &v, const std::vector<Vector3> &ns)
+static double secondsSince(const std::chrono::steady_clock::time_point &start)
+{
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+
+//Binary weight file: the header, then the vertices + 1 offsets, the weights
+//and the bone ids of the CSR matrix, in native byte order.  The arrays are
+//in order of decreasing alignment so that a mapped file can be used in place.
+struct WeightFileHeader {
+  char magic[4]; //"PINW"
+  unsigned int version;
+  unsigned int vertices;
+  unsigned int bones;
+  unsigned int influences;
+  unsigned int reserved;
+  unsigned long long meshHash; //Mesh::topologyHash() of the mesh it was computed for
+};
+
+static const char weightFileMagic[4] = { 'P', 'I', 'N', 'W' };
+static const unsigned int weightFileVersion = 1;
+
+static size_t weightFileSize(size_t vertices, size_t influences)
+{
+  return sizeof(WeightFileHeader) + (vertices + 1) * sizeof(unsigned int)
+    + influences * (sizeof(float) + sizeof(unsigned short));
+}
+
+
+//whether the offsets of a weight file (of the size its header says) start
+//at 0 and never decrease, and every bone id is in range, so that skinning
+//with it stays inside the arrays and the palette
+static bool validWeights(const WeightFileHeader *header, const unsigned int *offsets)
+{
+  unsigned int i;
+  if(offsets[0] != 0)
+    return false;
+  for(i = 0; i < header->vertices; ++i)
+    if(offsets[i + 1] < offsets[i])
+      return false;
+  const unsigned short *boneIds = (const unsigned short *)((const float *)(offsets + header->vertices + 1)
+    + header->influences);
+  for(i = 0; i < header->influences; ++i)
+    if(boneIds[i] >= header->bones)
+      return false;
+  return true;
+}
+
+
+//whether v is within 60 degrees of the average of the face normals
+//around a vertex (given as their sum)
+bool vectorInCone(const Vector3 &v, const Vector3 &normalSum)
+{
+  return v.normalize() * normalSum.normalize() > 0.5;
+}
+
+
+//Everything the weights are solved from.  The constructor builds one and
+//keeps it if AttachmentParams::updatable is set, so that update() can redo
+//only the part that moving some joints changes.
+struct AttachmentState
+{
+  AttachmentParams params;
+  int bones;
+  std::vector<int> fPrev;
+  std::vector<Vector3> match;
+  std::vector<Vector3> positions;
+  //sum of the face normals around each vertex, for the visibility cone
+  std::vector<Vector3> normalSums;
+  std::shared_ptr<const MeshOperators> ops;
+  std::shared_ptr<SymbolicFactor> symbolic;
+
+  //distance from each vertex to each bone, and whether the bone is
+  //visible from it (only set for the nearest bones), vertex by vertex
+  std::vector<double> boneDists;
+  std::vector<char> boneVis;
+  std::vector<int> closest;
+
+  //We have -Lw+Hw=HI, same as (H-L)w=HI, with (H-L)=DA (with
+  //D=diag(1./area)) so w = A^-1 (HI/D)
+  std::vector<double> D, H;
+
+  //(vertex, weight) of each bone, before normalization
+  std::vector<std::vector<std::pair<int, double> > > boneWeights;
+
+  //direct solver: the factor of A for the heat factorH, which may be
+  //older than H (see solveDirect)
+  std::shared_ptr<const LLTMatrix> factor;
+  std::vector<double> factorH;
+
+  //the heat of each bone: only the nearest visible bones heat a vertex
+  bool isSource(int v, int b) const
+  {
+    return boneVis[v * bones + b] && boneDists[v * bones + b] <= boneDists[v * bones + closest[v]] * 1.00001;
+  }
+
+  //finds the closest bone of vertex v and the heat there
+  void computeHeat(int v)
+  {
+    int j;
+    const double *dists = &boneDists[v * bones];
+    double minDist = 1e37;
+
+    closest[v] = -1;
+    H[v] = 0.;
+    for(j = 0; j < bones; ++j)
+    {
+      if(dists[j] < minDist)
+      {
+        closest[v] = j;
+        minDist = dists[j];
+      }
+    }
+    for(j = 0; j < bones; ++j)
+      if(boneVis[v * bones + j] && dists[j] <= minDist * 1.00001)
+        H[v] += params.heatWeight / SQR(1e-8 + dists[closest[v]]);
+  }
+
+  //lower triangle of A for the heat h: the laplacian plus h/D on the
+  //diagonal, which is the last entry of each row
+  SparseLower system(const std::vector<double> &h) const
+  {
+    int i;
+    SparseLower A(ops->laplacian);
+    for(i = 0; i < A.size(); ++i)
+      A.val[A.rowStart[i + 1] - 1] += h[i] / D[i];
+    return A;
+  }
+};
+
+//a ray from a vertex to the closest point of a nearby bone
+struct VisQuery
+{
+  int vertex, bone;
+  Vector3 from, to;
+};
+
+//traces the rays against the distance field in batches and sets the visibility
+static void traceQueries(const std::vector<std::vector<VisQuery> > &chunkQueries,
+  const VisibilityTester *tester, AttachmentState &st)
 {
   int i;
-  Vector3 avg;
-  for(i = 0; i < (int)ns.size(); ++i)
-    avg += ns[i];
+  const int chunk = 256;
+  std::vector<VisQuery> queries;
+  for(i = 0; i < (int)chunkQueries.size(); ++i)
+    queries.insert(queries.end(), chunkQueries[i].begin(), chunkQueries[i].end());
+
+  int nq = queries.size();
+  std::vector<Vector3> from(nq), to(nq);
+  std::vector<char> seen(nq);
+  for(i = 0; i < nq; ++i)
+  {
+    from[i] = queries[i].from;
+    to[i] = queries[i].to;
+  }
+  ThreadPool::global().parallelFor((nq + chunk - 1) / chunk, [&](int c)
+  {
+    int q0 = c * chunk;
+    tester->canSeeMany(&from[q0], &to[q0], std::min(chunk, nq - q0), &seen[q0]);
+  });
+  for(i = 0; i < nq; ++i)
+    st.boneVis[queries[i].vertex * st.bones + queries[i].bone] = seen[i];
+}
+
+//dense LU with partial pivoting of the n x n row-major matrix a, in place
+static void luFactor(std::vector<double> &a, int n, std::vector<int> &pivots)
+{
+  int i, j, k;
+  pivots.resize(n);
+  for(k = 0; k < n; ++k)
+  {
+    int p = k;
+    for(i = k + 1; i < n; ++i)
+      if(fabs(a[i * n + k]) > fabs(a[p * n + k]))
+        p = i;
+    pivots[k] = p;
+    if(p != k)
+      for(j = 0; j < n; ++j)
+        std::swap(a[k * n + j], a[p * n + j]);
+    if(a[k * n + k] == 0.)
+      continue;
+    for(i = k + 1; i < n; ++i)
+    {
+      double f = (a[i * n + k] /= a[k * n + k]);
+      for(j = k + 1; j < n; ++j)
+        a[i * n + j] -= f * a[k * n + j];
+    }
+  }
+}
+
+static void luSolve(const std::vector<double> &a, int n, const std::vector<int> &pivots, double *x)
+{
+  int i, j;
+  for(i = 0; i < n; ++i)
+  {
+    std::swap(x[i], x[pivots[i]]);
+    for(j = 0; j < i; ++j)
+      x[i] -= a[i * n + j] * x[j];
+  }
+  for(i = n - 1; i >= 0; --i)
+  {
+    for(j = i + 1; j < n; ++j)
+      x[i] -= a[i * n + j] * x[j];
+    if(a[i * n + i] != 0.)
+      x[i] /= a[i * n + i];
+  }
+}
+
+//factors A for the current heat, reusing the symbolic factorization if it fits
+static bool factorSystem(AttachmentState &st, FactorStats *stats)
+{
+  SparseLower A = st.system(st.H);
+  SPDMatrix Am(A);
+  if(!st.symbolic || !st.symbolic->matches(A))
+    st.symbolic.reset(Am.analyze());
+  st.factor.reset(Am.factor(*st.symbolic, stats));
+  if(!st.factor)
+    return false;
+  st.factorH = st.H;
+  return true;
+}
+
+//Solves for the weights of the given bones with the direct factor.  If the
+//heat changed at some vertices since the factorization, A differs from the
+//factored matrix by a diagonal of that rank, which is corrected for with the
+//Sherman-Morrison-Woodbury formula.
+static void solveDirect(AttachmentState &st, const std::vector<int> &which)
+{
+  int i, j;
+  int nv = st.D.size();
+
+  std::vector<int> changed;
+  std::vector<double> delta;
+  for(i = 0; i < nv; ++i)
+  {
+    if(st.H[i] != st.factorH[i])
+    {
+      changed.push_back(i);
+      delta.push_back((st.H[i] - st.factorH[i]) / st.D[i]);
+    }
+  }
+
+  //Z = F^-1 U and the capacitance matrix S = diag(1/delta) + U^T Z, so that
+  //A^-1 b = y - Z S^-1 (U^T y) with y = F^-1 b
+  int r = changed.size();
+  std::vector<double> Z, S;
+  std::vector<int> pivots;
+  if(r > 0)
+  {
+    Z.assign(nv * r, 0.);
+    for(i = 0; i < r; ++i)
+      Z[changed[i] * r + i] = 1.;
+    st.factor->solveMany(Z, r);
+    S.resize(r * r);
+    for(i = 0; i < r; ++i)
+      for(j = 0; j < r; ++j)
+        S[i * r + j] = Z[changed[i] * r + j] + (i == j ? 1. / delta[i] : 0.);
+    luFactor(S, r, pivots);
+  }
+
+  //the solves are independent and only read the factor, so blocks of
+  //bones are solved together on the thread pool
+  const int bonesPerBlock = 8;
+  int n = which.size();
+  int blocks = (n + bonesPerBlock - 1) / bonesPerBlock;
+  ThreadPool::global().parallelFor(blocks, [&](int blk)
+  {
+    int v, b, c;
+    int b0 = blk * bonesPerBlock, k = std::min(bonesPerBlock, n - b0);
+    std::vector<double> rhs(nv * k, 0.), t(r);
+    for(v = 0; v < nv; ++v)
+    {
+      for(b = 0; b < k; ++b)
+      {
+        if(st.isSource(v, which[b0 + b]))
+          rhs[v * k + b] = st.H[v] / st.D[v];
+      }
+    }
+
+    st.factor->solveMany(rhs, k);
+    for(b = 0; b < k; ++b)
+    {
+      if(r > 0)
+      {
+        for(c = 0; c < r; ++c)
+          t[c] = rhs[changed[c] * k + b];
+        luSolve(S, r, pivots, &t[0]);
+        for(v = 0; v < nv; ++v)
+          for(c = 0; c < r; ++c)
+            rhs[v * k + b] -= Z[v * r + c] * t[c];
+      }
+
+      std::vector<std::pair<int, double> > &out = st.boneWeights[which[b0 + b]];
+      out.clear();
+      for(v = 0; v < nv; ++v)
+      {
+        double w = rhs[v * k + b];
+        if(w > 1.)
+          //clip just in case
+          w = 1.;
+        if(w > 1e-8)
+          out.push_back(std::make_pair(v, w));
+      }
+    }
+  });
+}
+
+//Solves for the weights of the given bones with PCG, in parallel.  Each
+//starts from its previous weights, or if it has none, from the weights it
+//would have if every vertex were attached to its nearest bone.
+static void solvePCG(AttachmentState &st, const std::vector<int> &which)
+{
+  int j;
+  int nv = st.D.size();
+  const AttachmentParams &params = st.params;
+  std::chrono::steady_clock::time_point timer = std::chrono::steady_clock::now();
+  PCGSolver pcg(st.system(st.H), params.preconditioner);
+
+  //weights below the tolerance are just solver noise and dropped
+  double threshold = std::max(1e-8, params.tolerance);
+  std::vector<int> iterations(which.size());
+  ThreadPool::global().parallelFor(which.size(), [&](int bi)
+  {
+    int v, b = which[bi];
+    std::vector<double> rhs(nv, 0.), x(nv, 0.);
+    std::vector<std::pair<int, double> > &out = st.boneWeights[b];
+    for(v = 0; v < (int)out.size(); ++v)
+      x[out[v].first] = out[v].second;
+    for(v = 0; v < nv; ++v)
+    {
+      if(st.isSource(v, b))
+        rhs[v] = st.H[v] / st.D[v];
+      if(out.empty() && st.closest[v] == b)
+        x[v] = 1.;
+    }
 
-  return v.normalize() * avg.normalize() > 0.5;
+    iterations[bi] = pcg.solve(rhs, x, params.tolerance, params.maxIterations);
+    out.clear();
+    for(v = 0; v < nv; ++v)
+    {
+      double w = std::min(x[v], 1.);
+      if(w > threshold)
+        out.push_back(std::make_pair(v, w));
+    }
+  });
+
+  int maxIter = 0, failed = 0;
+  for(j = 0; j < (int)which.size(); ++j)
+  {
+    if(iterations[j] < 0)
+      ++failed;
+    maxIter = std::max(maxIter, iterations[j] < 0 ? params.maxIterations : iterations[j]);
+  }
+  Debugging::out() << "Weights: PCG (" << (pcg.getPreconditioner() == PCGSolver::IC0 ? "IC0" : "Jacobi")
+    << ") " << secondsSince(timer) << "s memory " << pcg.bytes() / 1048576. << "MB max iterations "
+    << maxIter << std::endl;
+  if(failed)
+    Debugging::out() << "PCG did not converge for " << failed << " bones" << std::endl;
 }
 
 
 class AttachmentPrivate1 : public AttachmentPrivate
 {
   public:
-    AttachmentPrivate1() {}
+    AttachmentPrivate1() : nBones(0), influenceLimit(0) { updateView(); }
+
+    //uses the weights of a file written by Attachment::writeWeights
+    AttachmentPrivate1(const std::shared_ptr<MappedFile> &inFile) : nBones(0), file(inFile), influenceLimit(0)
+    {
+      updateView();
+    }
 
     AttachmentPrivate1(const Mesh &mesh, const Skeleton &skeleton,
       const std::vector<Vector3> &match, const VisibilityTester *tester,
-      double initialHeatWeight)
+      const AttachmentParams &params) : nBones(0), influenceLimit(0)
     {
       int i, j;
       int nv = mesh.vertices.size();
-      //compute edges
-      std::vector<std::vector<int> > edges(nv);
-
+      int bones = skeleton.fGraph().verts.size() - 1;
+      //vertices per task for the per-vertex loops
+      const int chunk = 256;
+      int chunks = (nv + chunk - 1) / chunk;
+      ThreadPool &pool = ThreadPool::global();
+      std::chrono::steady_clock::time_point timer = std::chrono::steady_clock::now();
+      nBones = bones;
+      updateView();
+
+      std::shared_ptr<AttachmentState> newState(new AttachmentState());
+      AttachmentState &st = *newState;
+      st.params = params;
+      st.bones = bones;
+      st.fPrev = skeleton.fPrev();
+      st.match = match;
+      st.positions.resize(nv);
+      st.normalSums.resize(nv);
       for(i = 0; i < nv; ++i)
-      {
-        int cur, start;
-        cur = start = mesh.vertices[i].edge;
-        do
-        {
-          edges[i].push_back(mesh.edges[cur].vertex);
-          cur = mesh.edges[mesh.edges[cur].prev].twin;
-        } while(cur != start);
-      }
+        st.positions[i] = mesh.vertices[i].pos;
 
-      int bones = skeleton.fGraph().verts.size() - 1;
+      //one-rings, areas and the laplacian
+      bool operatorsCached = false;
+      st.ops = getMeshOperators(mesh, &operatorsCached);
+      const MeshOperators *ops = st.ops.get();
+      double operatorTime = secondsSince(timer);
+      timer = std::chrono::steady_clock::now();
 
+      st.boneDists.assign(nv * bones, -1);
+      st.boneVis.assign(nv * bones, 0);
+      std::vector<std::vector<VisQuery> > chunkQueries(chunks);
 
-      std::vector<std::vector<double> > boneDists(nv);
-      std::vector<std::vector<bool> > boneVis(nv);
+      pool.parallelFor(chunks, [&](int c)
+      {
+        int v, b, k;
+        for(v = c * chunk; v < std::min(nv, (c + 1) * chunk); ++v)
+        {
+          const int *r = &(ops->ring[0]) + ops->ringStart[v];
+          int n = ops->ringSize(v);
+          Vector3 cPos = mesh.vertices[v].pos;
+          double *dists = &st.boneDists[v * bones];
 
+          Vector3 avgNormal;
+          for(k = 0; k < n; ++k)
+          {
+            int nk = (k + 1) % n;
+            Vector3 v1 = mesh.vertices[r[k]].pos - cPos;
+            Vector3 v2 = mesh.vertices[r[nk]].pos - cPos;
+            avgNormal += (v1 % v2).normalize();
+          }
+          st.normalSums[v] = avgNormal;
+
+          double minDist = 1e37;
+          for(b = 1; b <= bones; ++b)
+          {
+            const Vector3 &v1 = match[b],
+              &v2 = match[st.fPrev[b]];
+            dists[b - 1] = sqrt(distsqToSeg(cPos, v1, v2));
+            minDist = std::min(dists[b - 1], minDist);
+          }
+          for(b = 1; b <= bones; ++b)
+          {
+            //the reason we don't just pick the closest bone is so
+            //that if two are equally close, both are factored in.
+            if(dists[b - 1] > minDist * 1.0001)
+              continue;
+
+            const Vector3 &v1 = match[b],
+              &v2 = match[st.fPrev[b]];
+            Vector3 p = projToSeg(cPos, v1, v2);
+            //a bone behind the surface is never visible, so the ray is
+            //only traced when the cone test passes
+            if(vectorInCone(cPos - p, avgNormal))
+            {
+              VisQuery q = { v, b - 1, cPos, p };
+              chunkQueries[c].push_back(q);
+            }
+          }
+        }
+      });
+      double distTime = secondsSince(timer);
+
+      timer = std::chrono::steady_clock::now();
+      traceQueries(chunkQueries, tester, st);
+      int nq = 0;
+      for(i = 0; i < chunks; ++i)
+        nq += chunkQueries[i].size();
+      std::vector<std::vector<VisQuery> >().swap(chunkQueries);
+      Debugging::out() << "Attachment: mesh operators " << operatorTime << (operatorsCached ? "s (cached)" : "s")
+        << " distances " << distTime << "s visibility "
+        << secondsSince(timer) << "s (" << nq << " rays)" << std::endl;
+
+      st.D.resize(nv);
+      st.H.resize(nv);
+      st.closest.resize(nv);
       for(i = 0; i < nv; ++i)
       {
-        boneDists[i].resize(bones, -1);
-        boneVis[i].resize(bones);
-        Vector3 cPos = mesh.vertices[i].pos;
+        st.D[i] = 1. / (1e-10 + ops->areas[i]);
+        st.computeHeat(i);
+      }
+
+      std::vector<int> allBones(bones);
+      for(j = 0; j < bones; ++j)
+        allBones[j] = j;
+      st.boneWeights.resize(bones);
+      timer = std::chrono::steady_clock::now();
 
-        std::vector<Vector3> normals;
-        for(j = 0; j < (int)edges[i].size(); ++j)
+      if(params.solver == AttachmentParams::PCG)
+        solvePCG(st, allBones);
+      else
+      {
+        //only the diagonal depends on the skeleton and the heat weight, so the
+        //symbolic factorization is kept with the mesh and reused
+        MeshCache &cache = getMeshCache(mesh);
         {
-          int nj = (j + 1) % edges[i].size();
-          Vector3 v1 = mesh.vertices[edges[i][j]].pos - cPos;
-          Vector3 v2 = mesh.vertices[edges[i][nj]].pos - cPos;
-          normals.push_back((v1 % v2).normalize());
+          std::lock_guard<std::mutex> lock(cache.mutex);
+          st.symbolic = cache.attachmentSymbolic;
         }
+        if(st.symbolic && st.symbolic->matches(ops->laplacian))
+          Debugging::out() << "Reusing symbolic factorization" << std::endl;
 
-        double minDist = 1e37;
-        for(j = 1; j <= bones; ++j)
+        FactorStats factorStats;
+        bool factored = factorSystem(st, &factorStats);
         {
-          const Vector3 &v1 = match[j],
-            &v2 = match[skeleton.fPrev()[j]];
-          boneDists[i][j - 1] = sqrt(distsqToSeg(cPos, v1, v2));
-          minDist = std::min(boneDists[i][j - 1], minDist);
+          std::lock_guard<std::mutex> lock(cache.mutex);
+          cache.attachmentSymbolic = st.symbolic;
         }
-        for(j = 1; j <= bones; ++j)
-        {
-          //the reason we don't just pick the closest bone is so
-          //that if two are equally close, both are factored in.
-          if(boneDists[i][j - 1] > minDist * 1.0001)
-            continue;
+        if(!factored)
+          return;
 
-          const Vector3 &v1 = match[j],
-            &v2 = match[skeleton.fPrev()[j]];
-          Vector3 p = projToSeg(cPos, v1, v2);
-          boneVis[i][j - 1] = tester->canSee(cPos, p)
-            && vectorInCone(cPos - p, normals);
-        }
+        solveDirect(st, allBones);
+        Debugging::out() << "Weights: direct " << secondsSince(timer) << "s memory "
+          << std::max(factorStats.factorBytes, factorStats.numericBytes) / 1048576. << "MB" << std::endl;
       }
 
-      //We have -Lw+Hw=HI, same as (H-L)w=HI, with (H-L)=DA (with
-      //D=diag(1./area)) so w = A^-1 (HI/D)
+      setWeights(st.boneWeights, nv);
+      if(params.updatable)
+        state = newState;
 
-      std::vector<std::vector<std::pair<int, double> > > A(nv);
-      std::vector<double> D(nv, 0.), H(nv, 0.);
-      std::vector<int> closest(nv, -1);
-      for(i = 0; i < nv; ++i)
+      return;
+    }
+
+    //Moves the given joints and redoes the part of the solve that depends on
+    //them: the distances and visibility of the vertices whose nearest bones
+    //changed, and the weights of the bones whose heat sources changed or
+    //that reach a vertex whose heat changed.  The direct solver corrects its
+    //factor for the heat changes while there are few of them and refactors
+    //the matrix (reusing the symbolic factorization) once there are more.
+    bool update(const std::vector<int> &changedJoints, const std::vector<Vector3> &newEmbedding,
+      const VisibilityTester *tester)
+    {
+      int i, j;
+      if(!state || newEmbedding.size() != state->match.size())
+        return false;
+      if(state.use_count() > 1)
+        //shared with a copy of this attachment
+        state = std::make_shared<AttachmentState>(*state);
+      AttachmentState &st = *state;
+      int nv = st.positions.size(), bones = st.bones;
+      const int chunk = 256;
+      int chunks = (nv + chunk - 1) / chunk;
+      //beyond this many heat changes refactoring is cheaper than the correction
+      const int maxLowRank = 32;
+      std::chrono::steady_clock::time_point timer = std::chrono::steady_clock::now();
+
+      //the bones with a moved end
+      std::vector<char> jointMoved(st.match.size(), 0), boneMoved(bones, 0);
+      std::vector<int> movedBones;
+      for(i = 0; i < (int)changedJoints.size(); ++i)
+        if(changedJoints[i] >= 0 && changedJoints[i] < (int)jointMoved.size())
+          jointMoved[changedJoints[i]] = 1;
+      for(j = 0; j < bones; ++j)
       {
-        //get areas
-        for(j = 0; j < (int)edges[i].size(); ++j)
+        if(jointMoved[j + 1] || jointMoved[st.fPrev[j + 1]])
         {
-          int nj = (j + 1) % edges[i].size();
-
-          D[i] += ((mesh.vertices[edges[i][j]].pos -
-            mesh.vertices[i].pos) %
-            (mesh.vertices[edges[i][nj]].pos -
-            mesh.vertices[i].pos)).length();
+          boneMoved[j] = 1;
+          movedBones.push_back(j);
         }
-        D[i] = 1. / (1e-10 + D[i]);
-
-        //get bones
-        double minDist = 1e37;
-        for(j = 0; j < bones; ++j)
+      }
+      //other joints keep their place even if newEmbedding moves them, since
+      //nothing that depends on them is recomputed
+      for(i = 0; i < (int)jointMoved.size(); ++i)
+        if(jointMoved[i])
+          st.match[i] = newEmbedding[i];
+      if(movedBones.empty())
+        return true;
+
+      //a vertex is affected if a moved bone is among its nearest bones before
+      //or after; it gets new rays for the nearest bones that moved or weren't
+      //nearest before, and keeps the others
+      struct Affected
+      {
+        int vertex;
+        double oldH;
+        std::vector<int> oldSources;
+      };
+      std::vector<std::vector<Affected> > chunkAffected(chunks);
+      std::vector<std::vector<VisQuery> > chunkQueries(chunks);
+
+      ThreadPool::global().parallelFor(chunks, [&](int c)
+      {
+        int v, b, k;
+        std::vector<double> oldDists(bones);
+        for(v = c * chunk; v < std::min(nv, (c + 1) * chunk); ++v)
         {
-          if(boneDists[i][j] < minDist)
+          double *dists = &st.boneDists[v * bones];
+          char *vis = &st.boneVis[v * bones];
+          const Vector3 &cPos = st.positions[v];
+
+          double oldMin = 1e37, minDist = 1e37;
+          for(b = 0; b < bones; ++b)
+            oldMin = std::min(oldMin, dists[b]);
+          bool affected = false;
+          for(k = 0; k < (int)movedBones.size(); ++k)
           {
-            closest[i] = j;
-            minDist = boneDists[i][j];
+            b = movedBones[k];
+            oldDists[b] = dists[b];
+            affected = affected || dists[b] <= oldMin * 1.0001;
+            dists[b] = sqrt(distsqToSeg(cPos, st.match[b + 1], st.match[st.fPrev[b + 1]]));
           }
-        }
-        for(j = 0; j < bones; ++j)
-          if(boneVis[i][j] && boneDists[i][j] <= minDist * 1.00001)
-            H[i] += initialHeatWeight / SQR(1e-8 + boneDists[i][closest[i]]);
-
-        //get laplacian
-        double sum = 0.;
-        for(j = 0; j < (int)edges[i].size(); ++j)
-        {
-          int nj = (j + 1) % edges[i].size();
-          int pj = (j + edges[i].size() - 1) % edges[i].size();
-
-          Vector3 v1 = mesh.vertices[i].pos -
-            mesh.vertices[edges[i][pj]].pos;
-          Vector3 v2 = mesh.vertices[edges[i][j]].pos -
-            mesh.vertices[edges[i][pj]].pos;
-          Vector3 v3 = mesh.vertices[i].pos -
-            mesh.vertices[edges[i][nj]].pos;
-          Vector3 v4 = mesh.vertices[edges[i][j]].pos -
-            mesh.vertices[edges[i][nj]].pos;
-
-          double cot1 = (v1 * v2) / (1e-6 + (v1 % v2).length());
-          double cot2 = (v3 * v4) / (1e-6 + (v3 % v4).length());
-          sum += (cot1 + cot2);
-
-          // check for triangular here because sum should be
-          // computed regardless
-          if(edges[i][j] > i)
+          for(b = 0; b < bones; ++b)
+            minDist = std::min(minDist, dists[b]);
+          for(k = 0; k < (int)movedBones.size(); ++k)
+            affected = affected || dists[movedBones[k]] <= minDist * 1.0001;
+          if(!affected)
             continue;
-          A[i].push_back(std::make_pair(edges[i][j], -cot1 - cot2));
-        }
 
-        A[i].push_back(std::make_pair(i, sum + H[i] / D[i]));
+          Affected a;
+          a.vertex = v;
+          a.oldH = st.H[v];
+          for(b = 0; b < bones; ++b)
+            if(st.isSource(v, b))
+              a.oldSources.push_back(b);
+          chunkAffected[c].push_back(a);
 
-        sort(A[i].begin(), A[i].end());
-      }
+          for(b = 0; b < bones; ++b)
+          {
+            bool wasNearest = (boneMoved[b] ? oldDists[b] : dists[b]) <= oldMin * 1.0001;
+            if(dists[b] > minDist * 1.0001)
+              vis[b] = 0;
+            else if(boneMoved[b] || !wasNearest)
+            {
+              vis[b] = 0;
+              Vector3 p = projToSeg(cPos, st.match[b + 1], st.match[st.fPrev[b + 1]]);
+              if(vectorInCone(cPos - p, st.normalSums[v]))
+              {
+                VisQuery q = { v, b, cPos, p };
+                chunkQueries[c].push_back(q);
+              }
+            }
+          }
+        }
+      });
 
-      nzweights.resize(nv);
-      SPDMatrix Am(A);
-      LLTMatrix *Ainv = Am.factor();
-      if(Ainv == NULL)
-        return;
+      traceQueries(chunkQueries, tester, st);
+      int nq = 0;
+      for(i = 0; i < chunks; ++i)
+        nq += chunkQueries[i].size();
 
-      for(j = 0; j < bones; ++j)
+      //bones whose right hand side changed, and vertices whose heat changed
+      std::vector<char> resolve(boneMoved.size(), 0), heatChanged(nv, 0);
+      int nAffected = 0;
+      for(i = 0; i < chunks; ++i)
       {
-        std::vector<double> rhs(nv, 0.);
-        for(i = 0; i < nv; ++i)
-        {
-          if(boneVis[i][j] && boneDists[i][j] <=
-            boneDists[i][closest[i]] * 1.00001)
-            rhs[i] = H[i] / D[i];
-        }
-
-        Ainv->solve(rhs);
-        for(i = 0; i < nv; ++i)
+        for(j = 0; j < (int)chunkAffected[i].size(); ++j, ++nAffected)
         {
-          if(rhs[i] > 1.)
-            //clip just in case
-            rhs[i] = 1.;
-          if(rhs[i] > 1e-8)
-            nzweights[i].push_back(std::make_pair(j, rhs[i]));
+          const Affected &a = chunkAffected[i][j];
+          int v = a.vertex, k, b;
+          st.computeHeat(v);
+          if(st.H[v] != a.oldH)
+          {
+            heatChanged[v] = 1;
+            for(k = 0; k < (int)a.oldSources.size(); ++k)
+              resolve[a.oldSources[k]] = 1;
+          }
+          for(b = 0, k = 0; b < bones; ++b)
+          {
+            bool was = k < (int)a.oldSources.size() && a.oldSources[k] == b;
+            if(was)
+              ++k;
+            bool is = st.isSource(v, b);
+            if(is != was || (is && heatChanged[v]))
+              resolve[b] = 1;
+          }
         }
       }
 
-      weights.resize(nv);
-
-      // initialize the weights vectors so they are big enough
-      for(i = 0; i < nv; ++i)
-        weights[i][bones - 1] = 0.;
-
-      for(i = 0; i < nv; ++i)
+      //a bone is also affected through A wherever the heat changed under
+      //its weights, so it is re-solved if it has any weight there--the
+      //others change by less than the weights dropped from them
+      std::vector<int> which;
+      for(j = 0; j < bones; ++j)
       {
-        double sum = 0.;
-        for(j = 0; j < (int)nzweights[i].size(); ++j)
-          sum += nzweights[i][j].second;
+        for(i = 0; !resolve[j] && i < (int)st.boneWeights[j].size(); ++i)
+          if(heatChanged[st.boneWeights[j][i].first])
+            resolve[j] = 1;
+        if(resolve[j])
+          which.push_back(j);
+      }
 
-        for(j = 0; j < (int)nzweights[i].size(); ++j)
+      if(!which.empty())
+      {
+        if(st.params.solver == AttachmentParams::PCG)
+          solvePCG(st, which);
+        else
         {
-          nzweights[i][j].second /= sum;
-          weights[i][nzweights[i][j].first] = nzweights[i][j].second;
+          int rank = 0;
+          for(i = 0; i < nv; ++i)
+            if(st.H[i] != st.factorH[i])
+              ++rank;
+          if(rank > maxLowRank && !factorSystem(st, NULL))
+            return false;
+          solveDirect(st, which);
         }
+        setWeights(st.boneWeights, nv);
       }
 
-      delete Ainv;
-      return;
+      Debugging::out() << "Attachment update: " << nAffected << " vertices " << nq << " rays "
+        << which.size() << " bones re-solved " << secondsSince(timer) << "s" << std::endl;
+      return true;
     }
 
-    /*
-     * Deforms the mesh but according to what algorithm the user chose to
-     * use as the skinning algorithm. The options are linear blend
-     * skinning, dual quaternion skinning, or a mixed result.
-     */
-    Mesh deform(const Mesh &mesh, const std::vector<Transform<> > &transforms)
-      const
-    {
-      Mesh out;
+    SkinWeights getSkinWeights() const { return view; }
 
-      if (mesh.algo == Mesh::DQS)
-        out = dualQuaternion(mesh, transforms);
-      else if (mesh.algo == Mesh::LBS)
-        out = linearBlend(mesh, transforms);
-      else if (mesh.algo == Mesh::MIX)
-        out = mixedBlend(mesh, transforms);
+    void limitInfluences(int maxInfluences)
+    {
+      if(maxInfluences < 1)
+        return;
+      influenceLimit = maxInfluences;
+      applyInfluenceLimit();
+    }
 
-      out.computeVertexNormals();
+    AttachmentPrivate *clone() const
+    {
+      AttachmentPrivate1 *out = new AttachmentPrivate1();
+      *out = *this;
+      out->updateView();
       return out;
     }
 
-    /* 
-     *  This function deforms the mesh using a blended result of both
-     *  dual quaternion and linear blend skinning. The blending weight
-     *  that is contained within the mesh object passed in referes to how
-     *  much of the linear blend result will be mixed in. For example,
-     *  if the blending weight is 0.2, then 20% of the linear blend result
-     *  will be used, while 80% of the dual quaternion result will be used.
-     */
-    Mesh mixedBlend(const Mesh &mesh,
-      const std::vector<Transform<> > &transforms)
-      const
+  private:
+    //builds the sparse weights from the weights of each bone
+    void setWeights(const std::vector<std::vector<std::pair<int, double> > > &boneWeights, int nv)
     {
-      Mesh out = mesh;
-      Tbx::Dual_quat_cu dquat_blend = Tbx::Dual_quat_cu::identity();
-      int i, nv = mesh.vertices.size();
-
-      if(mesh.vertices.size() != weights.size())
-        //error
-        return out;
+      int i, j, bones = boneWeights.size();
 
+      //merge in bone order so the result doesn't depend on the scheduling:
+      //count the influences of each vertex, then scatter the bones into place
+      weightOffsets.assign(nv + 1, 0);
+      for(j = 0; j < bones; ++j)
+        for(i = 0; i < (int)boneWeights[j].size(); ++i)
+          ++weightOffsets[boneWeights[j][i].first + 1];
       for(i = 0; i < nv; ++i)
-      {
-        int j;
-        int nbones = (int)nzweights[i].size();
-        Tbx::Quat_cu q0;
-        Vector3 newPos;
+        weightOffsets[i + 1] += weightOffsets[i];
 
-        // inititialize the first dual quaternion
-        if (nbones == 0)
-        {
-          dquat_blend = Tbx::Dual_quat_cu::identity();
-          q0 = dquat_blend.rotation();
-        }
-        else
-        {
-          Tbx::Dual_quat_cu dquat =
-            getQuatFromMat(transforms[nzweights[i][0].first]);
-          dquat_blend = dquat * nzweights[i][0].second;
-          q0 = dquat.rotation();
-        }
-        // init first transform for linear blend
-        newPos += ((transforms[nzweights[i][0].first] *
-          out.vertices[i].pos) * nzweights[i][0].second);
-
-        for(j = 1; j < nbones; ++j)
+      std::vector<double> nzweights(weightOffsets[nv]);
+      std::vector<unsigned int> fill(weightOffsets.begin(), weightOffsets.end() - 1);
+      weightBones.resize(weightOffsets[nv]);
+      for(j = 0; j < bones; ++j)
+      {
+        for(i = 0; i < (int)boneWeights[j].size(); ++i)
         {
-          float w = nzweights[i][j].second;
-          const Tbx::Dual_quat_cu& dq =
-            (nzweights[i][j].second <= 0) ?
-            Tbx::Dual_quat_cu::identity() :
-          getQuatFromMat(transforms[nzweights[i][j].first]);
-
-          // find shortest rotation
-          if (dq.rotation().dot(q0) < 0.f)
-            w *= -1.f;
-
-          dquat_blend = dquat_blend + dq * w;
-          newPos += ((transforms[nzweights[i][j].first] *
-            out.vertices[i].pos) * w);
+          unsigned int idx = fill[boneWeights[j][i].first]++;
+          weightBones[idx] = (unsigned short)j;
+          nzweights[idx] = boneWeights[j][i].second;
         }
-
-        // Transform the vertex
-        Vector3 dqpos = out.vertices[i].pos;
-        dqpos = transformPoint(out.vertices[i].pos, dquat_blend);
-        out.vertices[i].pos = dqpos;
-        out.vertices[i].pos = newPos *
-          out.blendWeight + dqpos * (1.0 - out.blendWeight);
       }
-      return out;
-    }
-
-    /*
-     * This function deforms the mesh using the normal linear blend
-     * skinning. This was the original code used in Pinocchio before
-     * our adjustments.
-     */
-    Mesh linearBlend(const Mesh &mesh, const std::vector<Transform<> > &transforms)
-      const
-    {
-      Mesh out = mesh;
-      int i, nv = mesh.vertices.size();
-
-      if(mesh.vertices.size() != weights.size())
-        //error
-        return out;
 
+      //normalize in double precision, store as float
+      weightValues.resize(weightOffsets[nv]);
       for(i = 0; i < nv; ++i)
       {
-        int j;
-        int nbones = (int)nzweights[i].size();
-        Vector3 newPos;
+        double sum = 0.;
+        for(j = weightOffsets[i]; j < (int)weightOffsets[i + 1]; ++j)
+          sum += nzweights[j];
 
-        // Loop through bones and sum up their weighted
-        // transformations
-        for(j = 0; j < nbones; ++j)
-        {
-          newPos += ((transforms[nzweights[i][j].first] *
-            out.vertices[i].pos) * nzweights[i][j].second);
-        }
+        for(j = weightOffsets[i]; j < (int)weightOffsets[i + 1]; ++j)
+          weightValues[j] = (float)(nzweights[j] / sum);
+      }
 
-        // Transform the vertex
-        out.vertices[i].pos = newPos;
 
-      }
-      return out;
+      if(influenceLimit > 0)
+        applyInfluenceLimit();
+      updateView();
     }
 
-    /*
-     * This function deforms the mesh using dual quaternion skinning.
-     * We used the functions from the skinning library by Rodolphe
-     * Vaillant-David.
-     */
-    Mesh dualQuaternion(const Mesh &mesh,
-      const std::vector<Transform<> > &transforms)
-      const
+    //keeps the influenceLimit largest weights of every vertex and
+    //rescales them to sum to one; the bones stay in increasing order
+    void applyInfluenceLimit()
     {
-      Mesh out = mesh;
-      Tbx::Dual_quat_cu dquat_blend = Tbx::Dual_quat_cu::identity();
-      int i, nv = mesh.vertices.size();
+      int i, j, nv = (int)weightOffsets.size() - 1;
+      std::vector<std::pair<float, unsigned short> > cur;
+      unsigned int outIdx = 0;
 
-      if(mesh.vertices.size() != weights.size())
-        //error
-        return out;
+      if(file)
+      {
+        //copy the mapped weights before changing them
+        nBones = view.bones;
+        weightOffsets.assign(view.offsets, view.offsets + view.vertices + 1);
+        weightBones.assign(view.boneIds, view.boneIds + view.offsets[view.vertices]);
+        weightValues.assign(view.weights, view.weights + view.offsets[view.vertices]);
+        file.reset();
+        nv = view.vertices;
+      }
+      if(nv < 0)
+        return;
 
       for(i = 0; i < nv; ++i)
       {
-        int j;
-        int nbones = (int)nzweights[i].size();
-        Tbx::Quat_cu q0;
-        Vector3 newPos;
+        unsigned int first = weightOffsets[i], last = weightOffsets[i + 1];
+        weightOffsets[i] = outIdx;
+        cur.clear();
+        for(j = first; j < (int)last; ++j)
+          cur.push_back(std::make_pair(weightValues[j], weightBones[j]));
 
-        // inititialize the first dual quaternion
-        if (nbones == 0)
-        {
-          dquat_blend = Tbx::Dual_quat_cu::identity();
-          q0 = dquat_blend.rotation();
-        }
-        else
+        if((int)cur.size() > influenceLimit)
         {
-          Tbx::Dual_quat_cu dquat =
-            getQuatFromMat(transforms[nzweights[i][0].first]);
-          dquat_blend = dquat * nzweights[i][0].second;
-          q0 = dquat.rotation();
+          std::partial_sort(cur.begin(), cur.begin() + influenceLimit, cur.end(),
+            [](const std::pair<float, unsigned short> &a, const std::pair<float, unsigned short> &b)
+            { return a.first > b.first || (a.first == b.first && a.second < b.second); });
+          cur.resize(influenceLimit);
+          std::sort(cur.begin(), cur.end(),
+            [](const std::pair<float, unsigned short> &a, const std::pair<float, unsigned short> &b)
+            { return a.second < b.second; });
         }
 
-        for(j = 1; j < nbones; ++j)
+        double sum = 0.;
+        for(j = 0; j < (int)cur.size(); ++j)
+          sum += cur[j].first;
+        for(j = 0; j < (int)cur.size(); ++j, ++outIdx)
         {
-          float w = nzweights[i][j].second;
-          const Tbx::Dual_quat_cu& dq =
-            (nzweights[i][j].second <= 0) ?
-            Tbx::Dual_quat_cu::identity() :
-          getQuatFromMat(transforms[nzweights[i][j].first]);
-
-          // find shortest rotation
-          if (dq.rotation().dot(q0) < 0.f)
-            w *= -1.f;
-
-          // combine the quaternion with the main quaternion
-          // that will be used for transforming.
-          dquat_blend = dquat_blend + dq * w;
+          weightBones[outIdx] = cur[j].second;
+          weightValues[outIdx] = (float)(cur[j].first / sum);
         }
-
-        // Transform the vertex
-        out.vertices[i].pos = transformPoint(out.vertices[i].pos,
-          dquat_blend);
       }
-      return out;
+      weightOffsets[nv] = outIdx;
+      weightBones.resize(outIdx);
+      weightValues.resize(outIdx);
+      std::vector<unsigned short>(weightBones).swap(weightBones);
+      std::vector<float>(weightValues).swap(weightValues);
+      updateView();
     }
 
-    Vector<double, -1> getWeights(int i) const { return weights[i]; }
 
-    AttachmentPrivate *clone() const
+    //points the view at the file if there is one, otherwise at the vectors
+    void updateView()
     {
-      AttachmentPrivate1 *out = new AttachmentPrivate1();
-      *out = *this;
-      return out;
+      if(file)
+      {
+        const WeightFileHeader *header = (const WeightFileHeader *)file->data;
+        view.vertices = header->vertices;
+        view.bones = header->bones;
+        view.offsets = (const unsigned int *)(file->data + sizeof(WeightFileHeader));
+        view.weights = (const float *)(view.offsets + view.vertices + 1);
+        view.boneIds = (const unsigned short *)(view.weights + header->influences);
+        return;
+      }
+      view.vertices = std::max(0, (int)weightOffsets.size() - 1);
+      view.bones = nBones;
+      view.offsets = weightOffsets.empty() ? NULL : &(weightOffsets[0]);
+      view.boneIds = weightBones.empty() ? NULL : &(weightBones[0]);
+      view.weights = weightValues.empty() ? NULL : &(weightValues[0]);
     }
 
-  private:
-    std::vector<Vector<double, -1> > weights;
-    //sparse representation
-    std::vector<std::vector<std::pair<int, double> > > nzweights;
+    //CSR: the influences of vertex i are [weightOffsets[i], weightOffsets[i + 1])
+    int nBones;
+    std::vector<unsigned int> weightOffsets;
+    std::vector<unsigned short> weightBones;
+    std::vector<float> weightValues;
+    //set instead of the vectors when the weights were loaded from a file
+    std::shared_ptr<MappedFile> file;
+    SkinWeights view;
+    int influenceLimit; //0 for none
+    //kept for update(), shared between copies until one of them changes it
+    std::shared_ptr<AttachmentState> state;
 };
 
 Attachment::~Attachment()
@@ -445,20 +906,98 @@ Attachment::~Attachment()
 
 Attachment::Attachment(const Attachment &att)
 {
-  a = att.a->clone();
+  a = att.a ? att.a->clone() : NULL;
 }
 
 
-Vector<double, -1> Attachment::getWeights(int i) const
+WeightRow Attachment::getWeights(int i) const
 {
-  return a->getWeights(i);
+  return WeightRow(a->getSkinWeights(), i);
+}
+
+
+SkinWeights Attachment::getSkinWeights() const
+{
+  return a->getSkinWeights();
+}
+
+
+void Attachment::limitInfluences(int maxInfluences)
+{
+  a->limitInfluences(maxInfluences);
+}
+
+
+bool Attachment::update(const std::vector<int> &changedJoints,
+const std::vector<Vector3> &newEmbedding, const VisibilityTester *tester)
+{
+  return a->update(changedJoints, newEmbedding, tester);
 }
 
 
 Mesh Attachment::deform(const Mesh &mesh,
 const std::vector<Transform<> > &transforms) const
 {
-  return a->deform(mesh, transforms);
+  Mesh out = mesh;
+  deform(mesh, transforms, out);
+  return out;
+}
+
+
+bool Attachment::deformInto(const Mesh &mesh, const SkinningContext &context,
+const DeformTarget &target) const
+{
+  return skin(mesh, a->getSkinWeights(), context, target);
+}
+
+
+bool Attachment::deformInto(const Mesh &mesh, const std::vector<Transform<> > &transforms,
+const DeformTarget &target) const
+{
+  //kept so that converting the palette doesn't allocate after the first frame
+  static thread_local SkinningContext context;
+  context.setTransforms(transforms);
+  return deformInto(mesh, context, target);
+}
+
+
+bool Attachment::deform(const Mesh &mesh, const SkinningContext &context, Mesh &out) const
+{
+  //only the first frame copies the mesh
+  if(out.vertices.size() != mesh.vertices.size() || out.edges.size() != mesh.edges.size())
+    out = mesh;
+  DeformTarget target(out);
+  return deformInto(mesh, context, target);
+}
+
+
+bool Attachment::deformInstances(const Mesh &mesh, const std::vector<SkinningContext> &poses,
+const std::vector<DeformTarget> &targets) const
+{
+  return skinInstances(mesh, a->getSkinWeights(), poses, targets);
+}
+
+
+bool Attachment::deformChanged(const Mesh &mesh, const SkinningContext &context, Mesh &out) const
+{
+  if(out.vertices.size() != mesh.vertices.size() || out.edges.size() != mesh.edges.size())
+  {
+    out = mesh;
+    DeformTarget target(out);
+    return deformInto(mesh, context, target);
+  }
+  DeformTarget target(out);
+  return skinChanged(mesh, a->getSkinWeights(), context, target);
+}
+
+
+bool Attachment::deform(const Mesh &mesh, const std::vector<Transform<> > &transforms,
+Mesh &out) const
+{
+  if(out.vertices.size() != mesh.vertices.size() || out.edges.size() != mesh.edges.size())
+    out = mesh;
+  DeformTarget target(out);
+  return deformInto(mesh, transforms, target);
 }
 
 
@@ -466,7 +1005,91 @@ Attachment::Attachment(const Mesh &mesh, const Skeleton &skeleton,
 const std::vector<Vector3> &match, const VisibilityTester *tester,
 double initialHeatWeight)
 {
-  a = new AttachmentPrivate1(mesh, skeleton, match, tester, initialHeatWeight);
+  AttachmentParams params;
+  params.heatWeight = initialHeatWeight;
+  a = new AttachmentPrivate1(mesh, skeleton, match, tester, params);
+}
+
+
+Attachment::Attachment(const Mesh &mesh, const Skeleton &skeleton,
+const std::vector<Vector3> &match, const VisibilityTester *tester,
+const AttachmentParams &params)
+{
+  a = new AttachmentPrivate1(mesh, skeleton, match, tester, params);
+}
+
+Attachment::Attachment(const Mesh &mesh, const std::string &weightFile)
+{
+  //left empty if the file can't be used, like when the weights can't be solved for
+  a = new AttachmentPrivate1();
+  std::shared_ptr<MappedFile> file(new MappedFile());
+  if(!file->open(weightFile))
+  {
+    Debugging::out() << "Could not read weight file " << weightFile << std::endl;
+    return;
+  }
+
+  const WeightFileHeader *header = (const WeightFileHeader *)file->data;
+  if(file->size < sizeof(WeightFileHeader) || memcmp(header->magic, weightFileMagic, 4) != 0
+    || header->version != weightFileVersion)
+  {
+    Debugging::out() << weightFile << " is not a weight file" << std::endl;
+    return;
+  }
+  if(header->vertices != mesh.vertices.size() || header->meshHash != mesh.topologyHash())
+  {
+    Debugging::out() << weightFile << " was written for a different mesh" << std::endl;
+    return;
+  }
+  const unsigned int *offsets = (const unsigned int *)(file->data + sizeof(WeightFileHeader));
+  if(file->size != weightFileSize(header->vertices, header->influences)
+    || offsets[header->vertices] != header->influences)
+  {
+    Debugging::out() << weightFile << " is truncated" << std::endl;
+    return;
+  }
+  if(!validWeights(header, offsets))
+  {
+    Debugging::out() << weightFile << " is corrupt" << std::endl;
+    return;
+  }
+
+  delete a;
+  a = new AttachmentPrivate1(file);
+}
+
+
+bool Attachment::writeWeights(const std::string &filename, const Mesh &mesh) const
+{
+  if(a == NULL)
+    return false;
+  SkinWeights w = a->getSkinWeights();
+  if(w.vertices != (int)mesh.vertices.size())
+    return false;
+
+  WeightFileHeader header;
+  memcpy(header.magic, weightFileMagic, 4);
+  header.version = weightFileVersion;
+  header.vertices = w.vertices;
+  header.bones = w.bones;
+  header.influences = w.vertices > 0 ? w.offsets[w.vertices] : 0;
+  header.reserved = 0;
+  header.meshHash = mesh.topologyHash();
+
+  std::ofstream strm(filename.c_str(), std::ios::binary);
+  strm.write((const char *)&header, sizeof(header));
+  if(w.vertices > 0)
+  {
+    strm.write((const char *)w.offsets, (w.vertices + 1) * sizeof(unsigned int));
+    strm.write((const char *)w.weights, header.influences * sizeof(float));
+    strm.write((const char *)w.boneIds, header.influences * sizeof(unsigned short));
+  }
+  else
+  {
+    unsigned int zero = 0;
+    strm.write((const char *)&zero, sizeof(zero));
+  }
+  return (bool)strm;
 }
 
 } // namespace Pinocchio
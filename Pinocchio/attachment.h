@@ -23,13 +23,21 @@
 #include "skeleton.h"
 #include "transform.h"
 #include "quatinterface.h"
+#include "lsqSolver.h"
+#include "skinning.h"
 
 namespace Pinocchio {
 
+//testers may be called from several threads at once
 class VisibilityTester {
   public:
     virtual ~VisibilityTester() {}
     virtual bool canSee(const Vector3 &v1, const Vector3 &v2) const = 0;
+    //out[i] = canSee(from[i], to[i]) for n pairs
+    virtual void canSeeMany(const Vector3 *from, const Vector3 *to, int n, char *out) const {
+      for(int i = 0; i < n; ++i)
+        out[i] = canSee(from[i], to[i]);
+    }
 };
 
 template<class T>
@@ -60,6 +68,12 @@ class VisTester : public VisibilityTester {
       return true;
     }
 
+    //same as the default, but without a virtual call per ray
+    virtual void canSeeMany(const Vector3 *from, const Vector3 *to, int n, char *out) const {
+      for(int i = 0; i < n; ++i)
+        out[i] = VisTester<T>::canSee(from[i], to[i]);
+    }
+
   private:
     const T *tree;
 };
@@ -71,6 +85,26 @@ VisibilityTester *makeVisibilityTester(const T *tree) {
 }
 
 
+//how Attachment computes the weights
+struct AttachmentParams {
+  AttachmentParams() : heatWeight(1.), solver(DIRECT), preconditioner(PCGSolver::IC0),
+    tolerance(1e-6), maxIterations(2000), updatable(false) {}
+
+  // DIRECT sparse Cholesky factorization, exact but needs memory for the fill
+  // PCG preconditioned conjugate gradients, for meshes too big to factor
+  enum { DIRECT = 0, PCG = 1 };
+
+  double heatWeight; //stiffness
+  int solver;
+  //PCG only
+  int preconditioner; //PCGSolver::IC0 or PCGSolver::JACOBI
+  double tolerance; //relative residual; weights below this are dropped
+  int maxIterations;
+  //keep the distances, visibility and factor for Attachment::update; costs
+  //about 9 bytes per vertex per bone plus the factor
+  bool updatable;
+};
+
 class AttachmentPrivate;
 
 class PINOCCHIO_API Attachment {
@@ -78,14 +112,45 @@ class PINOCCHIO_API Attachment {
     Attachment() : a(NULL) {}
     Attachment(const Attachment &);
     Attachment(const Mesh &mesh, const Skeleton &skeleton, const std::vector<Vector3> &match, const VisibilityTester *tester, double initialHeatWeight=1.);
+    Attachment(const Mesh &mesh, const Skeleton &skeleton, const std::vector<Vector3> &match, const VisibilityTester *tester, const AttachmentParams &params);
+    //maps a file written by writeWeights; the mesh must have the same connectivity
+    //as the one it was written for, otherwise the attachment has no weights
+    Attachment(const Mesh &mesh, const std::string &weightFile);
 
     virtual ~Attachment();
 
     Mesh deform(const Mesh &mesh, const std::vector<Transform<> > &transforms) const;
+    //same as deform, but writes into out, which is only copied from mesh
+    //when it doesn't have its topology yet--returns false on error
+    bool deform(const Mesh &mesh, const std::vector<Transform<> > &transforms, Mesh &out) const;
+    //writes positions (and normals) without copying the rest mesh or allocating
+    bool deformInto(const Mesh &mesh, const std::vector<Transform<> > &transforms, const DeformTarget &target) const;
+    //the same with a palette converted by the caller
+    bool deform(const Mesh &mesh, const SkinningContext &context, Mesh &out) const;
+    bool deformInto(const Mesh &mesh, const SkinningContext &context, const DeformTarget &target) const;
+    //redoes only what the bones changed by the last setTransforms of context
+    //move in out, which holds the previous frame (the first frame is done in
+    //full).  The context needs setInfluences with this attachment's weights.
+    bool deformChanged(const Mesh &mesh, const SkinningContext &context, Mesh &out) const;
+    //one call for a crowd: instance i is deformed with poses[i] into targets[i]
+    bool deformInstances(const Mesh &mesh, const std::vector<SkinningContext> &poses,
+      const std::vector<DeformTarget> &targets) const;
     Mesh mixedBlend(const Mesh &mesh, const std::vector<Transform<> > &transforms) const;
     Mesh linearBlend(const Mesh &mesh, const std::vector<Transform<> > &transforms) const;
     Mesh dualQuaternion(const Mesh &mesh, const std::vector<Transform<> > &transforms) const;
-    Vector<double, -1> getWeights(int i) const;
+    //the weights of vertex i read in place, valid as long as getSkinWeights()
+    WeightRow getWeights(int i) const;
+    SkinWeights getSkinWeights() const;
+    //keep only the maxInfluences largest weights per vertex, renormalized
+    void limitInfluences(int maxInfluences);
+    //moves the joints in changedJoints to their place in newEmbedding (the
+    //other entries are ignored) and recomputes only what depends on
+    //them--the visibility tester is needed for the vertices that get new
+    //nearest bones.  Returns false if the attachment wasn't made with
+    //AttachmentParams::updatable.
+    bool update(const std::vector<int> &changedJoints, const std::vector<Vector3> &newEmbedding, const VisibilityTester *tester);
+    //binary sparse weights, returns false on error
+    bool writeWeights(const std::string &filename, const Mesh &mesh) const;
   private:
     AttachmentPrivate *a;
 };
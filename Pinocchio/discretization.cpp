@@ -20,6 +20,7 @@
 #include "pinocchioApi.h"
 #include "deriv.h"
 #include "debugging.h"
+#include "meshcache.h"
 
 namespace Pinocchio {
 
@@ -27,8 +28,6 @@ namespace Pinocchio {
 //component
 Mesh  prepareMesh(const Mesh &m)
 {
-  Mesh out = m;
-
   if(!m.isConnected())
   {
     Debugging::out() <<
@@ -36,6 +35,10 @@ Mesh  prepareMesh(const Mesh &m)
     return Mesh();
   }
 
+  //the prepared copy shares the cache, so rigging m again reuses it
+  getMeshCache(m);
+  Mesh out = m;
+
   out.computeVertexNormals();
   out.normalizeBoundingBox();
 
@@ -22,9 +22,265 @@
 #include <set>
 #include <iostream>
 #include <unordered_set>
+#include <chrono>
 
 #include "hashutils.h"
 #include "debugging.h"
+#include "threadpool.h"
+
+namespace Pinocchio {
+
+bool LLTMatrix::solveMany(std::vector<double> &b, int k) const
+{
+  int i, c, sz = size();
+  if((int)b.size() != sz * k)
+    return false;
+
+  std::vector<double> col(sz);
+  for(c = 0; c < k; ++c)
+  {
+    for(i = 0; i < sz; ++i)
+      col[i] = b[i * k + c];
+    if(!solve(col))
+      return false;
+    for(i = 0; i < sz; ++i)
+      b[i * k + c] = col[i];
+  }
+
+  return true;
+}
+
+
+SparseLower::SparseLower(const std::vector<std::vector<std::pair<int, double> > > &rows)
+{
+  int i, j, k;
+  int sz = rows.size();
+  rowStart.resize(sz + 1);
+  rowStart[0] = 0;
+  for(i = 0; i < sz; ++i)
+    rowStart[i + 1] = rowStart[i] + rows[i].size();
+  idx.resize(rowStart[sz]);
+  val.resize(rowStart[sz]);
+  for(i = 0, k = 0; i < sz; ++i)
+  {
+    for(j = 0; j < (int)rows[i].size(); ++j, ++k)
+    {
+      idx[k] = rows[i][j].first;
+      val[k] = rows[i][j].second;
+    }
+  }
+}
+
+
+bool SymbolicFactor::matches(const SparseLower &m) const
+{
+  return m.rowStart == patternStart && m.idx == patternIdx;
+}
+
+
+PCGSolver::PCGSolver(const SparseLower &m, int inPreconditioner)
+  : preconditioner(inPreconditioner)
+{
+  int i, k, sz = m.size();
+
+  //the same rows without the diagonal
+  rowStart.resize(sz + 1);
+  rowIdx.reserve(m.idx.size() - sz);
+  rowVal.reserve(m.idx.size() - sz);
+  diag.assign(sz, 0.);
+  rowStart[0] = 0;
+  for(i = 0; i < sz; ++i)
+  {
+    for(k = m.rowStart[i]; k < m.rowStart[i + 1]; ++k)
+    {
+      if(m.idx[k] == i)
+        diag[i] = m.val[k];
+      else
+      {
+        rowIdx.push_back(m.idx[k]);
+        rowVal.push_back(m.val[k]);
+      }
+    }
+    rowStart[i + 1] = rowIdx.size();
+  }
+
+  if(preconditioner == IC0 && !factorIC0())
+  {
+    Debugging::out() << "Incomplete Cholesky broke down; using Jacobi" << std::endl;
+    preconditioner = JACOBI;
+    std::vector<double>().swap(icVal);
+    std::vector<int>().swap(icColStart);
+    std::vector<int>().swap(icColIdx);
+    std::vector<double>().swap(icColVal);
+    std::vector<double>().swap(icDiag);
+  }
+}
+
+
+bool PCGSolver::factorIC0()
+{
+  int i, j, sz = diag.size();
+
+  icVal.resize(rowVal.size());
+  icDiag.resize(sz);
+  for(i = 0; i < sz; ++i)
+  {
+    double d = diag[i];
+    for(j = rowStart[i]; j < rowStart[i + 1]; ++j)
+    {
+      //entries of rows i and k left of column k, by merging the two rows
+      int k = rowIdx[j];
+      double val = rowVal[j];
+      int p = rowStart[i], q = rowStart[k];
+      while(p < j && q < rowStart[k + 1])
+      {
+        if(rowIdx[p] < rowIdx[q])
+          ++p;
+        else if(rowIdx[p] > rowIdx[q])
+          ++q;
+        else
+          val -= icVal[p++] * icVal[q++];
+      }
+      icVal[j] = val / icDiag[k];
+      d -= SQR(icVal[j]);
+    }
+    if(d <= 0.)
+      return false;
+    icDiag[i] = sqrt(d);
+  }
+
+  //the transpose, for the backward solve
+  icColStart.assign(sz + 1, 0);
+  for(j = 0; j < (int)rowIdx.size(); ++j)
+    ++icColStart[rowIdx[j] + 1];
+  for(i = 0; i < sz; ++i)
+    icColStart[i + 1] += icColStart[i];
+  icColIdx.resize(rowIdx.size());
+  icColVal.resize(rowIdx.size());
+  std::vector<int> pos(icColStart.begin(), icColStart.end() - 1);
+  for(i = 0; i < sz; ++i)
+  {
+    for(j = rowStart[i]; j < rowStart[i + 1]; ++j)
+    {
+      int p = pos[rowIdx[j]]++;
+      icColIdx[p] = i;
+      icColVal[p] = icVal[j];
+    }
+  }
+
+  return true;
+}
+
+
+void PCGSolver::multiply(const std::vector<double> &x, std::vector<double> &out) const
+{
+  int i, j, sz = diag.size();
+  for(i = 0; i < sz; ++i)
+    out[i] = diag[i] * x[i];
+  for(i = 0; i < sz; ++i)
+  {
+    for(j = rowStart[i]; j < rowStart[i + 1]; ++j)
+    {
+      out[i] += rowVal[j] * x[rowIdx[j]];
+      out[rowIdx[j]] += rowVal[j] * x[i];
+    }
+  }
+}
+
+
+void PCGSolver::precondition(const std::vector<double> &r, std::vector<double> &z) const
+{
+  int i, j, sz = diag.size();
+  if(preconditioner == JACOBI)
+  {
+    for(i = 0; i < sz; ++i)
+      z[i] = r[i] / diag[i];
+    return;
+  }
+
+  //L z' = r, then L^T z = z'
+  for(i = 0; i < sz; ++i)
+  {
+    double val = r[i];
+    for(j = rowStart[i]; j < rowStart[i + 1]; ++j)
+      val -= icVal[j] * z[rowIdx[j]];
+    z[i] = val / icDiag[i];
+  }
+  for(i = sz - 1; i >= 0; --i)
+  {
+    double val = z[i];
+    for(j = icColStart[i]; j < icColStart[i + 1]; ++j)
+      val -= icColVal[j] * z[icColIdx[j]];
+    z[i] = val / icDiag[i];
+  }
+}
+
+
+static double dot(const std::vector<double> &v1, const std::vector<double> &v2)
+{
+  double out = 0.;
+  for(int i = 0; i < (int)v1.size(); ++i)
+    out += v1[i] * v2[i];
+  return out;
+}
+
+
+int PCGSolver::solve(const std::vector<double> &b, std::vector<double> &x, double tolerance,
+int maxIterations) const
+{
+  int i, k, sz = diag.size();
+  if((int)b.size() != sz)
+    return -1;
+  x.resize(sz, 0.);
+
+  double bNorm = sqrt(dot(b, b));
+  if(bNorm == 0.)
+  {
+    x.assign(sz, 0.);
+    return 0;
+  }
+
+  std::vector<double> r(sz), z(sz), p(sz), ap(sz);
+  multiply(x, ap);
+  for(i = 0; i < sz; ++i)
+    r[i] = b[i] - ap[i];
+
+  precondition(r, z);
+  p = z;
+  double rz = dot(r, z);
+
+  for(k = 0; k < maxIterations; ++k)
+  {
+    if(sqrt(dot(r, r)) <= tolerance * bNorm)
+      return k;
+
+    multiply(p, ap);
+    double alpha = rz / dot(p, ap);
+    for(i = 0; i < sz; ++i)
+    {
+      x[i] += alpha * p[i];
+      r[i] -= alpha * ap[i];
+    }
+
+    precondition(r, z);
+    double newRz = dot(r, z);
+    double beta = newRz / rz;
+    rz = newRz;
+    for(i = 0; i < sz; ++i)
+      p[i] = z[i] + beta * p[i];
+  }
+
+  return sqrt(dot(r, r)) <= tolerance * bNorm ? k : -1;
+}
+
+
+size_t PCGSolver::bytes() const
+{
+  return sizeof(int) * (rowStart.size() + rowIdx.size() + icColStart.size() + icColIdx.size()) +
+    sizeof(double) * (rowVal.size() + diag.size() + icVal.size() + icColVal.size() + icDiag.size());
+}
+
+} // namespace Pinocchio
 
 //TAUCS
 #ifdef TAUCS
@@ -45,6 +301,45 @@ std::vector<int> SPDMatrix::computePerm() const
 }
 
 
+//TAUCS does its own analysis, so this only records the pattern
+struct SymbolicLLT
+{
+  int n;
+};
+
+
+SymbolicFactor::~SymbolicFactor()
+{
+  delete sym;
+}
+
+
+int SymbolicFactor::size() const
+{
+  return sym ? sym->n : 0;
+}
+
+
+SymbolicFactor *SPDMatrix::analyze(FactorStats *stats) const
+{
+  SymbolicFactor *out = new SymbolicFactor();
+  out->patternStart = m.rowStart;
+  out->patternIdx = m.idx;
+  out->sym = new SymbolicLLT();
+  out->sym->n = m.size();
+  out->stats.size = m.size();
+  if(stats)
+    *stats = out->stats;
+  return out;
+}
+
+
+LLTMatrix *SPDMatrix::factor(const SymbolicFactor &, FactorStats *stats) const
+{
+  return factor(stats);
+}
+
+
 class TaucsLLTMatrix : public LLTMatrix
 {
   public:
@@ -80,17 +375,21 @@ class TaucsLLTMatrix : public LLTMatrix
     friend class SPDMatrix;
 };
 
-LLTMatrix *SPDMatrix::factor() const
+LLTMatrix *SPDMatrix::factor(FactorStats *stats) const
 {
   //taucs_logfile("stdout");
   int i, j;
+  if(stats)
+  {
+    *stats = FactorStats();
+    stats->size = m.size();
+  }
   TaucsLLTMatrix *out = new TaucsLLTMatrix();
   int sz = out->sz = m.size();
   int nz = 0;
   Debugging::out() << "Size = " << sz << std::endl;
 
-  for(i = 0; i < sz; ++i)
-    nz += m[i].size();
+  nz = m.idx.size();
 
   out->m = taucs_ccs_create(sz, sz, nz, TAUCS_DOUBLE | TAUCS_SYMMETRIC | TAUCS_LOWER);
 
@@ -98,9 +397,9 @@ LLTMatrix *SPDMatrix::factor() const
   std::vector<std::vector<std::pair<int, double> > > mt(sz);
   for(i = 0; i < sz; ++i)
   {
-    for(j = 0; j < (int)m[i].size(); ++j)
+    for(j = m.rowStart[i]; j < m.rowStart[i + 1]; ++j)
     {
-      mt[m[i][j].first].push_back(std::make_pair(i, m[i][j].second));
+      mt[m.idx[j]].push_back(std::make_pair(i, m.val[j]));
     }
   }
 
@@ -146,14 +445,25 @@ class MyLLTMatrix : public LLTMatrix
   public:
     //solves it in place
     bool solve(std::vector<double> &b) const;
-    int size() const { return m.size(); }
+    bool solveMany(std::vector<double> &b, int k) const;
+    int size() const { return diag.size(); }
+    size_t bytes() const;
 
   private:
-    void initMt();
-    //off-diagonal values stored by rows
-    std::vector<std::vector<std::pair<int, double> > > m;
-    //off-diagonal values transposed stored by rows
-    std::vector<std::vector<std::pair<int, double> > > mt;
+    //fills the diagonal and the compressed arrays straight from the dense
+    //supernode blocks val of a factorization analyzed as sym
+    void setSupernodes(const SymbolicLLT &sym, const std::vector<double> &val);
+    //the forward and backward passes on a permuted block of k right hand
+    //sides stored like in solveMany
+    template<int K> void solveBlock(double *x, int k) const;
+
+    //off-diagonal values stored by rows (compressed): row i has columns
+    //rowIdx[rowStart[i]] ... rowIdx[rowStart[i + 1] - 1]
+    std::vector<int> rowStart, rowIdx;
+    std::vector<double> rowVal;
+    //the same values stored by columns, i.e. the rows of the transpose
+    std::vector<int> colStart, colIdx;
+    std::vector<double> colVal;
     //values on diagonal
     std::vector<double> diag;
     //permutation
@@ -163,6 +473,193 @@ class MyLLTMatrix : public LLTMatrix
 };
 
 std::vector<int> SPDMatrix::computePerm() const
+{
+  if(ordering == ORDER_MMD)
+    return computePermMMD();
+  return computePermAMD();
+}
+
+
+//Approximate minimum degree on the quotient graph (Amestoy, Davis and Duff).
+//An eliminated vertex becomes an element standing for the clique its
+//elimination creates, so cliques are never formed explicitly, and degrees are
+//upper bounds computed from the sizes of the elements instead of exact counts.
+std::vector<int> SPDMatrix::computePermAMD() const
+{
+  int i, j, k;
+  int sz = m.size();
+
+  //variable adjacency, elements adjacent to each variable, and variables
+  //of each element (indexed by the vertex it was created from)
+  std::vector<std::vector<int> > adj(sz), elems(sz), elemVars(sz);
+  for(i = 0; i < sz; ++i)
+  {
+    for(j = m.rowStart[i]; j < m.rowStart[i + 1]; ++j)
+    {
+      int c = m.idx[j];
+      if(c == i)
+        continue;
+      adj[i].push_back(c);
+      adj[c].push_back(i);
+    }
+  }
+
+  std::vector<bool> eliminated(sz, false), absorbed(sz, false);
+  std::vector<int> degree(sz), mark(sz, -1), wMark(sz, -1), w(sz, 0);
+
+  //degree lists
+  std::vector<int> head(sz + 1, -1), next(sz, -1), prev(sz, -1);
+  auto insert = [&](int v)
+  {
+    prev[v] = -1;
+    next[v] = head[degree[v]];
+    if(next[v] != -1)
+      prev[next[v]] = v;
+    head[degree[v]] = v;
+  };
+  auto remove = [&](int v)
+  {
+    if(prev[v] != -1)
+      next[prev[v]] = next[v];
+    else
+      head[degree[v]] = next[v];
+    if(next[v] != -1)
+      prev[next[v]] = prev[v];
+  };
+
+  for(i = 0; i < sz; ++i)
+  {
+    degree[i] = adj[i].size();
+    insert(i);
+  }
+
+  std::vector<int> out(sz);
+  int minDeg = 0;
+  for(k = 0; k < sz; ++k)
+  {
+    while(head[minDeg] == -1)
+      ++minDeg;
+    int p = head[minDeg];
+    remove(p);
+    out[p] = k;
+    eliminated[p] = true;
+
+    //the new element: neighbors of p and the variables of its elements,
+    //which are absorbed into it
+    std::vector<int> &lp = elemVars[p];
+    mark[p] = k;
+    for(i = 0; i < (int)adj[p].size(); ++i)
+    {
+      int v = adj[p][i];
+      if(!eliminated[v] && mark[v] != k)
+      {
+        mark[v] = k;
+        lp.push_back(v);
+      }
+    }
+    for(i = 0; i < (int)elems[p].size(); ++i)
+    {
+      int e = elems[p][i];
+      if(absorbed[e])
+        continue;
+      for(j = 0; j < (int)elemVars[e].size(); ++j)
+      {
+        int v = elemVars[e][j];
+        if(!eliminated[v] && mark[v] != k)
+        {
+          mark[v] = k;
+          lp.push_back(v);
+        }
+      }
+      absorbed[e] = true;
+      std::vector<int>().swap(elemVars[e]);
+    }
+    std::vector<int>().swap(adj[p]);
+    std::vector<int>().swap(elems[p]);
+
+    //prune the lists of the variables in the new element: absorbed
+    //elements go, and so do neighbors now covered by the new element
+    for(i = 0; i < (int)lp.size(); ++i)
+    {
+      int v = lp[i];
+      remove(v);
+
+      std::vector<int> &ve = elems[v];
+      int cnt = 0;
+      for(j = 0; j < (int)ve.size(); ++j)
+        if(!absorbed[ve[j]])
+          ve[cnt++] = ve[j];
+      ve.resize(cnt);
+      ve.push_back(p);
+
+      std::vector<int> &va = adj[v];
+      cnt = 0;
+      for(j = 0; j < (int)va.size(); ++j)
+        if(!eliminated[va[j]] && mark[va[j]] != k)
+          va[cnt++] = va[j];
+      va.resize(cnt);
+    }
+
+    //w[e] = |Le \ Lp| for the other elements touching Lp
+    for(i = 0; i < (int)lp.size(); ++i)
+    {
+      std::vector<int> &ve = elems[lp[i]];
+      for(j = 0; j + 1 < (int)ve.size(); ++j)
+      {
+        int e = ve[j];
+        if(wMark[e] != k)
+        {
+          wMark[e] = k;
+          std::vector<int> &vars = elemVars[e];
+          int cnt = 0;
+          for(int q = 0; q < (int)vars.size(); ++q)
+            if(!eliminated[vars[q]])
+              vars[cnt++] = vars[q];
+          vars.resize(cnt);
+          w[e] = cnt;
+        }
+        --w[e];
+      }
+    }
+
+    //approximate degrees
+    int lpSize = lp.size();
+    for(i = 0; i < lpSize; ++i)
+    {
+      int v = lp[i];
+      std::vector<int> &ve = elems[v];
+      int deg = adj[v].size() + lpSize - 1;
+      int cnt = 0;
+      for(j = 0; j + 1 < (int)ve.size(); ++j)
+      {
+        int e = ve[j];
+        //aggressive absorption: an element inside Lp is redundant
+        if(w[e] == 0)
+        {
+          absorbed[e] = true;
+          std::vector<int>().swap(elemVars[e]);
+          continue;
+        }
+        deg += w[e];
+        ve[cnt++] = e;
+      }
+      ve[cnt++] = p;
+      ve.resize(cnt);
+
+      deg = std::min(deg, degree[v] + lpSize - 1);
+      deg = std::min(deg, sz - k - 2);
+      degree[v] = std::max(deg, 0);
+      insert(v);
+      minDeg = std::min(minDeg, degree[v]);
+    }
+  }
+
+  return out;
+}
+
+
+//Minimum degree with explicit elimination cliques
+std::vector<int> SPDMatrix::computePermMMD() const
 {
   int i, j;
 
@@ -184,10 +681,10 @@ std::vector<int> SPDMatrix::computePerm() const
   std::vector<std::unordered_set<int> > neighbors(sz);
   for(i = 0; i < sz; ++i)
   {
-    for(j = 0; j < (int)m[i].size() - 1; ++j)
+    for(j = m.rowStart[i]; j < m.rowStart[i + 1] - 1; ++j)
     {
-      neighbors[i].insert(m[i][j].first);
-      neighbors[m[i][j].first].insert(i);
+      neighbors[i].insert(m.idx[j]);
+      neighbors[m.idx[j]].insert(i);
     }
   }
   for(i = 0; i < sz; ++i)
@@ -234,173 +731,607 @@ std::vector<int> SPDMatrix::computePerm() const
 }
 
 
-LLTMatrix *SPDMatrix::factor() const
+//Symbolic analysis for the supernodal Cholesky factorization--everything
+//that depends only on the nonzero pattern.  Factor columns are numbered in a
+//postorder of the elimination tree, so every supernode (a run of columns
+//with the same structure below the diagonal) is contiguous.
+struct SymbolicLLT
 {
-  int i, j, k;
-  MyLLTMatrix *outP = new MyLLTMatrix();
-  MyLLTMatrix &out = *outP;
-  int sz = m.size();
-  out.m.resize(sz);
-  out.diag.resize(sz);
-
-  Debugging::out() << "Factoring size = " << sz << std::endl;
-
-  out.perm = computePerm();
+  int n;
+  //original index -> factor index
+  std::vector<int> perm;
+  //supernode s has columns snStart[s] ... snStart[s + 1] - 1
+  std::vector<int> snStart;
+  //sorted row indices of supernode s, starting with its own columns:
+  //rows[rowStart[s]] ... rows[rowStart[s + 1] - 1]
+  std::vector<int> rowStart, rows;
+  //offset of the dense (column-major, rows x columns) block of supernode s
+  std::vector<size_t> valStart;
+  //supernodes whose columns update supernode s, along with the position in
+  //the updater's rows of the first row at or below s's first column
+  std::vector<int> updStart;
+  std::vector<std::pair<int, int> > upd;
+  //supernodes by height in the supernodal elimination tree--no supernode
+  //updates another one of the same height
+  std::vector<int> levelStart, levelNodes;
+};
 
-  Debugging::out() << "Perm computed" << std::endl;
 
-  //permute matrix according to the permuation
-  std::vector<std::vector<std::pair<int, double> > > pm(sz);
+//lower triangle of the matrix permuted by perm, stored by rows
+static void permuteLower(const SparseLower &m, const std::vector<int> &perm,
+std::vector<std::vector<std::pair<int, double> > > &pm)
+{
+  int i, j, sz = m.size();
+  pm.assign(sz, std::vector<std::pair<int, double> >());
   for(i = 0; i < sz; ++i)
   {
-    for(j = 0; j < (int)m[i].size(); ++j)
+    for(j = m.rowStart[i]; j < m.rowStart[i + 1]; ++j)
     {
-      int ni = out.perm[i], nidx = out.perm[m[i][j].first];
+      int ni = perm[i], nidx = perm[m.idx[j]];
       if(ni >= nidx)
-        pm[ni].push_back(std::make_pair(nidx, m[i][j].second));
+        pm[ni].push_back(std::make_pair(nidx, m.val[j]));
       else
-        pm[nidx].push_back(std::make_pair(ni, m[i][j].second));
+        pm[nidx].push_back(std::make_pair(ni, m.val[j]));
     }
   }
   for(i = 0; i < sz; ++i)
     sort(pm[i].begin(), pm[i].end());
+}
 
-  //prepare for decomposition
-  std::vector<std::vector<std::pair<int, double> > > cols(sz);
-  //inverses of out.diag
-  std::vector<double> dinv(sz);
 
-  std::vector<bool> added(sz, false);
+//elimination tree of a matrix given by the rows of its lower triangle
+static std::vector<int> eliminationTree(const std::vector<std::vector<std::pair<int, double> > > &pm)
+{
+  int i, j, sz = pm.size();
+  std::vector<int> parent(sz, -1), ancestor(sz, -1);
+  for(i = 0; i < sz; ++i)
+  {
+    for(j = 0; j < (int)pm[i].size(); ++j)
+    {
+      //walk up from the column to the root of its current subtree,
+      //compressing the path to i
+      int k = pm[i][j].first;
+      while(k != -1 && k < i)
+      {
+        int next = ancestor[k];
+        ancestor[k] = i;
+        if(next == -1)
+          parent[k] = i;
+        k = next;
+      }
+    }
+  }
+  return parent;
+}
+
+
+static SymbolicLLT *analyzePattern(const SparseLower &m,
+const std::vector<int> &fillPerm)
+{
+  int i, j, k, s;
+  int sz = m.size();
+  SymbolicLLT *out = new SymbolicLLT();
+  SymbolicLLT &sym = *out;
+  sym.n = sz;
 
-  //Sparse cholesky decomposition
-  //current row
+  std::vector<std::vector<std::pair<int, double> > > pm;
+  permuteLower(m, fillPerm, pm);
+  std::vector<int> parent = eliminationTree(pm);
+
+  //postorder the tree (children are visited in increasing order)
+  std::vector<int> childStart(sz + 1, 0), children(sz);
+  for(i = 0; i < sz; ++i)
+    if(parent[i] != -1)
+      ++childStart[parent[i] + 1];
+  for(i = 0; i < sz; ++i)
+    childStart[i + 1] += childStart[i];
+  std::vector<int> childPos(childStart.begin(), childStart.end() - 1);
+  for(i = 0; i < sz; ++i)
+    if(parent[i] != -1)
+      children[childPos[parent[i]]++] = i;
+
+  //each subtree only advances the positions of its own nodes, so they are
+  //reset once for all the roots
+  std::vector<int> post(sz), todo;
+  int cnt = 0;
+  childPos.assign(childStart.begin(), childStart.end() - 1);
   for(i = 0; i < sz; ++i)
   {
-    std::vector<int> columnsAdded;
-    columnsAdded.reserve(2 * pm[i].size());
+    if(parent[i] != -1)
+      continue;
+    //iterative dfs: a node is emitted after all its children
+    todo.push_back(i);
+    while(!todo.empty())
+    {
+      int cur = todo.back();
+      if(childPos[cur] < childStart[cur + 1])
+        todo.push_back(children[childPos[cur]++]);
+      else
+      {
+        post[cur] = cnt++;
+        todo.pop_back();
+      }
+    }
+  }
+
+  sym.perm.resize(sz);
+  for(i = 0; i < sz; ++i)
+    sym.perm[i] = post[fillPerm[i]];
+
+  //the postordered tree
+  permuteLower(m, sym.perm, pm);
+  parent = eliminationTree(pm);
+
+  //column counts (including the diagonal) from the row subtrees
+  std::vector<int> colCount(sz, 1), mark(sz, -1), childCount(sz, 0);
+  for(i = 0; i < sz; ++i)
+  {
+    mark[i] = i;
+    for(j = 0; j < (int)pm[i].size(); ++j)
+    {
+      for(k = pm[i][j].first; mark[k] != i; k = parent[k])
+      {
+        ++colCount[k];
+        mark[k] = i;
+      }
+    }
+    if(parent[i] != -1)
+      ++childCount[parent[i]];
+  }
+
+  //fundamental supernodes
+  std::vector<int> snode(sz);
+  for(i = 0; i < sz; ++i)
+  {
+    if(i == 0 || parent[i - 1] != i || childCount[i] != 1 || colCount[i - 1] != colCount[i] + 1)
+      sym.snStart.push_back(i);
+    snode[i] = sym.snStart.size() - 1;
+  }
+  int ns = sym.snStart.size();
+  sym.snStart.push_back(sz);
 
-    //compute columnsAdded (nonzero indices of factor in current row)
-    int inCA = 0;
-    for(j = 0; j < (int)pm[i].size() - 1; ++j)
+  //columns of the lower triangle
+  std::vector<std::vector<int> > cols(sz);
+  for(i = 0; i < sz; ++i)
+    for(j = 0; j < (int)pm[i].size(); ++j)
+      cols[pm[i][j].first].push_back(i);
+
+  //row structure: the supernode's columns, the rows of the matrix in them and
+  //the rows of the children below the children's columns
+  std::vector<int> snParent(ns, -1);
+  std::vector<std::vector<int> > snChildren(ns);
+  for(s = 0; s < ns; ++s)
+  {
+    int last = sym.snStart[s + 1] - 1;
+    if(parent[last] != -1)
     {
-      added[pm[i][j].first] = true;
-      columnsAdded.push_back(pm[i][j].first);
+      snParent[s] = snode[parent[last]];
+      snChildren[snParent[s]].push_back(s);
     }
-    while(inCA < (int)columnsAdded.size())
+  }
+
+  sym.rowStart.push_back(0);
+  mark.assign(sz, -1);
+  for(s = 0; s < ns; ++s)
+  {
+    int first = sym.snStart[s], end = sym.snStart[s + 1];
+    std::vector<int> rows;
+    for(j = first; j < end; ++j)
     {
-      int idx = columnsAdded[inCA];
-      ++inCA;
-      for(k = 0; k < (int)cols[idx].size(); ++k)
+      rows.push_back(j);
+      mark[j] = s;
+    }
+    for(j = first; j < end; ++j)
+    {
+      for(k = 0; k < (int)cols[j].size(); ++k)
+      {
+        int r = cols[j][k];
+        if(mark[r] != s)
+        {
+          mark[r] = s;
+          rows.push_back(r);
+        }
+      }
+    }
+    for(i = 0; i < (int)snChildren[s].size(); ++i)
+    {
+      int c = snChildren[s][i];
+      for(k = sym.rowStart[c] + sym.snStart[c + 1] - sym.snStart[c]; k < sym.rowStart[c + 1]; ++k)
       {
-        int curCol = cols[idx][k].first;
-        if(!added[curCol])
+        int r = sym.rows[k];
+        if(mark[r] != s)
         {
-          added[curCol] = true;
-          columnsAdded.push_back(curCol);
+          mark[r] = s;
+          rows.push_back(r);
         }
       }
     }
-    sort(columnsAdded.begin(), columnsAdded.end());
+    sort(rows.begin() + (end - first), rows.end());
+    sym.rows.insert(sym.rows.end(), rows.begin(), rows.end());
+    sym.rowStart.push_back(sym.rows.size());
+  }
+
+  sym.valStart.resize(ns + 1);
+  sym.valStart[0] = 0;
+  for(s = 0; s < ns; ++s)
+    sym.valStart[s + 1] = sym.valStart[s] +
+      size_t(sym.rowStart[s + 1] - sym.rowStart[s]) * size_t(sym.snStart[s + 1] - sym.snStart[s]);
+
+  //updaters: a supernode updates every supernode that one of its rows below
+  //its own columns falls into (rows are sorted, so those come in runs)
+  std::vector<std::vector<std::pair<int, int> > > upd(ns);
+  for(s = 0; s < ns; ++s)
+  {
+    int prevTarget = -1;
+    for(k = sym.rowStart[s] + sym.snStart[s + 1] - sym.snStart[s]; k < sym.rowStart[s + 1]; ++k)
+    {
+      int t = snode[sym.rows[k]];
+      if(t != prevTarget)
+        upd[t].push_back(std::make_pair(s, k - sym.rowStart[s]));
+      prevTarget = t;
+    }
+  }
+  sym.updStart.push_back(0);
+  for(s = 0; s < ns; ++s)
+  {
+    sym.upd.insert(sym.upd.end(), upd[s].begin(), upd[s].end());
+    sym.updStart.push_back(sym.upd.size());
+  }
+
+  //levels (children always come before their parents)
+  std::vector<int> level(ns, 0);
+  int levels = 0;
+  for(s = 0; s < ns; ++s)
+  {
+    if(snParent[s] != -1)
+      level[snParent[s]] = std::max(level[snParent[s]], level[s] + 1);
+    levels = std::max(levels, level[s] + 1);
+  }
+  sym.levelStart.assign(levels + 1, 0);
+  for(s = 0; s < ns; ++s)
+    ++sym.levelStart[level[s] + 1];
+  for(i = 0; i < levels; ++i)
+    sym.levelStart[i + 1] += sym.levelStart[i];
+  sym.levelNodes.resize(ns);
+  std::vector<int> levelPos(sym.levelStart.begin(), sym.levelStart.end() - 1);
+  for(s = 0; s < ns; ++s)
+    sym.levelNodes[levelPos[level[s]]++] = s;
+
+  return out;
+}
+
+
+//dense kernels on column-major blocks with leading dimension ld
+
+//C (m x n, leading dimension m) = A (m x k) * B (n x k)^T
+static void denseMultABt(const double *a, const double *b, int ld, int m, int n, int k, double *c)
+{
+  int i, j, p;
+  for(i = 0; i < m * n; ++i)
+    c[i] = 0.;
+  for(j = 0; j < n; ++j)
+  {
+    double *cj = c + j * m;
+    for(p = 0; p < k; ++p)
+    {
+      const double *ap = a + p * ld;
+      double bjp = b[j + p * ld];
+      for(i = 0; i < m; ++i)
+        cj[i] += ap[i] * bjp;
+    }
+  }
+}
+
+
+//Cholesky factorization of the top n x n block of an m x n panel, with the
+//rows below solved against it (potrf and trsm in one left-looking sweep)
+static bool denseFactorPanel(double *a, int ld, int m, int n)
+{
+  int i, j, p;
+  for(j = 0; j < n; ++j)
+  {
+    double *aj = a + j * ld;
+    for(p = 0; p < j; ++p)
+    {
+      const double *ap = a + p * ld;
+      double ljp = ap[j];
+      for(i = j; i < m; ++i)
+        aj[i] -= ap[i] * ljp;
+    }
+    if(aj[j] <= 0.)
+      return false;
+    double d = sqrt(aj[j]);
+    aj[j] = d;
+    double dinv = 1. / d;
+    for(i = j + 1; i < m; ++i)
+      aj[i] *= dinv;
+  }
+  return true;
+}
+
+
+//computes the dense block of supernode s from the matrix (given by the
+//columns of its permuted lower triangle) and the finished blocks of its
+//updaters
+static bool factorSupernode(const SymbolicLLT &sym, const std::vector<std::vector<std::pair<int, double> > > &cols,
+std::vector<double> &val, int s, std::vector<double> &work, std::vector<int> &rel)
+{
+  int i, j, k;
+  int first = sym.snStart[s], nc = sym.snStart[s + 1] - first;
+  const int *rows = &sym.rows[sym.rowStart[s]];
+  int m = sym.rowStart[s + 1] - sym.rowStart[s];
+  double *ls = &val[sym.valStart[s]];
+
+  for(i = 0; i < m * nc; ++i)
+    ls[i] = 0.;
+  for(j = 0; j < nc; ++j)
+  {
+    const std::vector<std::pair<int, double> > &col = cols[first + j];
+    for(k = 0; k < (int)col.size(); ++k)
+    {
+      int pos = std::lower_bound(rows, rows + m, col[k].first) - rows;
+      ls[pos + j * m] = col[k].second;
+    }
+  }
 
-    //add the columns and clear added
-    for(j = 0; j < (int)columnsAdded.size(); ++j)
+  for(k = sym.updStart[s]; k < sym.updStart[s + 1]; ++k)
+  {
+    int d = sym.upd[k].first, p0 = sym.upd[k].second;
+    const int *drows = &sym.rows[sym.rowStart[d]];
+    int dm = sym.rowStart[d + 1] - sym.rowStart[d], dn = sym.snStart[d + 1] - sym.snStart[d];
+    const double *ld = &val[sym.valStart[d]];
+
+    int p1 = p0;
+    while(p1 < dm && drows[p1] < first + nc)
+      ++p1;
+
+    //the rows of d from p0 on are a subset of the rows of s
+    int cm = dm - p0, cn = p1 - p0;
+    rel.resize(cm);
+    for(i = 0, j = 0; i < cm; ++i)
     {
-      added[columnsAdded[j]] = false;
-      cols[columnsAdded[j]].push_back(std::make_pair(i, 0.));
+      while(rows[j] != drows[p0 + i])
+        ++j;
+      rel[i] = j;
     }
 
-    //initialize it with m's entries
-    for(j = 0; j < (int)pm[i].size() - 1; ++j)
+    work.resize(cm * cn);
+    denseMultABt(ld + p0, ld + p0, dm, cm, cn, dn, &work[0]);
+    for(j = 0; j < cn; ++j)
     {
-      int curCol = pm[i][j].first;
-      cols[curCol].back().second = pm[i][j].second * dinv[curCol];
+      double *lsj = ls + (drows[p0 + j] - first) * m;
+      const double *wj = &work[j * cm];
+      for(i = j; i < cm; ++i)
+        lsj[rel[i]] -= wj[i];
     }
-    //current column
-    for(j = 0; j < (int)columnsAdded.size(); ++j)
+  }
+
+  return denseFactorPanel(ls, m, m, nc);
+}
+
+
+static double secondsSince(const std::chrono::steady_clock::time_point &start)
+{
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+
+SymbolicFactor::~SymbolicFactor()
+{
+  delete sym;
+}
+
+
+int SymbolicFactor::size() const
+{
+  return sym ? sym->n : 0;
+}
+
+
+SymbolicFactor *SPDMatrix::analyze(FactorStats *stats) const
+{
+  int s;
+  int sz = m.size();
+  FactorStats curStats;
+  curStats.size = sz;
+
+  SymbolicFactor *out = new SymbolicFactor();
+  out->patternStart = m.rowStart;
+  out->patternIdx = m.idx;
+  curStats.nonzeros = m.idx.size();
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  std::vector<int> fillPerm = computePerm();
+  curStats.orderingTime = secondsSince(start);
+
+  start = std::chrono::steady_clock::now();
+  out->sym = analyzePattern(m, fillPerm);
+  const SymbolicLLT &sym = *out->sym;
+  int ns = sym.snStart.size() - 1;
+  curStats.symbolicTime = secondsSince(start);
+  curStats.supernodes = ns;
+  for(s = 0; s < ns; ++s)
+  {
+    long cm = sym.rowStart[s + 1] - sym.rowStart[s], nc = sym.snStart[s + 1] - sym.snStart[s];
+    curStats.factorNonzeros += nc * cm - nc * (nc - 1) / 2;
+  }
+
+  Debugging::out() << "Analyzed: " << (ordering == ORDER_MMD ? "MMD" : "AMD") << " nonzeros = " << curStats.factorNonzeros
+    << " (matrix " << curStats.nonzeros << ") supernodes = " << ns << " ordering " << curStats.orderingTime
+    << "s symbolic " << curStats.symbolicTime << "s" << std::endl;
+
+  out->stats = curStats;
+  if(stats)
+    *stats = curStats;
+  return out;
+}
+
+
+LLTMatrix *SPDMatrix::factor(FactorStats *stats) const
+{
+  Debugging::out() << "Factoring size = " << m.size() << std::endl;
+
+  FactorStats curStats;
+  SymbolicFactor *symbolic = analyze(&curStats);
+  LLTMatrix *out = factor(*symbolic, stats);
+  if(stats)
+  {
+    stats->orderingTime = curStats.orderingTime;
+    stats->symbolicTime = curStats.symbolicTime;
+  }
+  delete symbolic;
+  return out;
+}
+
+
+LLTMatrix *SPDMatrix::factor(const SymbolicFactor &symbolic, FactorStats *stats) const
+{
+  int i, j, k;
+  int sz = m.size();
+
+  if(!symbolic.matches(m))
+  {
+    Debugging::out() << "Symbolic factorization is for a different pattern" << std::endl;
+    return factor(stats);
+  }
+
+  const SymbolicLLT &sym = *symbolic.sym;
+  int ns = sym.snStart.size() - 1;
+  //the analysis was done already, so it costs nothing here
+  FactorStats curStats = symbolic.stats;
+  curStats.orderingTime = curStats.symbolicTime = 0.;
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+  //columns of the permuted lower triangle
+  std::vector<std::vector<std::pair<int, double> > > pm, cols(sz);
+  permuteLower(m, sym.perm, pm);
+  for(i = 0; i < sz; ++i)
+    for(j = 0; j < (int)pm[i].size(); ++j)
+      cols[pm[i][j].first].push_back(std::make_pair(i, pm[i][j].second));
+  std::vector<std::vector<std::pair<int, double> > >().swap(pm);
+
+  //numeric factorization, one level of the supernodal tree at a time
+  std::vector<double> val(sym.valStart[ns]);
+  std::vector<double> work;
+  std::vector<int> rel;
+  std::atomic<bool> ok(true);
+  ThreadPool &pool = ThreadPool::global();
+  for(k = 0; k + 1 < (int)sym.levelStart.size() && ok; ++k)
+  {
+    int lsz = sym.levelStart[k + 1] - sym.levelStart[k];
+    const int *nodes = &sym.levelNodes[sym.levelStart[k]];
+    if(pool.size() > 1 && lsz > 1)
     {
-      int idx = columnsAdded[j];
-      int csz = cols[idx].size() - 1;
-      //index in column above current row -- inner loop
-      for(k = 0; k < csz; ++k)
+      pool.parallelFor(lsz, [&](int idx)
       {
-        //index into current row
-        int tidx = cols[idx][k].first;
-        double prod = cols[idx][k].second * cols[idx].back().second * dinv[tidx];
-        cols[tidx].back().second -= prod;
-      }
+        std::vector<double> tWork;
+        std::vector<int> tRel;
+        if(!factorSupernode(sym, cols, val, nodes[idx], tWork, tRel))
+          ok = false;
+      });
     }
-    //now diagonal
-    out.diag[i] = pm[i].back().second;
-    for(j = 0; j < (int)columnsAdded.size(); ++j)
+    else
     {
-      double val = cols[columnsAdded[j]].back().second;
-      out.diag[i] -= SQR(val);
-      //also add rows to output
-      out.m[i].push_back(std::make_pair(columnsAdded[j], val));
+      for(i = 0; i < lsz; ++i)
+        if(!factorSupernode(sym, cols, val, nodes[i], work, rel))
+          ok = false;
     }
+  }
+
+  if(!ok)
+  {
     //not positive definite
-    if(out.diag[i] <= 0.)
-    {
-      assert(false && "Not positive definite matrix (or ill-conditioned)");
-      delete outP;
-      return new MyLLTMatrix();
-    }
-    out.diag[i] = sqrt(out.diag[i]);
-    dinv[i] = 1. / out.diag[i];
-  }
-
-  out.initMt();
-
-  /* Error check
-  double totErr = 0;
-  for(i = 0; i < m.size(); ++i) {
-      for(j = 0; j < m[i].size(); ++j) {
-          int q = m[i][j].first;
-          double total = -m[i][j].second;
-          out.m[i].push_back(std::make_pair(i, out.diag[i]));
-          if(i != q) out.m[q].push_back(std::make_pair(q, out.diag[q]));
-          for(k = 0; k < out.m[i].size(); ++k) {
-              for(int z = 0; z < out.m[q].size(); ++z) {
-                  if(out.m[i][k].first != out.m[q][z].first)
-                      continue;
-                  total += out.m[i][k].second * out.m[q][z].second;
-              }
-          }
-          out.m[i].pop_back();
-          if(i != q) out.m[q].pop_back();
-
-          totErr += fabs(total);
-      }
+    assert(false && "Not positive definite matrix (or ill-conditioned)");
+    return new MyLLTMatrix();
   }
-  */
+
+  MyLLTMatrix *outP = new MyLLTMatrix();
+  MyLLTMatrix &out = *outP;
+  out.perm = sym.perm;
+  out.setSupernodes(sym, val);
+  curStats.numericTime = secondsSince(start);
+  curStats.factorBytes = out.bytes();
+  curStats.numericBytes = sizeof(double) * val.size();
+
+  Debugging::out() << "Factored: numeric " << curStats.numericTime << "s" << std::endl;
+  if(stats)
+    *stats = curStats;
 
   return outP;
 }
 
 
-//compute the transposed entries (by rows)
-void MyLLTMatrix::initMt()
+//The rows of supernode s from the k-th on have an entry in each of its
+//first min(k, nc) columns, so the sizes of the rows and the columns come from
+//the analysis alone.  The entries of a row are written in increasing column
+//order and those of a column in increasing row order.
+void MyLLTMatrix::setSupernodes(const SymbolicLLT &sym, const std::vector<double> &val)
 {
-  int i, j;
+  int i, j, s, sz = sym.n, ns = sym.snStart.size() - 1;
+
+  diag.resize(sz);
+  rowStart.assign(sz + 1, 0);
+  colStart.assign(sz + 1, 0);
+  for(s = 0; s < ns; ++s)
+  {
+    int first = sym.snStart[s], nc = sym.snStart[s + 1] - first;
+    const int *rows = &sym.rows[sym.rowStart[s]];
+    int cm = sym.rowStart[s + 1] - sym.rowStart[s];
+    for(j = 0; j < nc; ++j)
+      colStart[first + j + 1] = cm - j - 1;
+    for(i = 1; i < cm; ++i)
+      rowStart[rows[i] + 1] += std::min(i, nc);
+  }
+  for(i = 0; i < sz; ++i)
+  {
+    rowStart[i + 1] += rowStart[i];
+    colStart[i + 1] += colStart[i];
+  }
 
-  mt.clear();
-  mt.resize(m.size());
+  int nz = rowStart[sz];
+  rowIdx.resize(nz);
+  rowVal.resize(nz);
+  colIdx.resize(nz);
+  colVal.resize(nz);
 
-  for(i = 0; i < (int)m.size(); ++i)
+  std::vector<int> rowPos(rowStart.begin(), rowStart.end() - 1);
+  for(s = 0; s < ns; ++s)
   {
-    for(j = 0; j < (int)m[i].size(); ++j)
+    int first = sym.snStart[s], nc = sym.snStart[s + 1] - first;
+    const int *rows = &sym.rows[sym.rowStart[s]];
+    int cm = sym.rowStart[s + 1] - sym.rowStart[s];
+    const double *ls = &val[sym.valStart[s]];
+    for(j = 0; j < nc; ++j)
     {
-      mt[m[i][j].first].push_back(std::make_pair(i, m[i][j].second));
+      const double *lj = ls + j * cm;
+      diag[first + j] = lj[j];
+      int pos = colStart[first + j];
+      for(i = j + 1; i < cm; ++i, ++pos)
+      {
+        colIdx[pos] = rows[i];
+        colVal[pos] = lj[i];
+        int rp = rowPos[rows[i]]++;
+        rowIdx[rp] = first + j;
+        rowVal[rp] = lj[i];
+      }
     }
   }
 }
 
 
+size_t MyLLTMatrix::bytes() const
+{
+  return sizeof(int) * (rowStart.size() + rowIdx.size() + colStart.size() + colIdx.size() + perm.size()) +
+    sizeof(double) * (rowVal.size() + colVal.size() + diag.size());
+}
+
+
 bool MyLLTMatrix::solve(std::vector<double> &b) const
 {
   int i, j;
 
-  if(b.size() != m.size())
+  if(b.size() != diag.size())
     return false;
 
   std::vector<double> bp(b.size());
@@ -411,16 +1342,16 @@ bool MyLLTMatrix::solve(std::vector<double> &b) const
   //solve L (L^T x) = b for (L^T x)
   for(i = 0; i < (int)bp.size(); ++i)
   {
-    for(j = 0; j < (int)m[i].size(); ++j)
-      bp[i] -= bp[m[i][j].first] * m[i][j].second;
+    for(j = rowStart[i]; j < rowStart[i + 1]; ++j)
+      bp[i] -= bp[rowIdx[j]] * rowVal[j];
     bp[i] /= diag[i];
   }
 
   //solve L^T x = b for x
   for(i = bp.size() - 1; i >= 0; --i)
   {
-    for(j = 0; j < (int)mt[i].size(); ++j)
-      bp[i] -= bp[mt[i][j].first] * mt[i][j].second;
+    for(j = colStart[i]; j < colStart[i + 1]; ++j)
+      bp[i] -= bp[colIdx[j]] * colVal[j];
     bp[i] /= diag[i];
   }
 
@@ -431,6 +1362,78 @@ bool MyLLTMatrix::solve(std::vector<double> &b) const
   return true;
 }
 
+
+//K is the block width known at compile time (so the inner loops can be
+//unrolled and vectorized), or 0 to use k.  Every right hand side goes
+//through the same operations as in solve, so the results are identical.
+template<int K> void MyLLTMatrix::solveBlock(double *x, int k) const
+{
+  int i, j, c, sz = diag.size();
+  const int w = K ? K : k;
+
+  for(i = 0; i < sz; ++i)
+  {
+    double *xi = x + i * w;
+    for(j = rowStart[i]; j < rowStart[i + 1]; ++j)
+    {
+      const double *xj = x + rowIdx[j] * w;
+      double v = rowVal[j];
+      for(c = 0; c < w; ++c)
+        xi[c] -= xj[c] * v;
+    }
+    for(c = 0; c < w; ++c)
+      xi[c] /= diag[i];
+  }
+
+  for(i = sz - 1; i >= 0; --i)
+  {
+    double *xi = x + i * w;
+    for(j = colStart[i]; j < colStart[i + 1]; ++j)
+    {
+      const double *xj = x + colIdx[j] * w;
+      double v = colVal[j];
+      for(c = 0; c < w; ++c)
+        xi[c] -= xj[c] * v;
+    }
+    for(c = 0; c < w; ++c)
+      xi[c] /= diag[i];
+  }
+}
+
+
+bool MyLLTMatrix::solveMany(std::vector<double> &b, int k) const
+{
+  //right hand sides per pass over the factor
+  const int blockSize = 8;
+  int i, c, c0, sz = diag.size();
+
+  if(k <= 0 || (int)b.size() != sz * k)
+    return false;
+
+  std::vector<double> x(sz * std::min(k, blockSize));
+  for(c0 = 0; c0 < k; c0 += blockSize)
+  {
+    int w = std::min(blockSize, k - c0);
+
+    //permute the block into x
+    for(i = 0; i < sz; ++i)
+      for(c = 0; c < w; ++c)
+        x[perm[i] * w + c] = b[i * k + c0 + c];
+
+    if(w == blockSize)
+      solveBlock<blockSize>(&x[0], w);
+    else
+      solveBlock<0>(&x[0], w);
+
+    //unpermute
+    for(i = 0; i < sz; ++i)
+      for(c = 0; c < w; ++c)
+        b[i * k + c0 + c] = x[perm[i] * w + c];
+  }
+
+  return true;
+}
+
 } // namespace Pinocchio
 
 #endif
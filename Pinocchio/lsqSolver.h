@@ -35,9 +35,77 @@ class LLTMatrix {
   public:
     virtual ~LLTMatrix() {}
     virtual bool solve(std::vector<double> &b) const = 0;
+    //solves for k right hand sides at once, in place: b has size() * k
+    //entries, row i holding entries i of all k vectors next to each other
+    //(b[i * k + c] is entry i of vector c).  The default solves them one by one.
+    virtual bool solveMany(std::vector<double> &b, int k) const;
     virtual int size() const = 0;
 };
 
+/**
+ * What a factorization cost -- nonzeros count the lower triangle including the
+ * diagonal, so the fill is factorNonzeros - nonzeros.  Times are wall clock seconds.
+ */
+struct FactorStats {
+  FactorStats() : size(0), nonzeros(0), factorNonzeros(0), supernodes(0), factorBytes(0), numericBytes(0),
+    orderingTime(0.), symbolicTime(0.), numericTime(0.) {}
+
+  int size;
+  long nonzeros;
+  long factorNonzeros;
+  int supernodes;
+  size_t factorBytes; //storage of the finished factor
+  size_t numericBytes; //dense supernode storage used while factoring
+  double orderingTime;
+  double symbolicTime;
+  double numericTime;
+};
+
+/**
+ * Lower triangle of a sparse symmetric matrix compressed by rows: row i has
+ * columns idx[rowStart[i]] ... idx[rowStart[i + 1] - 1] in increasing order,
+ * ending with the diagonal, and the values at the same positions in val
+ */
+struct SparseLower {
+  SparseLower() : rowStart(1, 0) {}
+  //from rows of the lower triangle in the same order
+  explicit SparseLower(const std::vector<std::vector<std::pair<int, double> > > &rows);
+
+  int size() const { return (int)rowStart.size() - 1; }
+
+  std::vector<int> rowStart, idx;
+  std::vector<double> val;
+};
+
+struct SymbolicLLT;
+
+/**
+ * Ordering and nonzero structure of a Cholesky factorization, computed from the
+ * nonzero pattern of a matrix alone -- matrices with the same pattern but
+ * different values can be factored with it, skipping straight to the numeric work
+ */
+class SymbolicFactor {
+  public:
+    ~SymbolicFactor();
+
+    int size() const;
+    //whether the lower triangle m has exactly the pattern this was computed for
+    bool matches(const SparseLower &m) const;
+    //ordering and symbolic times and the sizes of the factor
+    const FactorStats &getStats() const { return stats; }
+
+  private:
+    SymbolicFactor() : sym(NULL) {}
+    SymbolicFactor(const SymbolicFactor &);
+    SymbolicFactor &operator=(const SymbolicFactor &);
+    SymbolicLLT *sym;
+    //the pattern analyzed, by rows
+    std::vector<int> patternStart, patternIdx;
+    FactorStats stats;
+
+    friend class SPDMatrix;
+};
+
 /**
  * Represents a symmetric positive definite (spd) matrix --
  * primary intended use is inside LSQSystem (because it's symmetric, only the lower triangle
@@ -45,15 +113,75 @@ class LLTMatrix {
  */
 class SPDMatrix {
   public:
-    SPDMatrix(const std::vector<std::vector<std::pair<int, double> > > &inM) : m(inM) {}
-    LLTMatrix *factor() const;
+    //fill-reducing orderings:
+    // ORDER_MMD minimum degree, forming the elimination cliques explicitly
+    // ORDER_AMD approximate minimum degree on the quotient graph
+    enum { ORDER_MMD = 0, ORDER_AMD = 1 };
+
+    SPDMatrix(const std::vector<std::vector<std::pair<int, double> > > &inM, int inOrdering = ORDER_AMD)
+      : m(inM), ordering(inOrdering) {}
+    SPDMatrix(const SparseLower &inM, int inOrdering = ORDER_AMD)
+      : m(inM), ordering(inOrdering) {}
+    LLTMatrix *factor(FactorStats *stats = NULL) const;
+
+    //the symbolic phase alone (be sure to delete the result)
+    SymbolicFactor *analyze(FactorStats *stats = NULL) const;
+    //numeric factorization reusing an analysis of the same pattern--if the
+    //pattern doesn't match, this falls back to a full factorization
+    LLTMatrix *factor(const SymbolicFactor &symbolic, FactorStats *stats = NULL) const;
 
   private:
     //computes a fill-reduction permutation
     std::vector<int> computePerm() const;
+    std::vector<int> computePermMMD() const;
+    std::vector<int> computePermAMD() const;
 
-    //rows -- lower triangle
-    std::vector<std::vector<std::pair<int, double> > > m;
+    //lower triangle
+    SparseLower m;
+    int ordering;
+};
+
+/**
+ * Preconditioned conjugate gradients for a symmetric positive definite matrix
+ * given by its lower triangle -- there is no fill, so it works where factoring
+ * runs out of memory.  solve is const and can be called from several threads
+ * at once.
+ */
+class PCGSolver {
+  public:
+    //preconditioners:
+    // JACOBI diagonal scaling
+    // IC0 incomplete Cholesky with the pattern of the matrix (falls back to
+    //     JACOBI if it breaks down)
+    enum { JACOBI = 0, IC0 = 1 };
+
+    PCGSolver(const SparseLower &m, int inPreconditioner = IC0);
+
+    int size() const { return diag.size(); }
+    int getPreconditioner() const { return preconditioner; }
+
+    //solves Ax = b starting from the guess in x, until the residual is at most
+    //tolerance * |b|.  Returns the iterations taken, or -1 if it didn't get
+    //there in maxIterations (x is still the last iterate).
+    int solve(const std::vector<double> &b, std::vector<double> &x, double tolerance, int maxIterations) const;
+
+    //storage for the matrix and the preconditioner
+    size_t bytes() const;
+
+  private:
+    void multiply(const std::vector<double> &x, std::vector<double> &out) const;
+    void precondition(const std::vector<double> &r, std::vector<double> &z) const;
+    bool factorIC0();
+
+    int preconditioner;
+    //strict lower triangle by rows (compressed) and the diagonal
+    std::vector<int> rowStart, rowIdx;
+    std::vector<double> rowVal, diag;
+    //incomplete factor: values with the same pattern as the strict lower
+    //triangle, the same values by columns, and the diagonal
+    std::vector<double> icVal;
+    std::vector<int> icColStart, icColIdx;
+    std::vector<double> icColVal, icDiag;
 };
 
 /**
@@ -0,0 +1,79 @@
+/*  This file is part of the Pinocchio automatic rigging library.
+    Copyright (C) 2007 Ilya Baran (ibaran@mit.edu)
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifdef _WIN32
+#include <cstdio>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "mappedfile.h"
+
+namespace Pinocchio {
+
+MappedFile::~MappedFile()
+{
+#ifndef _WIN32
+  if(data)
+    munmap((void *)data, size);
+#endif
+}
+
+
+bool MappedFile::open(const std::string &filename)
+{
+#ifdef _WIN32
+  FILE *f = fopen(filename.c_str(), "rb");
+  if(f == NULL)
+    return false;
+  fseek(f, 0, SEEK_END);
+  long len = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  //doubles so that the arrays are aligned
+  buffer.resize((len + sizeof(double) - 1) / sizeof(double));
+  bool ok = len > 0 && fread(&(buffer[0]), 1, len, f) == (size_t)len;
+  fclose(f);
+  if(!ok)
+    return false;
+  data = (const char *)&(buffer[0]);
+  size = len;
+  return true;
+#else
+  int fd = ::open(filename.c_str(), O_RDONLY);
+  if(fd < 0)
+    return false;
+  struct stat st;
+  if(fstat(fd, &st) != 0 || st.st_size <= 0)
+  {
+    close(fd);
+    return false;
+  }
+  void *mapped = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(mapped == MAP_FAILED)
+    return false;
+  data = (const char *)mapped;
+  size = st.st_size;
+  return true;
+#endif
+}
+
+} // namespace Pinocchio
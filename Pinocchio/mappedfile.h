@@ -0,0 +1,53 @@
+/*  This file is part of the Pinocchio automatic rigging library.
+    Copyright (C) 2007 Ilya Baran (ibaran@mit.edu)
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef MAPPEDFILE_H_1DA6DF7E_CBC9_11F1_A8DB_02FC00000001
+#define MAPPEDFILE_H_1DA6DF7E_CBC9_11F1_A8DB_02FC00000001
+
+#include <string>
+#include <vector>
+
+#include "Pinocchio.h"
+
+namespace Pinocchio {
+
+//a whole file mapped read-only into memory (read into a buffer on Windows),
+//so that binary data like weights or point caches can be used in place
+class PINOCCHIO_API MappedFile
+{
+  public:
+    MappedFile() : data(NULL), size(0) {}
+    ~MappedFile();
+
+    //fails on empty files
+    bool open(const std::string &filename);
+
+    const char *data;
+    size_t size;
+
+  private:
+    MappedFile(const MappedFile &);
+    MappedFile &operator=(const MappedFile &);
+#ifdef _WIN32
+    std::vector<double> buffer;
+#endif
+};
+
+} // namespace Pinocchio
+
+#endif // MAPPEDFILE_H_1DA6DF7E_CBC9_11F1_A8DB_02FC00000001
@@ -0,0 +1,54 @@
+/*  This file is part of the Pinocchio automatic rigging library.
+    Copyright (C) 2007 Ilya Baran (ibaran@mit.edu)
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef MESHCACHE_H_C1FFACDE_CBC0_11F1_BDFA_9CDE0A5AAB4C
+#define MESHCACHE_H_C1FFACDE_CBC0_11F1_BDFA_9CDE0A5AAB4C
+
+#include <memory>
+#include <mutex>
+
+#include "pin_mesh.h"
+#include "lsqSolver.h"
+
+namespace Pinocchio {
+
+struct MeshOperators;
+
+/**
+ * Data derived from a mesh that is expensive to compute and stays valid as
+ * long as the connectivity doesn't change.  Copies of a Mesh share the cache,
+ * so every entry has to be checked against the mesh it is used with.
+ */
+struct MeshCache {
+  std::mutex mutex; //guards the members below
+
+  //symbolic factorization of the attachment system, whose pattern is that
+  //of the mesh laplacian whatever the skeleton and heat weight are
+  std::shared_ptr<SymbolicFactor> attachmentSymbolic;
+
+  //one-rings, areas and cotangent laplacian (see meshoperators.h), which
+  //also depend on the vertex positions
+  std::shared_ptr<const MeshOperators> operators;
+};
+
+//the cache of the mesh, created on first use
+PINOCCHIO_API MeshCache &getMeshCache(const Mesh &mesh);
+
+} // namespace Pinocchio
+
+#endif // MESHCACHE_H_C1FFACDE_CBC0_11F1_BDFA_9CDE0A5AAB4C
@@ -0,0 +1,200 @@
+/*  This file is part of the Pinocchio automatic rigging library.
+    Copyright (C) 2007 Ilya Baran (ibaran@mit.edu)
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <algorithm>
+#include <cstring>
+
+#include "meshoperators.h"
+#include "meshcache.h"
+#include "threadpool.h"
+
+namespace Pinocchio {
+
+//64-bit FNV-1a of the vertex positions
+static unsigned long long geometryHashOf(const Mesh &mesh)
+{
+  int i;
+  unsigned long long hash = 14695981039346656037ULL;
+  for(i = 0; i < (int)mesh.vertices.size(); ++i)
+  {
+    unsigned char bytes[sizeof(Vector3)];
+    memcpy(bytes, &mesh.vertices[i].pos, sizeof(Vector3));
+    for(int b = 0; b < (int)sizeof(Vector3); ++b)
+    {
+      hash ^= bytes[b];
+      hash *= 1099511628211ULL;
+    }
+  }
+  return hash;
+}
+
+
+void MeshOperators::compute(const Mesh &mesh)
+{
+  int i;
+  int nv = mesh.vertices.size();
+  //vertices per task
+  const int chunk = 256;
+  int chunks = (nv + chunk - 1) / chunk;
+  ThreadPool &pool = ThreadPool::global();
+
+  topologyHash = mesh.topologyHash();
+  geometryHash = geometryHashOf(mesh);
+
+  //count the one-rings and their neighbors with smaller indices (plus the
+  //diagonal), then walk them again to fill the rings and the laplacian rows
+  //in place
+  std::vector<int> &lapStart = laplacian.rowStart;
+  ringStart.assign(nv + 1, 0);
+  lapStart.assign(nv + 1, 0);
+  pool.parallelFor(chunks, [&](int c)
+  {
+    int v;
+    for(v = c * chunk; v < std::min(nv, (c + 1) * chunk); ++v)
+    {
+      int cur, start, count = 0, lower = 0;
+      cur = start = mesh.vertices[v].edge;
+      lapStart[v + 1] = 1;
+      if(start < 0)
+        continue;
+      do
+      {
+        ++count;
+        if(mesh.edges[cur].vertex < v)
+          ++lower;
+        cur = mesh.edges[mesh.edges[cur].prev].twin;
+      } while(cur != start);
+      ringStart[v + 1] = count;
+      lapStart[v + 1] = lower + 1;
+    }
+  });
+  for(i = 0; i < nv; ++i)
+  {
+    ringStart[i + 1] += ringStart[i];
+    lapStart[i + 1] += lapStart[i];
+  }
+
+  ring.resize(ringStart[nv]);
+  areas.assign(nv, 0.);
+  laplacian.idx.resize(lapStart[nv]);
+  laplacian.val.resize(lapStart[nv]);
+
+  pool.parallelFor(chunks, [&](int c)
+  {
+    int v, j, k;
+    for(v = c * chunk; v < std::min(nv, (c + 1) * chunk); ++v)
+    {
+      int *r = &ring[0] + ringStart[v];
+      int n = ringStart[v + 1] - ringStart[v];
+      int *idx = &laplacian.idx[0] + lapStart[v];
+      double *val = &laplacian.val[0] + lapStart[v];
+      int lower = lapStart[v + 1] - lapStart[v] - 1;
+      if(n == 0)
+      {
+        //isolated vertex: just the diagonal
+        idx[0] = v;
+        val[0] = 0.;
+        continue;
+      }
+
+      int cur, start, k = 0;
+      cur = start = mesh.vertices[v].edge;
+      do
+      {
+        r[k++] = mesh.edges[cur].vertex;
+        cur = mesh.edges[mesh.edges[cur].prev].twin;
+      } while(cur != start);
+
+      //areas and cotangent weights in a single pass over the ring
+      const Vector3 &cPos = mesh.vertices[v].pos;
+      double area = 0., sum = 0.;
+      int filled = 0;
+      for(j = 0; j < n; ++j)
+      {
+        int nj = (j + 1) % n;
+        int pj = (j + n - 1) % n;
+        const Vector3 &pos = mesh.vertices[r[j]].pos;
+        const Vector3 &nPos = mesh.vertices[r[nj]].pos;
+        const Vector3 &pPos = mesh.vertices[r[pj]].pos;
+
+        area += ((pos - cPos) % (nPos - cPos)).length();
+
+        Vector3 v1 = cPos - pPos;
+        Vector3 v2 = pos - pPos;
+        Vector3 v3 = cPos - nPos;
+        Vector3 v4 = pos - nPos;
+
+        double cot1 = (v1 * v2) / (1e-6 + (v1 % v2).length());
+        double cot2 = (v3 * v4) / (1e-6 + (v3 % v4).length());
+        sum += (cot1 + cot2);
+
+        //only the lower triangle is stored, but the diagonal sums all of them.
+        //The few entries of a row are kept sorted by inserting each in place.
+        if(r[j] > v)
+          continue;
+        double w = -cot1 - cot2;
+        for(k = filled; k > 0 && std::make_pair(idx[k - 1], val[k - 1]) > std::make_pair(r[j], w); --k)
+        {
+          idx[k] = idx[k - 1];
+          val[k] = val[k - 1];
+        }
+        idx[k] = r[j];
+        val[k] = w;
+        ++filled;
+      }
+      areas[v] = area;
+      idx[lower] = v;
+      val[lower] = sum;
+    }
+  });
+}
+
+
+bool MeshOperators::matches(const Mesh &mesh) const
+{
+  return (int)ringStart.size() == (int)mesh.vertices.size() + 1
+    && topologyHash == mesh.topologyHash() && geometryHash == geometryHashOf(mesh);
+}
+
+
+std::shared_ptr<const MeshOperators> getMeshOperators(const Mesh &mesh, bool *wasCached)
+{
+  MeshCache &cache = getMeshCache(mesh);
+  {
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    if(cache.operators && cache.operators->matches(mesh))
+    {
+      if(wasCached)
+        *wasCached = true;
+      return cache.operators;
+    }
+  }
+
+  //computed outside the lock, in case another mesh sharing the cache needs it
+  std::shared_ptr<MeshOperators> ops(new MeshOperators());
+  ops->compute(mesh);
+  {
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    cache.operators = ops;
+  }
+  if(wasCached)
+    *wasCached = false;
+  return ops;
+}
+
+} // namespace Pinocchio
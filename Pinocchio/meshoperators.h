@@ -0,0 +1,70 @@
+/*  This file is part of the Pinocchio automatic rigging library.
+    Copyright (C) 2007 Ilya Baran (ibaran@mit.edu)
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef MESHOPERATORS_H_C1FFAD59_CBC0_11F1_BF25_3873F1A4F20F
+#define MESHOPERATORS_H_C1FFAD59_CBC0_11F1_BF25_3873F1A4F20F
+
+#include <vector>
+#include <memory>
+
+#include "pin_mesh.h"
+#include "lsqSolver.h"
+
+namespace Pinocchio {
+
+/**
+ * Differential operators of a closed triangle mesh, assembled in parallel.
+ * getMeshOperators caches them on the mesh, so rigging the same geometry
+ * again (for example with a different skeleton or heat weight) reuses them.
+ */
+struct PINOCCHIO_API MeshOperators {
+  MeshOperators() : topologyHash(0), geometryHash(0) {}
+
+  //what the operators were computed from
+  unsigned long long topologyHash; //Mesh::topologyHash()
+  unsigned long long geometryHash; //of the vertex positions
+
+  //one-ring of vertex v in counterclockwise order:
+  //ring[ringStart[v]] ... ring[ringStart[v + 1] - 1]
+  std::vector<int> ringStart;
+  std::vector<int> ring;
+
+  //sum over the one-ring of |e_k x e_k+1| (twice the area of the
+  //triangles around the vertex)
+  std::vector<double> areas;
+
+  //lower triangle of the cotangent laplacian: row v holds the neighbors
+  //with smaller indices in increasing order, then the diagonal, which is
+  //the sum of the cotangent weights of all the neighbors.  The off-diagonal
+  //entries are -(cot a + cot b).
+  SparseLower laplacian;
+
+  int ringSize(int v) const { return ringStart[v + 1] - ringStart[v]; }
+
+  //computes everything for mesh, replacing what was there
+  void compute(const Mesh &mesh);
+  //whether these are the operators of mesh as it is now
+  bool matches(const Mesh &mesh) const;
+};
+
+//the operators of mesh, from its cache if they are still valid there
+PINOCCHIO_API std::shared_ptr<const MeshOperators> getMeshOperators(const Mesh &mesh, bool *wasCached = NULL);
+
+} // namespace Pinocchio
+
+#endif // MESHOPERATORS_H_C1FFAD59_CBC0_11F1_BF25_3873F1A4F20F
@@ -17,6 +17,7 @@
 */
 
 #include "pin_mesh.h"
+#include "meshcache.h"
 #include "hashutils.h"
 #include "utils.h"
 #include "debugging.h"
@@ -29,6 +30,21 @@
 
 namespace Pinocchio {
 
+MeshCache &getMeshCache(const Mesh &mesh)
+{
+  static std::mutex cacheMutex;
+  std::lock_guard<std::mutex> lock(cacheMutex);
+  if(!mesh.cache)
+    mesh.cache = std::make_shared<MeshCache>();
+  return *mesh.cache;
+}
+
+
+Mesh::Mesh() : scale(1.)
+{
+}
+
+
 Mesh::Mesh(const std::string &file, int algo, float weight)
 : scale(1.), blendWeight(weight), algo(algo)
 {
@@ -701,6 +717,28 @@ void Mesh::writeObj(const std::string &filename) const
 }
 
 
+//64-bit FNV-1a over the vertex count and the vertex of every half-edge
+unsigned long long Mesh::topologyHash() const
+{
+  int i;
+  unsigned long long hash = 14695981039346656037ULL;
+  auto mix = [&hash](unsigned int x)
+  {
+    for(int b = 0; b < 4; ++b, x >>= 8)
+    {
+      hash ^= (x & 0xff);
+      hash *= 1099511628211ULL;
+    }
+  };
+
+  mix((unsigned int)vertices.size());
+  mix((unsigned int)edges.size());
+  for(i = 0; i < (int)edges.size(); ++i)
+    mix((unsigned int)edges[i].vertex);
+  return hash;
+}
+
+
 bool Mesh::isConnected() const
 {
   if(vertices.size() == 0)
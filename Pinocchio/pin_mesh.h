@@ -21,12 +21,15 @@
 
 #include <vector>
 #include <string>
+#include <memory>
 
 #include "vector.h"
 #include "rect.h"
 
 namespace Pinocchio {
 
+struct MeshCache;
+
 struct MeshVertex {
   MeshVertex() : edge(-1), origVertID(-999999999) {}
 
@@ -46,7 +49,7 @@ struct MeshEdge {
 
 class PINOCCHIO_API Mesh {
   public:
-    Mesh() : scale(1.) {}
+    Mesh();
     Mesh(const std::string &file, int algo=Mesh::LBS, float weight=1.);
 
     bool integrityCheck() const;
@@ -56,6 +59,8 @@ class PINOCCHIO_API Mesh {
     void computeTopology();
     void writeObj(const std::string &filename) const;
     void fixDupFaces();
+    //hash of the vertex count and the connectivity, but not the positions
+    unsigned long long topologyHash() const;
 
   private:
     void readObj(std::istream &strm);
@@ -74,6 +79,10 @@ class PINOCCHIO_API Mesh {
     float blendWeight;
     int algo;
 
+    //derived data shared by copies of the mesh (see meshcache.h)--created
+    //on first use by getMeshCache, so only copies made after that share it
+    mutable std::shared_ptr<MeshCache> cache;
+
     // Some constants to make it easier to specify different algorithms.
     // LBS linear blend skinning
     // DQS dual quaternion skinning
@@ -79,9 +79,56 @@ const Skeleton &skeleton, const std::vector<std::vector<int> > &possibilities);
 std::vector<Vector3> PINOCCHIO_API splitPaths(const std::vector<int> &discreteEmbedding, const PtGraph &graph,
 const Skeleton &skeleton);
 
+struct RefineOptions {
+  RefineOptions() : method(DESCENT), maxIterations(200), tolerance(1e-5), medialField(false),
+    medialTol(defaultTreeTol), incremental(true), checkGradient(false), checkMedial(false) {}
+
+  // LBFGS quasi-Newton iterations with a backtracking line search, after one
+  //       round of DESCENT to get near the fit.  A third to half of the
+  //       evaluations, but the error can end a little above DESCENT's.
+  // DESCENT the original gradient steps with step doubling (10 fixed rounds),
+  //       the default
+  enum { LBFGS = 0, DESCENT = 1 };
+
+  int method;
+  int maxIterations; //LBFGS only
+  double tolerance; //LBFGS stops when the relative decrease stays below this
+  //look up the distance to the medial surface in an octree built once
+  //(to medialTol) instead of projecting onto the medial samples every time
+  bool medialField;
+  double medialTol;
+  //per-bone steps evaluate only the error terms of the bones touching the
+  //moved joints instead of the whole sum
+  bool incremental;
+  //compares the hand-written gradient with forward mode derivatives at the
+  //initial and the refined embedding (see RefineStats::gradientError)
+  bool checkGradient;
+  //compares the medial field with exact projection along the initial bones
+  //(see RefineStats::medialFieldError)
+  bool checkMedial;
+};
+
+struct RefineStats {
+  RefineStats() : iterations(0), evaluations(0), boneTerms(0), initialError(0.), error(0.),
+    medialFieldError(0.), gradientError(0.) {}
+
+  int iterations;
+  int evaluations; //calls to the fine error function, with or without gradient
+  int boneTerms; //per-bone error terms computed by the per-bone steps
+  double initialError; //error of the initial embedding
+  double error; //final error
+  //largest difference between the medial field and exact projection, sampled
+  //along the initial bones (zero without the field or checkMedial)
+  double medialFieldError;
+  //largest difference between the hand-written gradient and the forward mode
+  //one, over the largest gradient entry (zero without checkGradient)
+  double gradientError;
+};
+
 //refines embedding
 std::vector<Vector3> PINOCCHIO_API refineEmbedding(TreeType *distanceField, const std::vector<Vector3> &medialSurface,
-const std::vector<Vector3> &initialEmbedding, const Skeleton &skeleton);
+const std::vector<Vector3> &initialEmbedding, const Skeleton &skeleton,
+const RefineOptions &options = RefineOptions(), RefineStats *stats = NULL);
 
 //to compute the attachment, create a new Attachment object
 
@@ -0,0 +1,396 @@
+/*  This file is part of the Pinocchio automatic rigging library.
+    Copyright (C) 2007 Ilya Baran (ibaran@mit.edu)
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+
+#include "pointcache.h"
+#include "mappedfile.h"
+#include "skinning.h"
+#include "threadpool.h"
+#include "debugging.h"
+
+namespace Pinocchio {
+
+static const char pointCacheMagic[4] = { 'P', 'I', 'N', 'C' };
+static const unsigned int pointCacheVersion = 1;
+
+//rounds to the nearest half, ties to even, with overflow going to infinity
+static unsigned short floatToHalf(float value)
+{
+  unsigned int f, sign;
+  memcpy(&f, &value, sizeof(f));
+  sign = (f >> 16) & 0x8000;
+  f &= 0x7fffffff;
+
+  if(f >= 0x47800000) //too large for a half (or inf or nan)
+    return (unsigned short)(sign | (f > 0x7f800000 ? 0x7e00 : 0x7c00));
+  if(f < 0x38800000) //subnormal half: let the float addition do the rounding
+  {
+    const unsigned int magicBits = 126 << 23; //0.5
+    float magic, shifted;
+    memcpy(&magic, &magicBits, sizeof(magic));
+    memcpy(&shifted, &f, sizeof(shifted));
+    shifted += magic;
+    memcpy(&f, &shifted, sizeof(f));
+    return (unsigned short)(sign | (f - magicBits));
+  }
+  unsigned int odd = (f >> 13) & 1;
+  f += 0xc8000fff + odd; //rebias the exponent from 127 to 15 and round
+  return (unsigned short)(sign | (f >> 13));
+}
+
+
+static float halfToFloat(unsigned short h)
+{
+  unsigned int sign = (unsigned int)(h & 0x8000) << 16;
+  unsigned int exponent = (h >> 10) & 0x1f;
+  unsigned int mantissa = h & 0x3ff;
+  unsigned int f;
+  float out;
+
+  if(exponent == 0x1f)
+    f = sign | 0x7f800000 | (mantissa << 13);
+  else if(exponent != 0)
+    f = sign | ((exponent + 112) << 23) | (mantissa << 13);
+  else
+  {
+    //zero or subnormal: mantissa * 2^-24
+    out = (float)mantissa * (1.f / 16777216.f);
+    return sign ? -out : out;
+  }
+  memcpy(&out, &f, sizeof(out));
+  return out;
+}
+
+
+//bytes of the positions (or normals) of one frame, kept a multiple of 4 so
+//that the floats of every frame are aligned
+static size_t blockBytes(size_t vertices, int flags)
+{
+  size_t values = vertices * 3;
+  if(flags & PointCacheWriter::HALF)
+    return (values * sizeof(unsigned short) + 3) / 4 * 4;
+  return values * sizeof(float);
+}
+
+
+//reads count values stored as floats or halves into out, or adds them to it
+static void decodeValues(const char *data, bool half, int count, float *out, bool add)
+{
+  int i;
+  if(half)
+  {
+    const unsigned short *h = (const unsigned short *)data;
+    for(i = 0; i < count; ++i)
+      out[i] = add ? out[i] + halfToFloat(h[i]) : halfToFloat(h[i]);
+  }
+  else
+  {
+    const float *f = (const float *)data;
+    for(i = 0; i < count; ++i)
+      out[i] = add ? out[i] + f[i] : f[i];
+  }
+}
+
+
+bool PointCacheWriter::open(const std::string &filename, const Mesh &mesh, int inFlags,
+float fps, int inKeyInterval)
+{
+  if(strm.is_open())
+    close();
+  vertices = (int)mesh.vertices.size();
+  flags = inFlags;
+  keyInterval = std::max(1, inKeyInterval);
+  frames = 0;
+
+  strm.clear();
+  name = filename;
+  strm.open(filename.c_str(), std::ios::binary);
+  if(!strm)
+  {
+    Debugging::out() << "Could not create point cache " << filename << std::endl;
+    return false;
+  }
+
+  PointCacheHeader header;
+  memcpy(header.magic, pointCacheMagic, 4);
+  header.version = pointCacheVersion;
+  header.vertices = vertices;
+  header.frames = 0; //filled in by close
+  header.flags = flags;
+  header.keyInterval = keyInterval;
+  header.fps = fps;
+  header.reserved = 0;
+  header.meshHash = mesh.topologyHash();
+  strm.write((const char *)&header, sizeof(header));
+
+  previous.assign(flags & DELTA ? vertices * 3 : 0, 0.f);
+  return (bool)strm;
+}
+
+
+void PointCacheWriter::writeValues(const float *v, int count)
+{
+  int i;
+  if(flags & HALF)
+  {
+    halves.resize(count + 1);
+    for(i = 0; i < count; ++i)
+      halves[i] = floatToHalf(v[i]);
+    halves[count] = 0;
+    strm.write((const char *)&halves[0], blockBytes(vertices, flags));
+  }
+  else
+    strm.write((const char *)v, count * sizeof(float));
+}
+
+
+bool PointCacheWriter::writeFrame(const float *positions, const float *normals)
+{
+  int i;
+  if(!strm.is_open() || positions == NULL)
+    return false;
+  if((flags & NORMALS) && normals == NULL)
+    return false;
+
+  int count = vertices * 3;
+  bool key = !(flags & DELTA) || frames % keyInterval == 0;
+  const float *v = positions;
+  if(!key)
+  {
+    values.resize(count);
+    for(i = 0; i < count; ++i)
+      values[i] = positions[i] - previous[i];
+    v = count ? &values[0] : NULL;
+  }
+  writeValues(v, count);
+
+  //track what the reader will get, so that rounding errors don't add up
+  //over the deltas
+  if(flags & DELTA)
+  {
+    for(i = 0; i < count; ++i)
+    {
+      float d = (flags & HALF) ? halfToFloat(halves[i]) : v[i];
+      previous[i] = key ? d : previous[i] + d;
+    }
+  }
+
+  if(flags & NORMALS)
+    writeValues(normals, count);
+  ++frames;
+  return (bool)strm;
+}
+
+
+bool PointCacheWriter::close()
+{
+  if(!strm.is_open())
+    return false;
+  unsigned int count = frames;
+  strm.seekp(offsetof(PointCacheHeader, frames));
+  strm.write((const char *)&count, sizeof(count));
+  bool ok = (bool)strm;
+  strm.close();
+  return ok;
+}
+
+
+void PointCacheWriter::abort()
+{
+  if(!strm.is_open())
+    return;
+  //the header still says 0 frames, but don't leave a cache around at all
+  strm.close();
+  std::remove(name.c_str());
+}
+
+
+bool PointCache::open(const std::string &filename, const Mesh *mesh)
+{
+  header = NULL;
+  decodedFrame = -1;
+  file.reset(new MappedFile());
+  if(!file->open(filename))
+  {
+    Debugging::out() << "Could not read point cache " << filename << std::endl;
+    return false;
+  }
+
+  const PointCacheHeader *h = (const PointCacheHeader *)file->data;
+  if(file->size < sizeof(PointCacheHeader) || memcmp(h->magic, pointCacheMagic, 4) != 0
+    || h->version != pointCacheVersion || h->keyInterval == 0)
+  {
+    Debugging::out() << filename << " is not a point cache" << std::endl;
+    return false;
+  }
+  if(mesh && (h->vertices != mesh->vertices.size() || h->meshHash != mesh->topologyHash()))
+  {
+    Debugging::out() << filename << " was baked for a different mesh" << std::endl;
+    return false;
+  }
+  frameBytes = blockBytes(h->vertices, h->flags) * ((h->flags & PointCacheWriter::NORMALS) ? 2 : 1);
+  if(file->size != sizeof(PointCacheHeader) + h->frames * frameBytes)
+  {
+    Debugging::out() << filename << " is truncated" << std::endl;
+    return false;
+  }
+
+  header = h;
+  return true;
+}
+
+
+const char *PointCache::frameData(int frame) const
+{
+  return file->data + sizeof(PointCacheHeader) + frame * frameBytes;
+}
+
+
+const float *PointCache::positions(int frame) const
+{
+  if(header == NULL || frame < 0 || frame >= frames() || (header->flags & PointCacheWriter::HALF))
+    return NULL;
+  if((header->flags & PointCacheWriter::DELTA) && frame % header->keyInterval != 0)
+    return NULL;
+  return (const float *)frameData(frame);
+}
+
+
+const float *PointCache::normals(int frame) const
+{
+  if(header == NULL || frame < 0 || frame >= frames() || (header->flags & PointCacheWriter::HALF)
+    || !(header->flags & PointCacheWriter::NORMALS))
+    return NULL;
+  return (const float *)(frameData(frame) + blockBytes(header->vertices, header->flags));
+}
+
+
+bool PointCache::readFrame(int frame, float *outPositions, float *outNormals)
+{
+  if(header == NULL || frame < 0 || frame >= frames())
+    return false;
+  if(outNormals && !(header->flags & PointCacheWriter::NORMALS))
+    return false;
+
+  int count = vertices() * 3;
+  bool half = (header->flags & PointCacheWriter::HALF) != 0;
+  if(outPositions && !(header->flags & PointCacheWriter::DELTA))
+    decodeValues(frameData(frame), half, count, outPositions, false);
+  else if(outPositions)
+  {
+    int key = frame - frame % header->keyInterval;
+    int f = key;
+    decoded.resize(count);
+    //playback asks for the frames in order, so go on from the last one
+    if(decodedFrame >= key && decodedFrame <= frame)
+      f = decodedFrame;
+    else
+      decodeValues(frameData(key), half, count, &decoded[0], false);
+    for(++f; f <= frame; ++f)
+      decodeValues(frameData(f), half, count, &decoded[0], true);
+    decodedFrame = frame;
+    std::copy(decoded.begin(), decoded.end(), outPositions);
+  }
+
+  if(outNormals)
+    decodeValues(frameData(frame) + blockBytes(header->vertices, header->flags), half, count,
+      outNormals, false);
+  return true;
+}
+
+
+bool bakePointCache(const std::string &filename, const Mesh &mesh, const Attachment &attachment,
+const std::vector<std::vector<Transform<> > > &frames, int flags, float fps)
+{
+  int i;
+  int nv = (int)mesh.vertices.size();
+  SkinWeights weights = attachment.getSkinWeights();
+  if(nv == 0 || weights.vertices != nv)
+    return false; //error
+
+  PointCacheWriter writer;
+  if(!writer.open(filename, mesh, flags, fps))
+    return false;
+
+  //enough frames per batch for skinInstances to keep the pool busy
+  const int batch = 64;
+  bool normals = (flags & PointCacheWriter::NORMALS) != 0;
+  int frameValues = nv * 3 * (normals ? 2 : 1);
+  std::vector<SkinningContext> poses;
+  std::vector<DeformTarget> targets;
+  std::vector<Vector3> positions(batch * nv), normalValues(normals ? batch * nv : 0);
+  std::vector<float> values(batch * frameValues);
+
+  for(int first = 0; first < (int)frames.size(); first += batch)
+  {
+    int count = std::min(batch, (int)frames.size() - first);
+    poses.resize(count);
+    targets.resize(count);
+    for(i = 0; i < count; ++i)
+    {
+      poses[i].setTransforms(frames[first + i]);
+      poses[i].setParallelThreshold(0);
+      targets[i].positions = &positions[i * nv];
+      targets[i].normals = normals ? &normalValues[i * nv] : NULL;
+    }
+    if(!skinInstances(mesh, weights, poses, targets))
+    {
+      //error
+      writer.abort();
+      return false;
+    }
+
+    ThreadPool::global().parallelFor(count, [&](int f)
+    {
+      int j, k;
+      float *out = &values[f * frameValues];
+      for(j = 0; j < nv; ++j)
+        for(k = 0; k < 3; ++k)
+          out[j * 3 + k] = (float)positions[f * nv + j][k];
+      if(normals)
+        for(j = 0; j < nv; ++j)
+          for(k = 0; k < 3; ++k)
+            out[(nv + j) * 3 + k] = (float)normalValues[f * nv + j][k];
+    });
+
+    //the encoding depends on the previous frame, so this part is serial
+    for(i = 0; i < count; ++i)
+    {
+      const float *frame = &values[i * frameValues];
+      if(!writer.writeFrame(frame, normals ? frame + nv * 3 : NULL))
+      {
+        //error
+        writer.abort();
+        return false;
+      }
+    }
+  }
+  if(!writer.close())
+  {
+    //error
+    std::remove(filename.c_str());
+    return false;
+  }
+  return true;
+}
+
+} // namespace Pinocchio
@@ -0,0 +1,132 @@
+/*  This file is part of the Pinocchio automatic rigging library.
+    Copyright (C) 2007 Ilya Baran (ibaran@mit.edu)
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef POINTCACHE_H_1DA6E140_CBC9_11F1_A8DB_02FC00000001
+#define POINTCACHE_H_1DA6E140_CBC9_11F1_A8DB_02FC00000001
+
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "attachment.h"
+
+namespace Pinocchio {
+
+class MappedFile;
+
+/**
+ * Baked vertex animation: every frame of a clip skinned ahead of time, so
+ * that playing it back is a lookup instead of a deform.  A file is a
+ * PointCacheHeader followed by frames of equal size, each the interleaved
+ * xyz positions of every vertex, then their normals if there are any.
+ * HALF stores the values as IEEE float16 instead of float.  With DELTA the
+ * positions of a frame that isn't a key frame (a multiple of keyInterval)
+ * are the difference to the decoded previous frame, which keeps the
+ * small per-frame motion at full half precision; normals are never deltas.
+ */
+struct PointCacheHeader {
+  char magic[4]; //"PINC"
+  unsigned int version;
+  unsigned int vertices;
+  unsigned int frames;
+  unsigned int flags;
+  unsigned int keyInterval;
+  float fps;
+  unsigned int reserved;
+  unsigned long long meshHash; //Mesh::topologyHash() of the baked mesh
+};
+
+//streams frames to a cache file
+class PINOCCHIO_API PointCacheWriter {
+  public:
+    enum { HALF = 1, DELTA = 2, NORMALS = 4 };
+
+    PointCacheWriter() : vertices(0), flags(0), keyInterval(1), frames(0) {}
+    ~PointCacheWriter() { close(); }
+
+    //returns false if the file can't be created
+    bool open(const std::string &filename, const Mesh &mesh, int inFlags = 0,
+      float fps = 120.f, int inKeyInterval = 30);
+    //3 floats per vertex each; normals are needed (and only used) with NORMALS
+    bool writeFrame(const float *positions, const float *normals = NULL);
+    //writes the frame count, returns false if anything failed to write
+    bool close();
+    //closes and deletes the file, for when the frames can't all be written
+    void abort();
+
+    int framesWritten() const { return frames; }
+
+  private:
+    PointCacheWriter(const PointCacheWriter &);
+    PointCacheWriter &operator=(const PointCacheWriter &);
+
+    std::ofstream strm;
+    std::string name;
+    int vertices, flags, keyInterval, frames;
+    std::vector<float> previous; //what a reader decodes for the last frame
+    std::vector<float> values;
+    std::vector<unsigned short> halves;
+
+    void writeValues(const float *v, int count);
+};
+
+//a cache file mapped read-only into memory
+class PINOCCHIO_API PointCache {
+  public:
+    PointCache() : header(NULL), frameBytes(0), decodedFrame(-1) {}
+
+    //checks the file against mesh if one is given, returns false if the
+    //file can't be used
+    bool open(const std::string &filename, const Mesh *mesh = NULL);
+
+    int vertices() const { return header ? (int)header->vertices : 0; }
+    int frames() const { return header ? (int)header->frames : 0; }
+    float fps() const { return header ? header->fps : 0.f; }
+    int flags() const { return header ? (int)header->flags : 0; }
+
+    //pointers straight into the file (3 floats per vertex), or NULL if the
+    //frame is stored as halves or deltas and has to go through readFrame
+    const float *positions(int frame) const;
+    const float *normals(int frame) const;
+    //decodes a frame, starting from the nearest key frame unless it is the
+    //one after the last frame read.  Not safe to call from several threads.
+    bool readFrame(int frame, float *outPositions, float *outNormals = NULL);
+
+  private:
+    std::shared_ptr<MappedFile> file;
+    const PointCacheHeader *header;
+    size_t frameBytes;
+    int decodedFrame;
+    std::vector<float> decoded; //positions of decodedFrame
+
+    const char *frameData(int frame) const;
+};
+
+//Skins frames[f] of a clip into frame f of a cache file.  Batches of frames
+//are deformed at once with skinInstances across the pool and streamed out.
+//Normals are stored with PointCacheWriter::NORMALS.  Returns false if the
+//attachment's weights aren't for mesh, a frame has too few bones or the
+//file can't be written.
+PINOCCHIO_API bool bakePointCache(const std::string &filename, const Mesh &mesh,
+  const Attachment &attachment, const std::vector<std::vector<Transform<> > > &frames,
+  int flags = 0, float fps = 120.f);
+
+} // namespace Pinocchio
+
+#endif // POINTCACHE_H_1DA6E140_CBC9_11F1_A8DB_02FC00000001
@@ -57,4 +57,15 @@ Vector3 transformPoint(Vector3 vpos, Dual_quat_cu &dquat_blend)
   return Vector3(newPos.x, newPos.y, newPos.z);
 }
 
+
+/*
+ * Rotates a direction (such as a normal) by the rotation part of the
+ * dual quaternion, which is normalized first.
+ */
+Vector3 rotateVector(Vector3 v, const Dual_quat_cu &dquat_blend)
+{
+  Vec3 newV = dquat_blend.rotate(Vec3(v[0], v[1], v[2]));
+  return Vector3(newV.x, newV.y, newV.z);
+}
+
 } // namespace Pinocchio
@@ -29,6 +29,7 @@ namespace Pinocchio {
 
 Tbx::Dual_quat_cu getQuatFromMat(Transform<> matrix);
 Vector3 transformPoint(Vector3 vpos, Tbx::Dual_quat_cu &dquat_blend);
+Vector3 rotateVector(Vector3 v, const Tbx::Dual_quat_cu &dquat_blend);
 
 } // namespace Pinocchio
 
@@ -17,6 +17,7 @@
 */
 
 #include <algorithm>
+#include <iterator>
 #include "pinocchioApi.h"
 #include "deriv.h"
 #include "debugging.h"
@@ -26,84 +27,321 @@ namespace Pinocchio {
 //information for refined embedding
 struct RP
 {
-  RP(TreeType *inD, const Skeleton &inSk, const std::vector<Vector3> &medialSurface)
-    : distanceField(inD), given(inSk)
+  RP(TreeType *inD, const Skeleton &inSk, const std::vector<Vector3> &medialSurface, const RefineOptions &options)
+    : distanceField(inD), given(inSk), medialField(NULL), incremental(options.incremental)
   {
+    int i;
     std::vector<Vec3Object> mpts;
-    for(int i = 0; i < (int)medialSurface.size(); ++i)
+    for(i = 0; i < (int)medialSurface.size(); ++i)
       mpts.push_back(medialSurface[i]);
 
     medProjector = ObjectProjector<3, Vec3Object>(mpts);
+
+    if(options.medialField)
+      medialField = OctTreeMaker<TreeType>::make(medProjector, options.medialTol);
+
+    //the term of bone i reads joints i, prev, and those of its symmetric bone
+    jointBones.resize(given.fPrev().size());
+    for(i = 1; i < (int)given.fPrev().size(); ++i)
+    {
+      addJointBone(i, i);
+      addJointBone(given.fPrev()[i], i);
+      int s = given.fSym()[i];
+      if(s != -1)
+      {
+        addJointBone(s, i);
+        addJointBone(given.fPrev()[s], i);
+      }
+    }
+  }
+
+  ~RP() { delete medialField; }
+
+  //whether v is in the box the medial field was built over--outside it the
+  //field is only extrapolated, so the samples are projected onto instead
+  template<class Real> bool inMedialField(const Vector<Real, 3> &v) const
+  {
+    if(!medialField)
+      return false;
+    const Rect3 &box = medialField->getRect();
+    for(int d = 0; d < 3; ++d)
+      if(v[d] < Real(box.getLo()[d]) || v[d] > Real(box.getHi()[d]))
+        return false;
+    return true;
+  }
+
+  //distance to the closest medial sample
+  template<class Real> Real medialDist(const Vector<Real, 3> &v) const
+  {
+    if(inMedialField(v))
+      return medialField->locate(v)->evaluate(v);
+    Vector3 m = medProjector.project(v);
+    return (v - Vector<Real, 3>(m)).length();
   }
 
   TreeType *distanceField;
   const Skeleton &given;
   ObjectProjector<3, Vec3Object> medProjector;
+  //optional precomputed octree of the distance to the medial samples
+  TreeType *medialField;
+  //whether the per-bone steps evaluate only the terms that can change
+  bool incremental;
+  //for every joint, the (sorted) bones whose error terms depend on it
+  std::vector<std::vector<int> > jointBones;
+
+  private:
+    void addJointBone(int joint, int bone)
+    {
+      std::vector<int> &bones = jointBones[joint];
+      std::vector<int>::iterator it = std::lower_bound(bones.begin(), bones.end(), bone);
+      if(it == bones.end() || *it != bone)
+        bones.insert(it, bone);
+    }
+
+    RP(const RP &);
+    RP &operator=(const RP &);
 };
 
+//the fine error is a sum of per-bone terms--this is the term of bone i
+template<class Real> Real computeBoneError(const std::vector<Vector<Real, 3> > &match, RP *rp, int i)
+{
+  int prev = rp->given.fPrev()[i];
+
+  Real surfPenalty = Real();
+  Real lenPenalty = Real();
+  Real anglePenalty = Real();
+  Real symPenalty = Real();
+
+  //-----------------surf
+  const int samples = 10;
+  for(int k = 0; k < samples; ++k)
+  {
+    double frac = double(k) / double(samples);
+    Vector<Real, 3> cur = match[i] * Real(1. - frac) + match[prev] * Real(frac);
+    Real medDist = rp->medialDist(cur);
+    Real surfDist = -rp->distanceField->locate(cur)->evaluate(cur);
+    Real penalty = SQR(std::min(medDist, Real(0.001) + std::max(Real(0.), Real(0.05) - surfDist)));
+    if(penalty > Real(SQR(0.003)))
+      surfPenalty += Real(1. / double(samples)) * penalty;
+  }
+
+  //---------------length
+  Real optDistSq = (rp->given.fGraph().verts[i] - rp->given.fGraph().verts[prev]).lengthsq();
+  Real distSq = SQR(std::max(Real(-10.), (match[i] - match[prev]) *
+    (rp->given.fGraph().verts[i] - rp->given.fGraph().verts[prev]))) / optDistSq;
+  lenPenalty = std::max(Real(.5), (Real(0.0001) + optDistSq) / (Real(0.0001) + distSq));
+
+  //---------------sym
+  if(rp->given.fSym()[i] != -1)
+  {
+    int s = rp->given.fSym()[i];
+    int sp = rp->given.fPrev()[s];
+
+    Real sDistSq = (match[s] - match[sp]).lengthsq();
+    symPenalty = std::max(Real(1.05), std::max(distSq / (Real(0.001) + sDistSq), sDistSq / (Real(0.001) + distSq)));
+  }
+
+  //--------------angle
+  if(distSq > Real(1e-16))
+  {
+    Vector<Real, 3> curDir = (match[i] - match[prev]).normalize();
+    Vector<Real, 3> skelDir = (rp->given.fGraph().verts[i] - rp->given.fGraph().verts[prev]).normalize();
+    if(curDir * skelDir < Real(1. - 1e-8))
+      anglePenalty = Real(0.5) * acos(curDir * skelDir);
+    anglePenalty = CUBE(Real(0.3) + anglePenalty);
+    if(curDir * skelDir < Real(0.))
+      anglePenalty *= 10.;
+  }
+
+  return Real(15000.) * surfPenalty + Real(0.25) * lenPenalty + Real(2.0) * anglePenalty + symPenalty;
+}
+
+
 template<class Real> Real computeFineError(const std::vector<Vector<Real, 3> > &match, RP *rp)
 {
   Real out = Real();
   int i;
   for(i = 1; i < (int)match.size(); ++i)
-  {
-    int prev = rp->given.fPrev()[i];
+    out += computeBoneError(match, rp, i);
+
+  return out;
+}
+
+
+//value of the distance field at v along with its gradient--the field is
+//trilinear within the octree cell containing v, so this is exact
+static double evaluateField(TreeType *distanceField, const Vector3 &v, Vector3 &grad)
+{
+  typedef Deriv<double, 3> DType;
+  Vector<DType, 3> dv(DType(v[0], 0), DType(v[1], 1), DType(v[2], 2));
+  DType val = distanceField->locate(v)->evaluate(dv);
+  grad = Vector3(val.getDeriv(0), val.getDeriv(1), val.getDeriv(2));
+  return val.getReal();
+}
+
+
+//Same value as computeBoneError, but also adds the gradient of the term with
+//respect to every joint into grad.  The derivatives are taken by hand, term by
+//term, following the same branches of min/max that Deriv would follow.
+double computeBoneErrorGrad(const std::vector<Vector3> &match, RP *rp, int i, std::vector<Vector3> &grad)
+{
+  int prev = rp->given.fPrev()[i];
 
-    Real surfPenalty = Real();
-    Real lenPenalty = Real();
-    Real anglePenalty = Real();
-    Real symPenalty = Real();
+  double surfPenalty = 0.;
+  double lenPenalty = 0.;
+  double anglePenalty = 0.;
+  double symPenalty = 0.;
 
-    //-----------------surf
-    const int samples = 10;
-    for(int k = 0; k < samples; ++k)
+  //-----------------surf
+  const int samples = 10;
+  for(int k = 0; k < samples; ++k)
+  {
+    double frac = double(k) / double(samples);
+    Vector3 cur = match[i] * (1. - frac) + match[prev] * frac;
+    double medDist;
+    Vector3 medGrad;
+    if(rp->inMedialField(cur))
+      medDist = evaluateField(rp->medialField, cur, medGrad);
+    else
     {
-      double frac = double(k) / double(samples);
-      Vector<Real, 3> cur = match[i] * Real(1. - frac) + match[prev] * Real(frac);
-      Vector3 m = rp->medProjector.project(cur);
-      Real medDist = (cur - Vector<Real, 3>(m)).length();
-      Real surfDist = -rp->distanceField->locate(cur)->evaluate(cur);
-      Real penalty = SQR(std::min(medDist, Real(0.001) + std::max(Real(0.), Real(0.05) - surfDist)));
-      if(penalty > Real(SQR(0.003)))
-        surfPenalty += Real(1. / double(samples)) * penalty;
+      Vector3 medDiff = cur - rp->medProjector.project(cur);
+      medDist = medDiff.length();
+      if(medDist > 0.)
+        medGrad = medDiff / medDist;
     }
+    Vector3 fieldGrad;
+    double surfDist = -evaluateField(rp->distanceField, cur, fieldGrad);
 
-    //---------------length
-    Real optDistSq = (rp->given.fGraph().verts[i] - rp->given.fGraph().verts[prev]).lengthsq();
-    Real distSq = SQR(std::max(Real(-10.), (match[i] - match[prev]) *
-      (rp->given.fGraph().verts[i] - rp->given.fGraph().verts[prev]))) / optDistSq;
-    lenPenalty = std::max(Real(.5), (Real(0.0001) + optDistSq) / (Real(0.0001) + distSq));
-
-    //---------------sym
-    if(rp->given.fSym()[i] != -1)
+    //derivative of the min(...) with respect to cur
+    double dist = 0.001;
+    Vector3 dDist;
+    if(0. < 0.05 - surfDist)
     {
-      int s = rp->given.fSym()[i];
-      int sp = rp->given.fPrev()[s];
+      dist += 0.05 - surfDist;
+      dDist = fieldGrad;
+    }
+    if(!(dist < medDist))
+    {
+      dist = medDist;
+      dDist = medGrad;
+    }
 
-      Real sDistSq = (match[s] - match[sp]).lengthsq();
-      symPenalty = std::max(Real(1.05), std::max(distSq / (Real(0.001) + sDistSq), sDistSq / (Real(0.001) + distSq)));
+    double penalty = SQR(dist);
+    if(penalty > SQR(0.003))
+    {
+      surfPenalty += (1. / double(samples)) * penalty;
+      Vector3 g = dDist * (15000. * (1. / double(samples)) * 2. * dist);
+      grad[i] += g * (1. - frac);
+      grad[prev] += g * frac;
     }
+  }
 
-    //--------------angle
-    if(distSq > Real(1e-16))
+  //---------------length
+  Vector3 skelDiff = rp->given.fGraph().verts[i] - rp->given.fGraph().verts[prev];
+  Vector3 diff = match[i] - match[prev];
+  double optDistSq = skelDiff.lengthsq();
+  double dot = diff * skelDiff;
+  double distSq = 0.;
+  Vector3 dDistSq; //with respect to diff
+  if(-10. < dot)
+  {
+    distSq = SQR(dot) / optDistSq;
+    dDistSq = skelDiff * (2. * dot / optDistSq);
+  }
+  else
+    distSq = SQR(-10.) / optDistSq;
+
+  lenPenalty = (0.0001 + optDistSq) / (0.0001 + distSq);
+  if(0.5 < lenPenalty)
+  {
+    Vector3 g = dDistSq * (-0.25 * lenPenalty / (0.0001 + distSq));
+    grad[i] += g;
+    grad[prev] -= g;
+  }
+  else
+    lenPenalty = 0.5;
+
+  //---------------sym
+  if(rp->given.fSym()[i] != -1)
+  {
+    int s = rp->given.fSym()[i];
+    int sp = rp->given.fPrev()[s];
+
+    Vector3 sDiff = match[s] - match[sp];
+    double sDistSq = sDiff.lengthsq();
+    double r1 = distSq / (0.001 + sDistSq);
+    double r2 = sDistSq / (0.001 + distSq);
+    //derivatives with respect to distSq and sDistSq
+    double dR, dSR;
+    if(r1 < r2)
     {
-      Vector<Real, 3> curDir = (match[i] - match[prev]).normalize();
-      Vector<Real, 3> skelDir = (rp->given.fGraph().verts[i] - rp->given.fGraph().verts[prev]).normalize();
-      if(curDir * skelDir < Real(1. - 1e-8))
-        anglePenalty = Real(0.5) * acos(curDir * skelDir);
-      anglePenalty = CUBE(Real(0.3) + anglePenalty);
-      if(curDir * skelDir < Real(0.))
-        anglePenalty *= 10.;
+      symPenalty = r2;
+      dR = -r2 / (0.001 + distSq);
+      dSR = 1. / (0.001 + distSq);
     }
+    else
+    {
+      symPenalty = r1;
+      dR = 1. / (0.001 + sDistSq);
+      dSR = -r1 / (0.001 + sDistSq);
+    }
+    if(1.05 < symPenalty)
+    {
+      Vector3 g = dDistSq * dR;
+      grad[i] += g;
+      grad[prev] -= g;
+      Vector3 sg = sDiff * (2. * dSR);
+      grad[s] += sg;
+      grad[sp] -= sg;
+    }
+    else
+      symPenalty = 1.05;
+  }
 
-    out += Real(15000.) * surfPenalty + Real(0.25) * lenPenalty + Real(2.0) * anglePenalty + symPenalty;
+  //--------------angle
+  if(distSq > 1e-16)
+  {
+    double len = diff.length();
+    Vector3 curDir = diff / len;
+    Vector3 skelDir = skelDiff.normalize();
+    double c = curDir * skelDir;
+    double dAngle = 0.;
+    if(c < 1. - 1e-8)
+    {
+      anglePenalty = 0.5 * acos(c);
+      dAngle = -0.5 / sqrt(1. - SQR(c));
+    }
+    dAngle *= 3. * SQR(0.3 + anglePenalty);
+    anglePenalty = CUBE(0.3 + anglePenalty);
+    if(c < 0.)
+    {
+      anglePenalty *= 10.;
+      dAngle *= 10.;
+    }
+    Vector3 g = (skelDir - curDir * c) * (2.0 * dAngle / len);
+    grad[i] += g;
+    grad[prev] -= g;
   }
 
+  return 15000. * surfPenalty + 0.25 * lenPenalty + 2.0 * anglePenalty + symPenalty;
+}
+
+
+//computeFineError along with its gradient with respect to every joint
+double computeFineErrorGrad(const std::vector<Vector3> &match, RP *rp, std::vector<Vector3> &grad)
+{
+  double out = 0.;
+  int i;
+  grad.assign(match.size(), Vector3());
+  for(i = 1; i < (int)match.size(); ++i)
+    out += computeBoneErrorGrad(match, rp, i, grad);
+
   return out;
 }
 
 
-std::vector<Vector3> optimizeEmbedding1D(std::vector<Vector3> fineEmbedding, std::vector<Vector3> dir, RP *rp)
+std::vector<Vector3> optimizeEmbedding1D(std::vector<Vector3> fineEmbedding, std::vector<Vector3> dir, RP *rp,
+RefineStats &stats)
 {
   int i;
   double step = 0.001;
@@ -120,6 +358,7 @@ std::vector<Vector3> optimizeEmbedding1D(std::vector<Vector3> fineEmbedding, std
   while(++count)
   {
     double curErr = computeFineError(fineEmbedding, rp);
+    ++stats.evaluations;
     if(prevErr == -1e10 || curErr < prevErr)
     {
       step *= 2.;
@@ -146,92 +385,384 @@ std::vector<Vector3> optimizeEmbedding1D(std::vector<Vector3> fineEmbedding, std
 }
 
 
-//refines embedding
-std::vector<Vector3> refineEmbedding(TreeType *distanceField, const std::vector<Vector3> &medialSurface,
-const std::vector<Vector3> &initialEmbedding, const Skeleton &skeleton)
+//sum of the terms of the given bones--when only the joints of those bones'
+//terms move, this differs from the full error by a constant
+static double computeBonesError(const std::vector<Vector3> &match, RP *rp, const std::vector<int> &bones,
+RefineStats &stats)
 {
-  RP rp(distanceField, skeleton, medialSurface);
+  double out = 0.;
+  for(int i = 0; i < (int)bones.size(); ++i)
+    out += computeBoneError(match, rp, bones[i]);
 
-  int sz = initialEmbedding.size();
-  std::vector<Vector3> fineEmbedding = initialEmbedding;
-  int i, k;
-  for(k = 0; k < 10; ++k)
-  {
-    typedef Deriv<double, 6> DType;
-    typedef Deriv<double, -1> DType1;
+  ++stats.evaluations;
+  stats.boneTerms += bones.size();
+  return out;
+}
 
-    Debugging::out() << "E = " << computeFineError(fineEmbedding, &rp) << std::endl;
 
-    for(int j = 0; j < 2; ++j)
+//the same line search as optimizeEmbedding1D, for a step that moves only the
+//joints j0 and j1: just the terms of the bones that depend on them are
+//evaluated, and only those two joints are updated
+static void optimizeJoints1D(std::vector<Vector3> &fineEmbedding, int j0, int j1, const Vector3 &d0,
+const Vector3 &d1, const std::vector<int> &bones, RP *rp, RefineStats &stats)
+{
+  double step = 0.001 + d0.lengthsq() + d1.lengthsq();
+  step = 0.0005 / sqrt(step);
+
+  double prevErr = -1e10;
+  int count = 0;
+  while(++count)
+  {
+    double curErr = computeBonesError(fineEmbedding, rp, bones, stats);
+    if(prevErr == -1e10 || curErr < prevErr)
     {
-      std::vector<Vector<DType1, 3> > dMatch(sz);
-      for(i = 0; i < sz; ++i)
+      step *= 2.;
+      fineEmbedding[j0] += d0 * step;
+      fineEmbedding[j1] += d1 * step;
+      prevErr = curErr;
+    }
+    else
+    {
+      if(count > 2)
       {
-        dMatch[i][0] = DType1(fineEmbedding[i][0], i * 3);
-        dMatch[i][1] = DType1(fineEmbedding[i][1], i * 3 + 1);
-        dMatch[i][2] = DType1(fineEmbedding[i][2], i * 3 + 2);
+        fineEmbedding[j0] -= d0 * step;
+        fineEmbedding[j1] -= d1 * step;
       }
+      break;
+    }
+  }
+}
+
+
+//one local step per bone, moving only the bone's two joints
+std::vector<Vector3> optimizeBones(std::vector<Vector3> fineEmbedding, RP *rp, RefineStats &stats)
+{
+  int i, cur, sz = fineEmbedding.size();
+  std::vector<Vector3> grad;
+  std::vector<int> bones;
+  for(cur = 1; cur < sz; ++cur)
+  {
+    int prev = rp->given.fPrev()[cur];
+
+    if(rp->incremental)
+    {
+      //only the terms touching cur or prev contribute to their gradient
+      //or change along the step
+      const std::vector<int> &b0 = rp->jointBones[cur], &b1 = rp->jointBones[prev];
+      bones.clear();
+      std::set_union(b0.begin(), b0.end(), b1.begin(), b1.end(), std::back_inserter(bones));
+
+      grad.assign(sz, Vector3());
+      for(i = 0; i < (int)bones.size(); ++i)
+        computeBoneErrorGrad(fineEmbedding, rp, bones[i], grad);
+      stats.boneTerms += bones.size();
+    }
+    else
+    {
+      computeFineErrorGrad(fineEmbedding, rp, grad);
+      stats.boneTerms += sz - 1;
+    }
+    ++stats.evaluations;
+
+    //the local step has always been seeded with the coordinates themselves
+    //(x * Deriv(1, var) has derivative x), so scale the same way
+    Vector3 dCur = -grad[cur].apply(std::multiplies<double>(), fineEmbedding[cur]);
+    Vector3 dPrev = -grad[prev].apply(std::multiplies<double>(), fineEmbedding[prev]);
 
-      DType1 err = computeFineError(dMatch, &rp) + (DType1() * DType1(0., 3 * sz));
+    if(rp->incremental)
+      optimizeJoints1D(fineEmbedding, cur, prev, dCur, dPrev, bones, rp, stats);
+    else
+    {
       std::vector<Vector3> dir(sz);
+      dir[cur] = dCur;
+      dir[prev] = dPrev;
+      int before = stats.evaluations;
+      fineEmbedding = optimizeEmbedding1D(fineEmbedding, dir, rp, stats);
+      stats.boneTerms += (stats.evaluations - before) * (sz - 1);
+    }
+  }
 
+  return fineEmbedding;
+}
+
+
+//one round of the original optimizer: two global gradient steps followed by
+//a local step per bone, all using step doubling
+static std::vector<Vector3> descentRound(std::vector<Vector3> fineEmbedding, RP *rp, RefineStats &stats)
+{
+  int i, j, sz = fineEmbedding.size();
+  std::vector<Vector3> grad, dir(sz);
+  for(j = 0; j < 2; ++j)
+  {
+    computeFineErrorGrad(fineEmbedding, rp, grad);
+    ++stats.evaluations;
+
+    for(i = 0; i < sz; ++i)
+      dir[i] = -grad[i];
+    fineEmbedding = optimizeEmbedding1D(fineEmbedding, dir, rp, stats);
+  }
+
+  return optimizeBones(fineEmbedding, rp, stats);
+}
+
+
+//the original optimizer: a fixed number of rounds
+std::vector<Vector3> refineDescent(const std::vector<Vector3> &initialEmbedding, RP *rp, RefineStats &stats)
+{
+  std::vector<Vector3> fineEmbedding = initialEmbedding;
+  for(int k = 0; k < 10; ++k)
+  {
+    Debugging::out() << "E = " << computeFineError(fineEmbedding, rp) << std::endl;
+    ++stats.iterations;
+    fineEmbedding = descentRound(fineEmbedding, rp, stats);
+  }
+
+  return fineEmbedding;
+}
+
+
+static double dot(const std::vector<Vector3> &v1, const std::vector<Vector3> &v2)
+{
+  double out = 0.;
+  for(int i = 0; i < (int)v1.size(); ++i)
+    out += v1[i] * v2[i];
+  return out;
+}
+
+
+//The error has kinks (the min/max terms and the surface penalty threshold)
+//where a quasi-Newton step cannot make progress.  A sweep of local per-bone
+//steps gets past them; returns false if the sweep doesn't help either.
+static bool escapeKink(std::vector<Vector3> &x, std::vector<Vector3> &grad, double &err, RP *rp,
+const RefineOptions &options, RefineStats &stats)
+{
+  std::vector<Vector3> newGrad;
+  std::vector<Vector3> swept = optimizeBones(x, rp, stats);
+  double sweptErr = computeFineErrorGrad(swept, rp, newGrad);
+  ++stats.evaluations;
+  if(err - sweptErr <= options.tolerance * std::max(1., fabs(err)))
+    return false;
+
+  x.swap(swept);
+  grad.swap(newGrad);
+  err = sweptErr;
+  return true;
+}
+
+
+//limited memory BFGS with a backtracking (Armijo) line search.  The error is
+//only piecewise smooth, so the curvature pairs that would break positive
+//definiteness are skipped and the memory is reset if the search direction
+//stops being a descent direction.
+//The discrete embedding can start far from the fit, where short steps settle
+//in a poor local minimum (with E several times what DESCENT reaches for
+//skeletons that fit loosely): one round of the original long doubling steps
+//and per-bone steps comes first to get near the right one.
+std::vector<Vector3> refineLBFGS(const std::vector<Vector3> &initialEmbedding, RP *rp,
+const RefineOptions &options, RefineStats &stats)
+{
+  const int memory = 8;
+  int i, j, sz = initialEmbedding.size();
+
+  std::vector<Vector3> x = descentRound(initialEmbedding, rp, stats), grad, newX(sz), newGrad, dir(sz);
+  std::vector<std::vector<Vector3> > sHist, yHist;
+  std::vector<double> rhoHist;
+  std::vector<double> alpha(memory);
+
+  double err = computeFineErrorGrad(x, rp, grad);
+  ++stats.evaluations;
+  Debugging::out() << "E = " << err << std::endl;
+
+  while(stats.iterations < options.maxIterations)
+  {
+    ++stats.iterations;
+
+    //two-loop recursion: dir = -H * grad
+    for(i = 0; i < sz; ++i)
+      dir[i] = -grad[i];
+    int hist = sHist.size();
+    for(j = hist - 1; j >= 0; --j)
+    {
+      alpha[j] = rhoHist[j] * dot(sHist[j], dir);
       for(i = 0; i < sz; ++i)
-      {
-        dir[i][0] = -err.getDeriv(i * 3);
-        dir[i][1] = -err.getDeriv(i * 3 + 1);
-        dir[i][2] = -err.getDeriv(i * 3 + 2);
-      }
-      fineEmbedding = optimizeEmbedding1D(fineEmbedding, dir, &rp);
+        dir[i] -= yHist[j][i] * alpha[j];
+    }
+    if(hist > 0)
+    {
+      double gamma = dot(sHist.back(), yHist.back()) / dot(yHist.back(), yHist.back());
+      for(i = 0; i < sz; ++i)
+        dir[i] *= gamma;
+    }
+    for(j = 0; j < hist; ++j)
+    {
+      double beta = rhoHist[j] * dot(yHist[j], dir);
+      for(i = 0; i < sz; ++i)
+        dir[i] += sHist[j][i] * (alpha[j] - beta);
     }
 
-    int cur;
-    for(cur = 1; cur < sz; ++cur)
+    double slope = dot(dir, grad);
+    if(hist == 0 || slope >= 0.)
     {
-      int prev = skeleton.fPrev()[cur];
+      //steepest descent with a small initial displacement
+      sHist.clear();
+      yHist.clear();
+      rhoHist.clear();
+      double len = sqrt(dot(grad, grad));
+      if(len == 0.)
+        break;
+      for(i = 0; i < sz; ++i)
+        dir[i] = grad[i] * (-0.01 / len);
+      slope = dot(dir, grad);
+    }
 
-      std::vector<Vector<DType, 3> > dMatch(sz);
+    //backtracking line search
+    double step = 1.;
+    double newErr = err;
+    bool found = false;
+    for(int tries = 0; tries < 10; ++tries)
+    {
       for(i = 0; i < sz; ++i)
+        newX[i] = x[i] + dir[i] * step;
+      newErr = computeFineErrorGrad(newX, rp, newGrad);
+      ++stats.evaluations;
+      if(newErr <= err + 1e-4 * step * slope)
       {
-        dMatch[i][0] = DType(fineEmbedding[i][0]);
-        dMatch[i][1] = DType(fineEmbedding[i][1]);
-        dMatch[i][2] = DType(fineEmbedding[i][2]);
-
-        int varNum = -1;
-        if(i == cur)
-          varNum = 0;
-        else if(i == prev)
-          varNum = 3;
+        found = true;
+        break;
+      }
+      step *= 0.5;
+    }
+    if(!found)
+    {
+      if(hist > 0)
+      {
+        //retry from steepest descent
+        sHist.clear();
+        yHist.clear();
+        rhoHist.clear();
+        continue;
+      }
+      if(!escapeKink(x, grad, err, rp, options, stats))
+        break;
+      continue;
+    }
 
-        if(varNum >= 0)
-        {
-          dMatch[i][0] *= DType(1, varNum + 0);
-          dMatch[i][1] *= DType(1, varNum + 1);
-          dMatch[i][2] *= DType(1, varNum + 2);
-        }
+    //update the curvature history
+    std::vector<Vector3> s(sz), y(sz);
+    for(i = 0; i < sz; ++i)
+    {
+      s[i] = newX[i] - x[i];
+      y[i] = newGrad[i] - grad[i];
+    }
+    double sy = dot(s, y);
+    if(sy > 1e-12 * sqrt(dot(s, s) * dot(y, y)))
+    {
+      if((int)sHist.size() == memory)
+      {
+        sHist.erase(sHist.begin());
+        yHist.erase(yHist.begin());
+        rhoHist.erase(rhoHist.begin());
       }
+      sHist.push_back(s);
+      yHist.push_back(y);
+      rhoHist.push_back(1. / sy);
+    }
 
-      DType err = computeFineError(dMatch, &rp);
+    double decrease = err - newErr;
+    x.swap(newX);
+    grad.swap(newGrad);
+    err = newErr;
 
-      std::vector<Vector3> dir(sz);
+    //converged, or stuck on one of the kinks of the error
+    if(decrease <= options.tolerance * std::max(1., fabs(err)))
+    {
+      sHist.clear();
+      yHist.clear();
+      rhoHist.clear();
+      if(!escapeKink(x, grad, err, rp, options, stats))
+        break;
+    }
+  }
 
-      for(i = 0; i < sz; ++i)
-      {
-        int varNum = -1;
-        if(i == cur)
-          varNum = 0;
-        else if(i == prev)
-          varNum = 3;
+  Debugging::out() << "E = " << err << std::endl;
+  return x;
+}
 
-        if(varNum >= 0)
-        {
-          dir[i][0] = -err.getDeriv(varNum);
-          dir[i][1] = -err.getDeriv(varNum + 1);
-          dir[i][2] = -err.getDeriv(varNum + 2);
-        }
+
+//largest difference between computeFineErrorGrad and the forward mode
+//derivatives of computeFineError at match, over the largest gradient entry
+static double gradientError(const std::vector<Vector3> &match, RP *rp)
+{
+  typedef Deriv<double, -1> DType1;
+  int i, d, sz = match.size();
+  std::vector<Vector3> grad;
+  computeFineErrorGrad(match, rp, grad);
+
+  std::vector<Vector<DType1, 3> > dMatch(sz);
+  for(i = 0; i < sz; ++i)
+    for(d = 0; d < 3; ++d)
+      dMatch[i][d] = DType1(match[i][d], i * 3 + d);
+  //the product makes sure every derivative slot exists
+  DType1 err = computeFineError(dMatch, rp) + (DType1() * DType1(0., 3 * sz));
+
+  double maxDiff = 0., maxGrad = 0.;
+  for(i = 0; i < sz; ++i)
+  {
+    for(d = 0; d < 3; ++d)
+    {
+      maxDiff = std::max(maxDiff, fabs(grad[i][d] - err.getDeriv(i * 3 + d)));
+      maxGrad = std::max(maxGrad, fabs(err.getDeriv(i * 3 + d)));
+    }
+  }
+  return maxGrad > 0. ? maxDiff / maxGrad : maxDiff;
+}
+
+
+//refines embedding
+std::vector<Vector3> refineEmbedding(TreeType *distanceField, const std::vector<Vector3> &medialSurface,
+const std::vector<Vector3> &initialEmbedding, const Skeleton &skeleton, const RefineOptions &options,
+RefineStats *stats)
+{
+  RP rp(distanceField, skeleton, medialSurface, options);
+
+  RefineStats curStats;
+  if(rp.medialField && options.checkMedial)
+  {
+    //check the field against exact projections along the initial bones
+    int i, k;
+    for(i = 1; i < (int)initialEmbedding.size(); ++i)
+    {
+      for(k = 0; k <= 10; ++k)
+      {
+        Vector3 cur = initialEmbedding[i] * (1. - k * 0.1) + initialEmbedding[skeleton.fPrev()[i]] * (k * 0.1);
+        double exact = (cur - rp.medProjector.project(cur)).length();
+        curStats.medialFieldError = std::max(curStats.medialFieldError, fabs(rp.medialDist(cur) - exact));
       }
-      fineEmbedding = optimizeEmbedding1D(fineEmbedding, dir, &rp);
     }
+    Debugging::out() << "Medial field nodes = " << rp.medialField->countNodes() << " max error = "
+      << curStats.medialFieldError << std::endl;
+  }
+
+  curStats.initialError = computeFineError(initialEmbedding, &rp);
+  if(options.checkGradient)
+    curStats.gradientError = gradientError(initialEmbedding, &rp);
+
+  std::vector<Vector3> fineEmbedding;
+  if(options.method == RefineOptions::DESCENT)
+    fineEmbedding = refineDescent(initialEmbedding, &rp, curStats);
+  else
+    fineEmbedding = refineLBFGS(initialEmbedding, &rp, options, curStats);
+
+  curStats.error = computeFineError(fineEmbedding, &rp);
+  Debugging::out() << "Refinement: E = " << curStats.error << " iterations = " << curStats.iterations
+    << " evaluations = " << curStats.evaluations << " bone terms = " << curStats.boneTerms << std::endl;
+  if(options.checkGradient)
+  {
+    curStats.gradientError = std::max(curStats.gradientError, gradientError(fineEmbedding, &rp));
+    Debugging::out() << "Gradient max relative error = " << curStats.gradientError << std::endl;
   }
+  if(stats)
+    *stats = curStats;
 
   return fineEmbedding;
 }
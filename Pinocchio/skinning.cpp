@@ -0,0 +1,1169 @@
+/*  This file is part of the Pinocchio automatic rigging library.
+    Copyright (C) 2007 Ilya Baran (ibaran@mit.edu)
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#include "skinning.h"
+#include "threadpool.h"
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define PINOCCHIO_AVX2_KERNELS
+#include <immintrin.h>
+#endif
+
+namespace Pinocchio {
+
+//exactly the same numbers, unlike Quaternion::operator==, which also
+//takes q and -q to be the same
+static bool sameTransform(const Transform<> &t1, const Transform<> &t2)
+{
+  int i;
+  for(i = 0; i < 4; ++i)
+    if(t1.getRot()[i] != t2.getRot()[i])
+      return false;
+  return t1.getScale() == t2.getScale() && t1.getTrans() == t2.getTrans();
+}
+
+
+void SkinningContext::setTransforms(const std::vector<Transform<> > &inTransforms)
+{
+  int b, n = inTransforms.size();
+
+  bool everything = allChanged || n != (int)transforms.size();
+  changed.clear();
+  for(b = 0; b < n; ++b)
+    if(everything || !sameTransform(inTransforms[b], transforms[b]))
+      changed.push_back(b);
+  findChangedRanges(everything);
+  allChanged = false;
+
+  transforms.assign(inTransforms.begin(), inTransforms.end());
+  setPalettes();
+}
+
+
+void SkinningContext::setTransforms(const std::vector<Transform<float> > &inTransforms)
+{
+  int b, n = inTransforms.size();
+
+  //converted straight into the stored transforms, each compared first
+  bool everything = allChanged || n != (int)transforms.size();
+  transforms.resize(n);
+  changed.clear();
+  for(b = 0; b < n; ++b)
+  {
+    Transform<> t(inTransforms[b]);
+    if(everything || !sameTransform(t, transforms[b]))
+      changed.push_back(b);
+    transforms[b] = t;
+  }
+  findChangedRanges(everything);
+  allChanged = false;
+
+  setPalettes();
+}
+
+
+void SkinningContext::setPalettes()
+{
+  int b, n = transforms.size();
+
+  dualQuats.resize(n);
+  axes.resize(n * 3);
+  matrices.resize(n * 12);
+  floatDualQuats.resize(n * 8);
+  for(b = 0; b < n; ++b)
+  {
+    const Transform<> &t = transforms[b];
+    dualQuats[b] = getQuatFromMat(t);
+
+    //the columns of the linear part are the transformed axes
+    Vector3 c0 = t.getRot() * Vector3(t.getScale(), 0., 0.);
+    Vector3 c1 = t.getRot() * Vector3(0., t.getScale(), 0.);
+    Vector3 c2 = t.getRot() * Vector3(0., 0., t.getScale());
+    Vector3 trans = t.getTrans();
+    axes[b * 3] = c0;
+    axes[b * 3 + 1] = c1;
+    axes[b * 3 + 2] = c2;
+    float *m = &matrices[b * 12];
+    for(int r = 0; r < 3; ++r)
+    {
+      m[r * 4 + 0] = (float)c0[r];
+      m[r * 4 + 1] = (float)c1[r];
+      m[r * 4 + 2] = (float)c2[r];
+      m[r * 4 + 3] = (float)trans[r];
+    }
+
+    Tbx::Quat_cu q0 = dualQuats[b].get_non_dual_part(), qe = dualQuats[b].get_dual_part();
+    float *dq = &floatDualQuats[b * 8];
+    dq[0] = q0.w(); dq[1] = q0.i(); dq[2] = q0.j(); dq[3] = q0.k();
+    dq[4] = qe.w(); dq[5] = qe.i(); dq[6] = qe.j(); dq[7] = qe.k();
+  }
+}
+
+
+//appends the runs of consecutive entries of the sorted vertices as
+//[begin, end) pairs
+static void appendRanges(const std::vector<int> &vertices, std::vector<int> &ranges)
+{
+  int i;
+  for(i = 0; i < (int)vertices.size(); ++i)
+  {
+    if(i > 0 && vertices[i] == vertices[i - 1] + 1)
+      ranges.back() = vertices[i] + 1;
+    else
+    {
+      ranges.push_back(vertices[i]);
+      ranges.push_back(vertices[i] + 1);
+    }
+  }
+}
+
+
+void SkinningContext::setInfluences(const Mesh &rest, const SkinWeights &weights)
+{
+  int i, j, b, nv = weights.vertices;
+
+  std::vector<std::vector<int> > touched(weights.bones);
+  for(i = 0; i < nv; ++i)
+    for(j = weights.offsets[i]; j < (int)weights.offsets[i + 1]; ++j)
+      touched[weights.boneIds[j]].push_back(i);
+
+  positionStart.assign(1, 0);
+  positionRanges.clear();
+  normalStart.assign(1, 0);
+  normalRanges.clear();
+  std::vector<int> ring;
+  for(b = 0; b < weights.bones; ++b)
+  {
+    appendRanges(touched[b], positionRanges);
+    positionStart.push_back(positionRanges.size() / 2);
+
+    //the normal of a vertex depends on the positions of its neighbors
+    ring = touched[b];
+    if(nv == (int)rest.vertices.size())
+    {
+      for(i = 0; i < (int)touched[b].size(); ++i)
+      {
+        int cur, start;
+        cur = start = rest.vertices[touched[b][i]].edge;
+        if(start < 0)
+          continue;
+        do
+        {
+          ring.push_back(rest.edges[cur].vertex);
+          cur = rest.edges[rest.edges[cur].prev].twin;
+        } while(cur != start);
+      }
+    }
+    sort(ring.begin(), ring.end());
+    ring.erase(unique(ring.begin(), ring.end()), ring.end());
+    appendRanges(ring, normalRanges);
+    normalStart.push_back(normalRanges.size() / 2);
+  }
+
+  indexVertices = nv;
+  allChanged = true;
+  findChangedRanges(true);
+}
+
+
+//merges the ranges of the changed bones into dirtyPositions and dirtyNormals
+void SkinningContext::findChangedRanges(bool everything)
+{
+  int i;
+  dirtyPositions.clear();
+  dirtyNormals.clear();
+  if(indexVertices < 0)
+    return;
+  if(everything)
+  {
+    //including the vertices that no bone moves
+    dirtyPositions.push_back(0);
+    dirtyPositions.push_back(indexVertices);
+    dirtyNormals = dirtyPositions;
+    return;
+  }
+
+  for(int pass = 0; pass < 2; ++pass)
+  {
+    const std::vector<int> &start = pass ? normalStart : positionStart;
+    const std::vector<int> &ranges = pass ? normalRanges : positionRanges;
+    std::vector<int> &dirty = pass ? dirtyNormals : dirtyPositions;
+
+    //collect the ranges as (begin, end) pairs, sort them and merge overlaps
+    std::vector<std::pair<int, int> > &all = mergeScratch;
+    all.clear();
+    for(i = 0; i < (int)changed.size(); ++i)
+    {
+      int b = changed[i];
+      if(b + 1 >= (int)start.size())
+        continue;
+      for(int r = start[b]; r < start[b + 1]; ++r)
+        all.push_back(std::make_pair(ranges[r * 2], ranges[r * 2 + 1]));
+    }
+    sort(all.begin(), all.end());
+    for(i = 0; i < (int)all.size(); ++i)
+    {
+      if(!dirty.empty() && all[i].first <= dirty.back())
+        dirty.back() = std::max(dirty.back(), all[i].second);
+      else
+      {
+        dirty.push_back(all[i].first);
+        dirty.push_back(all[i].second);
+      }
+    }
+  }
+}
+
+
+/*
+ * This function deforms a vertex using the normal linear blend
+ * skinning. This was the original code used in Pinocchio before
+ * our adjustments.
+ */
+static Vector3 linearBlend(const SkinWeights &weights, int i, const Vector3 &pos,
+  const SkinningContext &context)
+{
+  int j;
+  int first = weights.offsets[i];
+  int nbones = weights.offsets[i + 1] - first;
+  Vector3 newPos;
+
+  // Loop through bones and sum up their weighted
+  // transformations
+  for(j = 0; j < nbones; ++j)
+  {
+    newPos += ((context.transform(weights.boneIds[first + j]) *
+      pos) * weights.weights[first + j]);
+  }
+  return newPos;
+}
+
+/*
+ * The normal of a vertex under linear blend skinning: the rest normal times
+ * the inverse transpose of the blended linear part.  The cofactor matrix,
+ * whose columns are the cross products of the columns, is the inverse
+ * transpose up to the determinant, which the normalization takes care of.
+ */
+static Vector3 linearBlendNormal(const SkinWeights &weights, int i, const Vector3 &normal,
+  const SkinningContext &context)
+{
+  int j;
+  int first = weights.offsets[i];
+  int nbones = weights.offsets[i + 1] - first;
+  Vector3 c0, c1, c2;
+
+  for(j = 0; j < nbones; ++j)
+  {
+    const Vector3 *linear = context.linearPart(weights.boneIds[first + j]);
+    double w = weights.weights[first + j];
+    c0 += linear[0] * w;
+    c1 += linear[1] * w;
+    c2 += linear[2] * w;
+  }
+  return ((c1 % c2) * normal[0] + (c2 % c0) * normal[1] + (c0 % c1) * normal[2]).normalize();
+}
+
+/*
+ * This function blends the dual quaternions of the bones of a vertex
+ * for dual quaternion skinning; transformPoint then deforms the vertex.
+ * We used the functions from the skinning library by Rodolphe
+ * Vaillant-David.  The bone dual quaternions come from the context.
+ */
+static Tbx::Dual_quat_cu blendDualQuats(const SkinWeights &weights, int i,
+  const SkinningContext &context)
+{
+  int j;
+  int first = weights.offsets[i];
+  int nbones = weights.offsets[i + 1] - first;
+  Tbx::Dual_quat_cu dquat_blend;
+  Tbx::Quat_cu q0;
+
+  // inititialize the first dual quaternion
+  if (nbones == 0)
+  {
+    dquat_blend = Tbx::Dual_quat_cu::identity();
+    q0 = dquat_blend.rotation();
+  }
+  else
+  {
+    const Tbx::Dual_quat_cu &dquat = context.dualQuat(weights.boneIds[first]);
+    dquat_blend = dquat * weights.weights[first];
+    q0 = dquat.rotation();
+  }
+
+  for(j = 1; j < nbones; ++j)
+  {
+    float w = weights.weights[first + j];
+    const Tbx::Dual_quat_cu& dq =
+      (w <= 0) ?
+      Tbx::Dual_quat_cu::identity() :
+      context.dualQuat(weights.boneIds[first + j]);
+
+    // find shortest rotation
+    if (dq.rotation().dot(q0) < 0.f)
+      w *= -1.f;
+
+    // combine the quaternion with the main quaternion
+    // that will be used for transforming.
+    dquat_blend = dquat_blend + dq * w;
+  }
+
+  return dquat_blend;
+}
+
+/*
+ *  This function deforms a vertex using a blended result of both
+ *  dual quaternion and linear blend skinning. The blending weight
+ *  refers to how much of the linear blend result will be mixed in.
+ *  For example, if the blending weight is 0.2, then 20% of the linear
+ *  blend result will be used, while 80% of the dual quaternion result
+ *  will be used.
+ */
+static Vector3 mixedBlend(const SkinWeights &weights, int i, const Vector3 &pos,
+  const SkinningContext &context, Tbx::Dual_quat_cu dquat_blend, float blendWeight)
+{
+  return linearBlend(weights, i, pos, context) * blendWeight +
+    transformPoint(pos, dquat_blend) * (1.0 - blendWeight);
+}
+
+//calls f(begin, end) on consecutive ranges of the nv vertices, spread over
+//the global pool if there are enough of them.  Ranges are whole chunks, so
+//every begin is a multiple of SkinningContext::skinningChunk.
+static bool skinsInParallel(int nv, const SkinningContext &context)
+{
+  return nv >= context.parallelThreshold() && nv > SkinningContext::skinningChunk &&
+    ThreadPool::global().size() > 1;
+}
+
+//calls f(begin, end, instance) for every chunk of the nv vertices of each
+//of the instances.  The work is tiled so that the instances of a group run
+//one after the other on a chunk, while its rest positions and weights are
+//in cache, and the tiles are spread over the global pool if there is
+//enough work.
+template<class F> static void forInstanceTiles(int nv, int instances, int threshold, const F &f)
+{
+  const int chunk = SkinningContext::skinningChunk, group = 8;
+  int chunks = (nv + chunk - 1) / chunk;
+  int groups = (instances + group - 1) / group;
+
+  auto tile = [&](int t)
+  {
+    //consecutive tiles share a chunk, so concurrent ones share the cache too
+    int c = t / groups, g = t % groups;
+    int i, begin = c * chunk, end = std::min(nv, (c + 1) * chunk);
+    for(i = g * group; i < std::min(instances, (g + 1) * group); ++i)
+      f(begin, end, i);
+  };
+
+  if((long long)nv * instances < threshold || ThreadPool::global().size() == 1)
+  {
+    for(int t = 0; t < chunks * groups; ++t)
+      tile(t);
+    return;
+  }
+  ThreadPool::global().parallelFor(chunks * groups, tile);
+}
+
+template<class F> static void forVertexChunks(int nv, const SkinningContext &context, const F &f)
+{
+  const int chunk = SkinningContext::skinningChunk;
+
+  if(!skinsInParallel(nv, context))
+  {
+    f(0, nv);
+    return;
+  }
+  ThreadPool::global().parallelFor((nv + chunk - 1) / chunk, [&](int c)
+  {
+    f(c * chunk, std::min(nv, (c + 1) * chunk));
+  });
+}
+
+//normals of vertices begin to end - 1 from the deformed positions.  Each
+//vertex walks its own faces and only writes its own normal, so ranges can
+//run in parallel without locks or scratch space, at the cost of computing
+//every face normal once per corner.  The sums are in ring order rather
+//than face order and can differ from the serial ones in the last bit.
+static void gatherNormals(const Mesh &mesh, const DeformTarget &target, int begin, int end)
+{
+  int v;
+  for(v = begin; v < end; ++v)
+  {
+    Vector3 sum;
+    int cur, start;
+    cur = start = mesh.vertices[v].edge;
+    if(start >= 0)
+    {
+      do
+      {
+        int face = cur - cur % 3;
+        Vector3 p1 = target.position(mesh.edges[face].vertex);
+        Vector3 p2 = target.position(mesh.edges[face + 1].vertex);
+        Vector3 p3 = target.position(mesh.edges[face + 2].vertex);
+        sum += ((p2 - p1) % (p3 - p1)).normalize();
+        cur = mesh.edges[mesh.edges[cur].prev].twin;
+      } while(cur != start);
+    }
+    target.setNormal(v, sum.normalize());
+  }
+}
+
+//all the normals on one thread, scattering every face normal to its corners
+static void scatterNormals(const Mesh &mesh, const DeformTarget &target)
+{
+  int i, nv = mesh.vertices.size();
+  for(i = 0; i < nv; ++i)
+    target.setNormal(i, Vector3());
+  for(i = 0; i < (int)mesh.edges.size(); i += 3)
+  {
+    int i1 = mesh.edges[i].vertex;
+    int i2 = mesh.edges[i + 1].vertex;
+    int i3 = mesh.edges[i + 2].vertex;
+    Vector3 p1 = target.position(i1);
+    Vector3 normal = ((target.position(i2) - p1) % (target.position(i3) - p1)).normalize();
+    target.setNormal(i1, target.normal(i1) + normal);
+    target.setNormal(i2, target.normal(i2) + normal);
+    target.setNormal(i3, target.normal(i3) + normal);
+  }
+  for(i = 0; i < nv; ++i)
+    target.setNormal(i, target.normal(i).normalize());
+}
+
+//unit face normals of the deformed positions, summed at the vertices
+//and normalized, like Mesh::computeVertexNormals
+static void computeNormals(const Mesh &mesh, const SkinningContext &context,
+  const DeformTarget &target)
+{
+  int nv = mesh.vertices.size();
+
+  if(!skinsInParallel(nv, context))
+  {
+    scatterNormals(mesh, target);
+    return;
+  }
+
+  forVertexChunks(nv, context, [&](int begin, int end) { gatherNormals(mesh, target, begin, end); });
+}
+
+
+//positions (and skinned normals) of vertices begin to end - 1
+static void skinVertices(const Mesh &rest, const SkinWeights &weights, const SkinningContext &context,
+  const DeformTarget &target, bool skinNormals, int begin, int end)
+{
+  int v;
+  for(v = begin; v < end; ++v)
+  {
+    const Vector3 &pos = rest.vertices[v].pos;
+    const Vector3 &normal = rest.vertices[v].normal;
+    Vector3 newPos, newNormal;
+
+    if (rest.algo == Mesh::DQS)
+    {
+      Tbx::Dual_quat_cu dquat_blend = blendDualQuats(weights, v, context);
+      newPos = transformPoint(pos, dquat_blend);
+      if(skinNormals)
+        newNormal = rotateVector(normal, dquat_blend);
+    }
+    else if (rest.algo == Mesh::LBS)
+    {
+      newPos = linearBlend(weights, v, pos, context);
+      if(skinNormals)
+        newNormal = linearBlendNormal(weights, v, normal, context);
+    }
+    else if (rest.algo == Mesh::MIX)
+    {
+      Tbx::Dual_quat_cu dquat_blend = blendDualQuats(weights, v, context);
+      newPos = mixedBlend(weights, v, pos, context, dquat_blend, rest.blendWeight);
+      if(skinNormals)
+        newNormal = (linearBlendNormal(weights, v, normal, context) * rest.blendWeight +
+          rotateVector(normal, dquat_blend) * (1.0 - rest.blendWeight)).normalize();
+    }
+    else
+    {
+      newPos = pos;
+      newNormal = normal;
+    }
+    target.setPosition(v, newPos);
+    if(skinNormals)
+      target.setNormal(v, newNormal);
+  }
+}
+
+
+bool skin(const Mesh &rest, const SkinWeights &weights,
+  const SkinningContext &context, const DeformTarget &target)
+{
+  int nv = rest.vertices.size();
+
+  if(nv != weights.vertices || (weights.bones > 0 && context.size() < weights.bones))
+    //error
+    return false;
+
+  bool skinNormals = target.wantsNormals() && context.normalMode() == SkinningContext::SKINNED_NORMALS;
+
+  //every vertex is blended on its own, so the chunks write disjoint entries
+  forVertexChunks(nv, context, [&](int begin, int end)
+  {
+    skinVertices(rest, weights, context, target, skinNormals, begin, end);
+  });
+
+  if(target.wantsNormals() && !skinNormals)
+    computeNormals(rest, context, target);
+  return true;
+}
+
+
+bool skinChanged(const Mesh &rest, const SkinWeights &weights,
+  const SkinningContext &context, const DeformTarget &target)
+{
+  int r;
+  int nv = rest.vertices.size();
+
+  if(nv != weights.vertices || context.influenceIndexSize() != nv ||
+    (weights.bones > 0 && context.size() < weights.bones))
+    //error
+    return false;
+
+  bool skinNormals = target.wantsNormals() && context.normalMode() == SkinningContext::SKINNED_NORMALS;
+
+  const std::vector<int> &positions = context.changedVertices();
+  for(r = 0; r < (int)positions.size(); r += 2)
+  {
+    int first = positions[r];
+    forVertexChunks(positions[r + 1] - first, context, [&](int begin, int end)
+    {
+      skinVertices(rest, weights, context, target, skinNormals, first + begin, first + end);
+    });
+  }
+
+  if(target.wantsNormals() && !skinNormals)
+  {
+    //every normal that changes is recomputed after all the positions are in.
+    //Gathering costs about three times what the serial scatter over all the
+    //faces does per vertex, so past a third of the mesh the scatter wins.
+    const std::vector<int> &normals = context.changedNormals();
+    int count = 0;
+    for(r = 0; r < (int)normals.size(); r += 2)
+      count += normals[r + 1] - normals[r];
+    if(!skinsInParallel(nv, context) && count * 3 > nv)
+    {
+      computeNormals(rest, context, target);
+      return true;
+    }
+    for(r = 0; r < (int)normals.size(); r += 2)
+    {
+      int first = normals[r];
+      forVertexChunks(normals[r + 1] - first, context, [&](int begin, int end)
+      {
+        gatherNormals(rest, target, first + begin, first + end);
+      });
+    }
+  }
+  return true;
+}
+
+
+bool skinInstances(const Mesh &rest, const SkinWeights &weights,
+  const std::vector<SkinningContext> &poses, const std::vector<DeformTarget> &targets)
+{
+  int i;
+  int nv = rest.vertices.size(), n = poses.size();
+
+  if(nv != weights.vertices || (int)targets.size() != n)
+    //error
+    return false;
+  for(i = 0; i < n; ++i)
+    if(weights.bones > 0 && poses[i].size() < weights.bones)
+      //error
+      return false;
+  if(n == 0)
+    return true;
+
+  forInstanceTiles(nv, n, poses[0].parallelThreshold(), [&](int begin, int end, int instance)
+  {
+    const DeformTarget &target = targets[instance];
+    bool skinNormals = target.wantsNormals() &&
+      poses[instance].normalMode() == SkinningContext::SKINNED_NORMALS;
+    skinVertices(rest, weights, poses[instance], target, skinNormals, begin, end);
+  });
+
+  //recomputed normals need all the positions of an instance, so they go
+  //one instance per task
+  auto normals = [&](int instance)
+  {
+    const DeformTarget &target = targets[instance];
+    if(target.wantsNormals() && poses[instance].normalMode() != SkinningContext::SKINNED_NORMALS)
+      scatterNormals(rest, target);
+  };
+  if((long long)nv * n < poses[0].parallelThreshold())
+    for(i = 0; i < n; ++i)
+      normals(i);
+  else
+    ThreadPool::global().parallelFor(n, normals);
+  return true;
+}
+
+
+PackedSkin::PackedSkin(const Mesh &rest, const SkinWeights &inWeights)
+  : vertices(rest.vertices.size()), padded(0), slots(1), bones(inWeights.bones),
+  algo(rest.algo), blendWeight(rest.blendWeight)
+{
+  int i, k;
+
+  if(inWeights.vertices != vertices)
+    //error
+    vertices = 0;
+  padded = (vertices + 7) / 8 * 8;
+  for(i = 0; i < vertices; ++i)
+    slots = std::max(slots, (int)(inWeights.offsets[i + 1] - inWeights.offsets[i]));
+  //round up to a width that has its own kernels
+  if(slots == 3)
+    slots = 4;
+  else if(slots > 4 && slots < 8)
+    slots = 8;
+
+  restX.assign(padded, 0.f);
+  restY.assign(padded, 0.f);
+  restZ.assign(padded, 0.f);
+  restNX.assign(padded, 0.f);
+  restNY.assign(padded, 0.f);
+  restNZ.assign(padded, 0.f);
+  boneIds.assign(slots * padded, 0);
+  weights.assign(slots * padded, 0.f);
+  for(i = 0; i < vertices; ++i)
+  {
+    const Vector3 &pos = rest.vertices[i].pos;
+    restX[i] = (float)pos[0];
+    restY[i] = (float)pos[1];
+    restZ[i] = (float)pos[2];
+    const Vector3 &normal = rest.vertices[i].normal;
+    restNX[i] = (float)normal[0];
+    restNY[i] = (float)normal[1];
+    restNZ[i] = (float)normal[2];
+    for(k = 0; k < (int)(inWeights.offsets[i + 1] - inWeights.offsets[i]); ++k)
+    {
+      boneIds[k * padded + i] = inWeights.boneIds[inWeights.offsets[i] + k];
+      weights[k * padded + i] = inWeights.weights[inWeights.offsets[i] + k];
+    }
+  }
+  chooseKernels();
+}
+
+
+//what the float kernels read and write
+struct PackedKernelArgs
+{
+  const float *restX, *restY, *restZ;
+  const int *boneIds;
+  const float *weights;
+  int padded, slots;
+  const float *matrices, *dualQuats;
+  float blendWeight;
+  float *x, *y, *z;
+  //normals are skipped if nx is NULL
+  const float *restNX, *restNY, *restNZ;
+  float *nx, *ny, *nz;
+};
+
+
+//leaves zero vectors alone
+static inline void normalizePacked(float &x, float &y, float &z)
+{
+  float len2 = x * x + y * y + z * z;
+  if(len2 > 0.f)
+  {
+    float inv = 1.f / std::sqrt(len2);
+    x *= inv; y *= inv; z *= inv;
+  }
+}
+
+
+//The kernels are instantiated for each blend mode and for 1, 2, 4 and 8
+//influence slots, so that the loops over the slots unroll and the mode
+//tests fold away.  Slots = 0 reads the slot count from the arguments.
+
+//one vertex at a time in float, the same math as the AVX2 kernel
+template<int Slots, int Algo>
+static void skinPackedScalar(const PackedKernelArgs &a, int begin, int end)
+{
+  int i, k, c;
+  const int slots = Slots ? Slots : a.slots;
+  const bool lbs = Algo != Mesh::DQS, dqs = Algo != Mesh::LBS;
+  const bool normals = a.nx != NULL;
+
+  for(i = begin; i < end; ++i)
+  {
+    float px = a.restX[i], py = a.restY[i], pz = a.restZ[i];
+    float lx = 0.f, ly = 0.f, lz = 0.f, dx = px, dy = py, dz = pz;
+    float nx = 0.f, ny = 0.f, nz = 0.f;
+    if(normals)
+      { nx = a.restNX[i]; ny = a.restNY[i]; nz = a.restNZ[i]; }
+    float lnx = 0.f, lny = 0.f, lnz = 0.f, dnx = nx, dny = ny, dnz = nz;
+
+    if(lbs)
+    {
+      float l[9] = { 0.f, 0.f, 0.f, 0.f, 0.f, 0.f, 0.f, 0.f, 0.f }; //blended linear part, by rows
+      for(k = 0; k < slots; ++k)
+      {
+        float w = a.weights[k * a.padded + i];
+        const float *m = a.matrices + 12 * a.boneIds[k * a.padded + i];
+        lx += w * (m[0] * px + m[1] * py + m[2] * pz + m[3]);
+        ly += w * (m[4] * px + m[5] * py + m[6] * pz + m[7]);
+        lz += w * (m[8] * px + m[9] * py + m[10] * pz + m[11]);
+        if(normals)
+          for(c = 0; c < 9; ++c)
+            l[c] += w * m[c / 3 * 4 + c % 3];
+      }
+
+      if(normals)
+      {
+        //the cofactor matrix, as in linearBlendNormal
+        lnx = (l[4] * l[8] - l[7] * l[5]) * nx + (l[5] * l[6] - l[8] * l[3]) * ny + (l[3] * l[7] - l[6] * l[4]) * nz;
+        lny = (l[7] * l[2] - l[1] * l[8]) * nx + (l[8] * l[0] - l[2] * l[6]) * ny + (l[6] * l[1] - l[0] * l[7]) * nz;
+        lnz = (l[1] * l[5] - l[4] * l[2]) * nx + (l[2] * l[3] - l[5] * l[0]) * ny + (l[0] * l[4] - l[3] * l[1]) * nz;
+        normalizePacked(lnx, lny, lnz);
+      }
+    }
+
+    if(dqs)
+    {
+      //blend, flipping the quaternions on the other side of the first one
+      float b[8] = { 0.f, 0.f, 0.f, 0.f, 0.f, 0.f, 0.f, 0.f };
+      const float *pivot = a.dualQuats + 8 * a.boneIds[i];
+      for(k = 0; k < slots; ++k)
+      {
+        float w = a.weights[k * a.padded + i];
+        const float *q = a.dualQuats + 8 * a.boneIds[k * a.padded + i];
+        if(q[0] * pivot[0] + q[1] * pivot[1] + q[2] * pivot[2] + q[3] * pivot[3] < 0.f)
+          w = -w;
+        for(c = 0; c < 8; ++c)
+          b[c] += w * q[c];
+      }
+
+      float norm2 = b[0] * b[0] + b[1] * b[1] + b[2] * b[2] + b[3] * b[3];
+      if(norm2 > 0.f)
+      {
+        float inv = 1.f / std::sqrt(norm2);
+        float qw = b[0] * inv, qx = b[1] * inv, qy = b[2] * inv, qz = b[3] * inv;
+        float ew = b[4] * inv, ex = b[5] * inv, ey = b[6] * inv, ez = b[7] * inv;
+
+        //translation 2 (e.vec q.w - q.vec e.w + q.vec x e.vec)
+        float tx = 2.f * (ex * qw - qx * ew + (qy * ez - qz * ey));
+        float ty = 2.f * (ey * qw - qy * ew + (qz * ex - qx * ez));
+        float tz = 2.f * (ez * qw - qz * ew + (qx * ey - qy * ex));
+
+        //rotation p + 2 q.vec x (q.vec x p + q.w p)
+        float ux = (qy * pz - qz * py) + qw * px;
+        float uy = (qz * px - qx * pz) + qw * py;
+        float uz = (qx * py - qy * px) + qw * pz;
+        dx = px + 2.f * (qy * uz - qz * uy) + tx;
+        dy = py + 2.f * (qz * ux - qx * uz) + ty;
+        dz = pz + 2.f * (qx * uy - qy * ux) + tz;
+
+        if(normals)
+        {
+          float vx = (qy * nz - qz * ny) + qw * nx;
+          float vy = (qz * nx - qx * nz) + qw * ny;
+          float vz = (qx * ny - qy * nx) + qw * nz;
+          dnx = nx + 2.f * (qy * vz - qz * vy);
+          dny = ny + 2.f * (qz * vx - qx * vz);
+          dnz = nz + 2.f * (qx * vy - qy * vx);
+        }
+      }
+    }
+
+    if(Algo == Mesh::LBS)
+      { a.x[i] = lx; a.y[i] = ly; a.z[i] = lz; }
+    else if(Algo == Mesh::DQS)
+      { a.x[i] = dx; a.y[i] = dy; a.z[i] = dz; }
+    else
+    {
+      a.x[i] = lx * a.blendWeight + dx * (1.f - a.blendWeight);
+      a.y[i] = ly * a.blendWeight + dy * (1.f - a.blendWeight);
+      a.z[i] = lz * a.blendWeight + dz * (1.f - a.blendWeight);
+    }
+
+    if(!normals)
+      continue;
+    if(Algo == Mesh::LBS)
+      { nx = lnx; ny = lny; nz = lnz; }
+    else if(Algo == Mesh::DQS)
+      { nx = dnx; ny = dny; nz = dnz; }
+    else
+    {
+      nx = lnx * a.blendWeight + dnx * (1.f - a.blendWeight);
+      ny = lny * a.blendWeight + dny * (1.f - a.blendWeight);
+      nz = lnz * a.blendWeight + dnz * (1.f - a.blendWeight);
+      normalizePacked(nx, ny, nz);
+    }
+    a.nx[i] = nx; a.ny[i] = ny; a.nz[i] = nz;
+  }
+}
+
+
+#ifdef PINOCCHIO_AVX2_KERNELS
+
+//normalizePacked for 8 vectors
+__attribute__((target("avx2,fma")))
+static inline void normalizeAVX2(__m256 &x, __m256 &y, __m256 &z)
+{
+  const __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.f);
+  __m256 len2 = _mm256_fmadd_ps(x, x, _mm256_fmadd_ps(y, y, _mm256_mul_ps(z, z)));
+  __m256 inv = _mm256_div_ps(one, _mm256_sqrt_ps(_mm256_blendv_ps(len2, one,
+    _mm256_cmp_ps(len2, zero, _CMP_LE_OQ))));
+  x = _mm256_mul_ps(x, inv);
+  y = _mm256_mul_ps(y, inv);
+  z = _mm256_mul_ps(z, inv);
+}
+
+
+//stores the first count lanes of v, all of them if count >= 8
+__attribute__((target("avx2,fma")))
+static inline void storeLanes(float *out, __m256 v, int count)
+{
+  if(count >= 8)
+    _mm256_storeu_ps(out, v);
+  else
+  {
+    float tmp[8];
+    _mm256_storeu_ps(tmp, v);
+    memcpy(out, tmp, count * sizeof(float));
+  }
+}
+
+
+//8 vertices per iteration; begin must be a multiple of 8 and the inputs
+//are padded, so only the stores of the last group are partial
+template<int Slots, int Algo>
+__attribute__((target("avx2,fma")))
+static void skinPackedAVX2(const PackedKernelArgs &a, int begin, int end)
+{
+  int i, k, c;
+  const int slots = Slots ? Slots : a.slots;
+  const bool lbs = Algo != Mesh::DQS, dqs = Algo != Mesh::LBS;
+  const bool normals = a.nx != NULL;
+  const __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.f), two = _mm256_set1_ps(2.f);
+  const __m256 signBit = _mm256_set1_ps(-0.f);
+  const __m256 blend = _mm256_set1_ps(a.blendWeight), oneMinusBlend = _mm256_set1_ps(1.f - a.blendWeight);
+
+  for(i = begin; i < end; i += 8)
+  {
+    __m256 px = _mm256_loadu_ps(a.restX + i);
+    __m256 py = _mm256_loadu_ps(a.restY + i);
+    __m256 pz = _mm256_loadu_ps(a.restZ + i);
+    __m256 lx = zero, ly = zero, lz = zero, dx = px, dy = py, dz = pz;
+    __m256 nx = zero, ny = zero, nz = zero;
+    if(normals)
+    {
+      nx = _mm256_loadu_ps(a.restNX + i);
+      ny = _mm256_loadu_ps(a.restNY + i);
+      nz = _mm256_loadu_ps(a.restNZ + i);
+    }
+    __m256 lnx = zero, lny = zero, lnz = zero, dnx = nx, dny = ny, dnz = nz;
+
+    if(lbs)
+    {
+      const __m256i twelve = _mm256_set1_epi32(12);
+      __m256 l[9];
+      for(c = 0; c < 9; ++c)
+        l[c] = zero;
+      for(k = 0; k < slots; ++k)
+      {
+        __m256i idx = _mm256_mullo_epi32(_mm256_loadu_si256((const __m256i *)(a.boneIds + k * a.padded + i)), twelve);
+        __m256 w = _mm256_loadu_ps(a.weights + k * a.padded + i);
+        __m256 m[12];
+        for(c = 0; c < 12; ++c)
+          m[c] = _mm256_i32gather_ps(a.matrices + c, idx, 4);
+        __m256 tx = _mm256_fmadd_ps(m[0], px, _mm256_fmadd_ps(m[1], py, _mm256_fmadd_ps(m[2], pz, m[3])));
+        __m256 ty = _mm256_fmadd_ps(m[4], px, _mm256_fmadd_ps(m[5], py, _mm256_fmadd_ps(m[6], pz, m[7])));
+        __m256 tz = _mm256_fmadd_ps(m[8], px, _mm256_fmadd_ps(m[9], py, _mm256_fmadd_ps(m[10], pz, m[11])));
+        lx = _mm256_fmadd_ps(w, tx, lx);
+        ly = _mm256_fmadd_ps(w, ty, ly);
+        lz = _mm256_fmadd_ps(w, tz, lz);
+        if(normals)
+          for(c = 0; c < 9; ++c)
+            l[c] = _mm256_fmadd_ps(w, m[c / 3 * 4 + c % 3], l[c]);
+      }
+
+      if(normals)
+      {
+        __m256 c00 = _mm256_fmsub_ps(l[4], l[8], _mm256_mul_ps(l[7], l[5]));
+        __m256 c01 = _mm256_fmsub_ps(l[5], l[6], _mm256_mul_ps(l[8], l[3]));
+        __m256 c02 = _mm256_fmsub_ps(l[3], l[7], _mm256_mul_ps(l[6], l[4]));
+        __m256 c10 = _mm256_fmsub_ps(l[7], l[2], _mm256_mul_ps(l[1], l[8]));
+        __m256 c11 = _mm256_fmsub_ps(l[8], l[0], _mm256_mul_ps(l[2], l[6]));
+        __m256 c12 = _mm256_fmsub_ps(l[6], l[1], _mm256_mul_ps(l[0], l[7]));
+        __m256 c20 = _mm256_fmsub_ps(l[1], l[5], _mm256_mul_ps(l[4], l[2]));
+        __m256 c21 = _mm256_fmsub_ps(l[2], l[3], _mm256_mul_ps(l[5], l[0]));
+        __m256 c22 = _mm256_fmsub_ps(l[0], l[4], _mm256_mul_ps(l[3], l[1]));
+        lnx = _mm256_fmadd_ps(c00, nx, _mm256_fmadd_ps(c01, ny, _mm256_mul_ps(c02, nz)));
+        lny = _mm256_fmadd_ps(c10, nx, _mm256_fmadd_ps(c11, ny, _mm256_mul_ps(c12, nz)));
+        lnz = _mm256_fmadd_ps(c20, nx, _mm256_fmadd_ps(c21, ny, _mm256_mul_ps(c22, nz)));
+        normalizeAVX2(lnx, lny, lnz);
+      }
+    }
+
+    if(dqs)
+    {
+      const __m256i eight = _mm256_set1_epi32(8);
+      __m256i pivotIdx = _mm256_mullo_epi32(_mm256_loadu_si256((const __m256i *)(a.boneIds + i)), eight);
+      __m256 pivot[4], b[8];
+      for(c = 0; c < 4; ++c)
+        pivot[c] = _mm256_i32gather_ps(a.dualQuats + c, pivotIdx, 4);
+      for(c = 0; c < 8; ++c)
+        b[c] = zero;
+
+      for(k = 0; k < slots; ++k)
+      {
+        __m256i idx = _mm256_mullo_epi32(_mm256_loadu_si256((const __m256i *)(a.boneIds + k * a.padded + i)), eight);
+        __m256 w = _mm256_loadu_ps(a.weights + k * a.padded + i);
+        __m256 q[8];
+        for(c = 0; c < 8; ++c)
+          q[c] = _mm256_i32gather_ps(a.dualQuats + c, idx, 4);
+        __m256 dot = _mm256_fmadd_ps(q[0], pivot[0], _mm256_fmadd_ps(q[1], pivot[1],
+          _mm256_fmadd_ps(q[2], pivot[2], _mm256_mul_ps(q[3], pivot[3]))));
+        w = _mm256_xor_ps(w, _mm256_and_ps(_mm256_cmp_ps(dot, zero, _CMP_LT_OQ), signBit));
+        for(c = 0; c < 8; ++c)
+          b[c] = _mm256_fmadd_ps(w, q[c], b[c]);
+      }
+
+      __m256 norm2 = _mm256_fmadd_ps(b[0], b[0], _mm256_fmadd_ps(b[1], b[1],
+        _mm256_fmadd_ps(b[2], b[2], _mm256_mul_ps(b[3], b[3]))));
+      //vertices without influences stay where they are
+      __m256 empty = _mm256_cmp_ps(norm2, zero, _CMP_LE_OQ);
+      __m256 inv = _mm256_div_ps(one, _mm256_sqrt_ps(_mm256_blendv_ps(norm2, one, empty)));
+      __m256 qw = _mm256_mul_ps(b[0], inv), qx = _mm256_mul_ps(b[1], inv);
+      __m256 qy = _mm256_mul_ps(b[2], inv), qz = _mm256_mul_ps(b[3], inv);
+      __m256 ew = _mm256_mul_ps(b[4], inv), ex = _mm256_mul_ps(b[5], inv);
+      __m256 ey = _mm256_mul_ps(b[6], inv), ez = _mm256_mul_ps(b[7], inv);
+
+      __m256 tx = _mm256_mul_ps(two, _mm256_add_ps(_mm256_fmsub_ps(ex, qw, _mm256_mul_ps(qx, ew)),
+        _mm256_fmsub_ps(qy, ez, _mm256_mul_ps(qz, ey))));
+      __m256 ty = _mm256_mul_ps(two, _mm256_add_ps(_mm256_fmsub_ps(ey, qw, _mm256_mul_ps(qy, ew)),
+        _mm256_fmsub_ps(qz, ex, _mm256_mul_ps(qx, ez))));
+      __m256 tz = _mm256_mul_ps(two, _mm256_add_ps(_mm256_fmsub_ps(ez, qw, _mm256_mul_ps(qz, ew)),
+        _mm256_fmsub_ps(qx, ey, _mm256_mul_ps(qy, ex))));
+
+      __m256 ux = _mm256_fmadd_ps(qw, px, _mm256_fmsub_ps(qy, pz, _mm256_mul_ps(qz, py)));
+      __m256 uy = _mm256_fmadd_ps(qw, py, _mm256_fmsub_ps(qz, px, _mm256_mul_ps(qx, pz)));
+      __m256 uz = _mm256_fmadd_ps(qw, pz, _mm256_fmsub_ps(qx, py, _mm256_mul_ps(qy, px)));
+      __m256 rx = _mm256_add_ps(_mm256_fmadd_ps(two, _mm256_fmsub_ps(qy, uz, _mm256_mul_ps(qz, uy)), px), tx);
+      __m256 ry = _mm256_add_ps(_mm256_fmadd_ps(two, _mm256_fmsub_ps(qz, ux, _mm256_mul_ps(qx, uz)), py), ty);
+      __m256 rz = _mm256_add_ps(_mm256_fmadd_ps(two, _mm256_fmsub_ps(qx, uy, _mm256_mul_ps(qy, ux)), pz), tz);
+      dx = _mm256_blendv_ps(rx, px, empty);
+      dy = _mm256_blendv_ps(ry, py, empty);
+      dz = _mm256_blendv_ps(rz, pz, empty);
+
+      if(normals)
+      {
+        __m256 vx = _mm256_fmadd_ps(qw, nx, _mm256_fmsub_ps(qy, nz, _mm256_mul_ps(qz, ny)));
+        __m256 vy = _mm256_fmadd_ps(qw, ny, _mm256_fmsub_ps(qz, nx, _mm256_mul_ps(qx, nz)));
+        __m256 vz = _mm256_fmadd_ps(qw, nz, _mm256_fmsub_ps(qx, ny, _mm256_mul_ps(qy, nx)));
+        dnx = _mm256_blendv_ps(_mm256_fmadd_ps(two, _mm256_fmsub_ps(qy, vz, _mm256_mul_ps(qz, vy)), nx), nx, empty);
+        dny = _mm256_blendv_ps(_mm256_fmadd_ps(two, _mm256_fmsub_ps(qz, vx, _mm256_mul_ps(qx, vz)), ny), ny, empty);
+        dnz = _mm256_blendv_ps(_mm256_fmadd_ps(two, _mm256_fmsub_ps(qx, vy, _mm256_mul_ps(qy, vx)), nz), nz, empty);
+      }
+    }
+
+    __m256 ox, oy, oz;
+    if(Algo == Mesh::LBS)
+      { ox = lx; oy = ly; oz = lz; }
+    else if(Algo == Mesh::DQS)
+      { ox = dx; oy = dy; oz = dz; }
+    else
+    {
+      ox = _mm256_fmadd_ps(lx, blend, _mm256_mul_ps(dx, oneMinusBlend));
+      oy = _mm256_fmadd_ps(ly, blend, _mm256_mul_ps(dy, oneMinusBlend));
+      oz = _mm256_fmadd_ps(lz, blend, _mm256_mul_ps(dz, oneMinusBlend));
+    }
+    storeLanes(a.x + i, ox, end - i);
+    storeLanes(a.y + i, oy, end - i);
+    storeLanes(a.z + i, oz, end - i);
+
+    if(!normals)
+      continue;
+    if(Algo == Mesh::LBS)
+      { nx = lnx; ny = lny; nz = lnz; }
+    else if(Algo == Mesh::DQS)
+      { nx = dnx; ny = dny; nz = dnz; }
+    else
+    {
+      nx = _mm256_fmadd_ps(lnx, blend, _mm256_mul_ps(dnx, oneMinusBlend));
+      ny = _mm256_fmadd_ps(lny, blend, _mm256_mul_ps(dny, oneMinusBlend));
+      nz = _mm256_fmadd_ps(lnz, blend, _mm256_mul_ps(dnz, oneMinusBlend));
+      normalizeAVX2(nx, ny, nz);
+    }
+    storeLanes(a.nx + i, nx, end - i);
+    storeLanes(a.ny + i, ny, end - i);
+    storeLanes(a.nz + i, nz, end - i);
+  }
+}
+
+#endif //PINOCCHIO_AVX2_KERNELS
+
+
+template<int Algo>
+static PackedSkin::Kernel scalarKernel(int slots)
+{
+  switch(slots)
+  {
+    case 1: return skinPackedScalar<1, Algo>;
+    case 2: return skinPackedScalar<2, Algo>;
+    case 4: return skinPackedScalar<4, Algo>;
+    case 8: return skinPackedScalar<8, Algo>;
+    default: return skinPackedScalar<0, Algo>;
+  }
+}
+
+#ifdef PINOCCHIO_AVX2_KERNELS
+template<int Algo>
+static PackedSkin::Kernel simdKernel(int slots)
+{
+  switch(slots)
+  {
+    case 1: return skinPackedAVX2<1, Algo>;
+    case 2: return skinPackedAVX2<2, Algo>;
+    case 4: return skinPackedAVX2<4, Algo>;
+    case 8: return skinPackedAVX2<8, Algo>;
+    default: return skinPackedAVX2<0, Algo>;
+  }
+}
+#endif
+
+
+bool PackedSkin::hasAVX2()
+{
+#ifdef PINOCCHIO_AVX2_KERNELS
+  static const bool has = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+  return has;
+#else
+  return false;
+#endif
+}
+
+
+void PackedSkin::chooseKernels()
+{
+  //anything that is neither LBS nor DQS is mixed
+  if(algo == Mesh::LBS)
+    scalar = scalarKernel<Mesh::LBS>(slots);
+  else if(algo == Mesh::DQS)
+    scalar = scalarKernel<Mesh::DQS>(slots);
+  else
+    scalar = scalarKernel<Mesh::MIX>(slots);
+
+  simd = NULL;
+#ifdef PINOCCHIO_AVX2_KERNELS
+  if(hasAVX2())
+  {
+    if(algo == Mesh::LBS)
+      simd = simdKernel<Mesh::LBS>(slots);
+    else if(algo == Mesh::DQS)
+      simd = simdKernel<Mesh::DQS>(slots);
+    else
+      simd = simdKernel<Mesh::MIX>(slots);
+  }
+#endif
+}
+
+
+//Unused slots read bone 0 at weight 0, so with no bones at all (where the
+//context may have an empty palette) they read this identity bone instead.
+static const float identityMatrix[12] = { 1.f, 0.f, 0.f, 0.f, 0.f, 1.f, 0.f, 0.f, 0.f, 0.f, 1.f, 0.f };
+static const float identityDualQuat[8] = { 1.f, 0.f, 0.f, 0.f, 0.f, 0.f, 0.f, 0.f };
+
+static const float *packedMatrices(const SkinningContext &context)
+{
+  return context.size() > 0 ? context.packedMatrices() : identityMatrix;
+}
+
+static const float *packedDualQuats(const SkinningContext &context)
+{
+  return context.size() > 0 ? context.packedDualQuats() : identityDualQuat;
+}
+
+
+bool PackedSkin::deform(const SkinningContext &context, float *x, float *y, float *z, int kernel) const
+{
+  return deform(context, x, y, z, NULL, NULL, NULL, kernel);
+}
+
+
+bool PackedSkin::deform(const SkinningContext &context, float *x, float *y, float *z,
+float *nx, float *ny, float *nz, int kernel) const
+{
+  if(context.size() < bones)
+    //error
+    return false;
+  if(vertices == 0)
+    return true;
+
+  Kernel f = (kernel != SCALAR && simd) ? simd : scalar;
+  if(kernel == AVX2 && !simd)
+    return false;
+
+  PackedKernelArgs a = { &restX[0], &restY[0], &restZ[0], &boneIds[0], &weights[0], padded, slots,
+    packedMatrices(context), packedDualQuats(context), blendWeight, x, y, z,
+    &restNX[0], &restNY[0], &restNZ[0], nx, ny, nz };
+
+  //the chunks are multiples of 8 vertices, as the AVX2 kernel needs
+  forVertexChunks(vertices, context, [&](int begin, int end) { f(a, begin, end); });
+  return true;
+}
+
+
+bool PackedSkin::deformInstances(const std::vector<SkinningContext> &poses, float *out, int kernel) const
+{
+  return deformInstances(poses, out, NULL, kernel);
+}
+
+
+bool PackedSkin::deformInstances(const std::vector<SkinningContext> &poses, float *out, float *normals,
+int kernel) const
+{
+  int i, n = poses.size();
+
+  for(i = 0; i < n; ++i)
+    if(poses[i].size() < bones)
+      //error
+      return false;
+  Kernel f = (kernel != SCALAR && simd) ? simd : scalar;
+  if(kernel == AVX2 && !simd)
+    return false;
+  if(vertices == 0 || n == 0)
+    return true;
+
+  //the chunks are multiples of 8 vertices, as the AVX2 kernel needs
+  forInstanceTiles(vertices, n, poses[0].parallelThreshold(), [&](int begin, int end, int instance)
+  {
+    float *x = out + (size_t)instance * 3 * vertices;
+    float *nx = normals ? normals + (size_t)instance * 3 * vertices : NULL;
+    PackedKernelArgs a = { &restX[0], &restY[0], &restZ[0], &boneIds[0], &weights[0], padded, slots,
+      packedMatrices(poses[instance]), packedDualQuats(poses[instance]), blendWeight,
+      x, x + vertices, x + 2 * vertices, &restNX[0], &restNY[0], &restNZ[0],
+      nx, nx ? nx + vertices : NULL, nx ? nx + 2 * vertices : NULL };
+    f(a, begin, end);
+  });
+  return true;
+}
+
+} // namespace Pinocchio
@@ -0,0 +1,315 @@
+/*  This file is part of the Pinocchio automatic rigging library.
+    Copyright (C) 2007 Ilya Baran (ibaran@mit.edu)
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef SKINNING_H_C1FFADAA_CBC0_11F1_9C63_29CF544B373E
+#define SKINNING_H_C1FFADAA_CBC0_11F1_9C63_29CF544B373E
+
+#include <utility>
+#include <vector>
+
+#include "pin_mesh.h"
+#include "transform.h"
+#include "quatinterface.h"
+
+namespace Pinocchio {
+
+//read-only view of the skinning weights, valid until the Attachment is
+//changed or destroyed.  The influences of vertex i are the entries
+//offsets[i] to offsets[i + 1] - 1 of boneIds and weights, with the bones in
+//increasing order and the weights summing to one.
+//Memory is 4 bytes per vertex plus 6 bytes per influence, so a crowd
+//character capped at 4 influences costs at most 28 bytes per vertex
+//(a 10k vertex character is under 300KB) instead of 8 bytes per bone.
+struct SkinWeights {
+  int vertices;
+  int bones;
+  const unsigned int *offsets; //vertices + 1 entries
+  const unsigned short *boneIds;
+  const float *weights;
+};
+
+//one vertex of SkinWeights read as a dense vector over the bones, without
+//copying: v[j] is the weight of bone j, zero for the bones that don't
+//influence the vertex (found by a scan of its few sorted influences)
+struct WeightRow {
+  WeightRow() : bones(0), count(0), boneIds(NULL), weights(NULL) {}
+  WeightRow(const SkinWeights &w, int i) : bones(w.bones), count(0), boneIds(NULL), weights(NULL)
+  {
+    if(i >= 0 && i < w.vertices)
+    {
+      count = w.offsets[i + 1] - w.offsets[i];
+      boneIds = w.boneIds + w.offsets[i];
+      weights = w.weights + w.offsets[i];
+    }
+  }
+
+  int size() const { return bones; }
+  double operator[](int bone) const
+  {
+    for(int k = 0; k < count && boneIds[k] <= bone; ++k)
+      if(boneIds[k] == bone)
+        return weights[k];
+    return 0.;
+  }
+
+  int bones;
+  int count; //influences, stored in boneIds and weights with the bones increasing
+  const unsigned short *boneIds;
+  const float *weights;
+};
+
+//Caller-owned arrays that Attachment::deformInto writes, one entry per
+//vertex.  The Vector3 arrays are strided (in bytes) so that they can point
+//into interleaved vertex records like Mesh::vertices; x, y, z (and nx, ny,
+//nz) are separate coordinate arrays instead.  Either form or both can be
+//given, and NULL pointers are skipped.  Normals are only computed if there
+//is somewhere to put them.
+struct DeformTarget {
+  DeformTarget() : positions(NULL), normals(NULL), stride(sizeof(Vector3)),
+    x(NULL), y(NULL), z(NULL), nx(NULL), ny(NULL), nz(NULL) {}
+  //the vertices of out, which must have the topology of the rest mesh
+  explicit DeformTarget(Mesh &out) : positions(NULL), normals(NULL), stride(sizeof(MeshVertex)),
+    x(NULL), y(NULL), z(NULL), nx(NULL), ny(NULL), nz(NULL)
+  {
+    if(!out.vertices.empty())
+    {
+      positions = &out.vertices[0].pos;
+      normals = &out.vertices[0].normal;
+    }
+  }
+
+  Vector3 *positions;
+  Vector3 *normals;
+  int stride;
+  double *x, *y, *z;
+  double *nx, *ny, *nz;
+
+  bool wantsNormals() const { return (normals || nx) && (positions || x); }
+
+  Vector3 position(int i) const {
+    return positions ? at(positions, i) : Vector3(x[i], y[i], z[i]);
+  }
+  void setPosition(int i, const Vector3 &p) const {
+    if(positions)
+      at(positions, i) = p;
+    if(x)
+      { x[i] = p[0]; y[i] = p[1]; z[i] = p[2]; }
+  }
+  Vector3 normal(int i) const {
+    return normals ? at(normals, i) : Vector3(nx[i], ny[i], nz[i]);
+  }
+  void setNormal(int i, const Vector3 &n) const {
+    if(normals)
+      at(normals, i) = n;
+    if(nx)
+      { nx[i] = n[0]; ny[i] = n[1]; nz[i] = n[2]; }
+  }
+
+  private:
+    Vector3 &at(Vector3 *base, int i) const { return *(Vector3 *)((char *)base + (size_t)i * stride); }
+};
+
+/**
+ * The bone transforms of one frame, converted once for all the vertices:
+ * the dual quaternion skinning kernels index the packed dual quaternion
+ * palette instead of converting a transform for every influence, and the
+ * float kernels of PackedSkin use 3x4 matrices (row major, 12 floats per
+ * bone) and dual quaternions (w i j k of the rotation part, then of the
+ * dual part: 8 floats per bone).  Keep one context from frame to frame
+ * and nothing gets allocated after the first.
+ *
+ * Meshes with at least parallelThreshold() vertices are skinned in chunks
+ * of skinningChunk vertices on ThreadPool::global(); smaller ones are not
+ * worth waking the workers for and run on the calling thread.
+ *
+ * Normals are recomputed from the deformed faces by default, which gives
+ * the same result as Mesh::computeVertexNormals.  With SKINNED_NORMALS
+ * the rest normals are instead carried along by the blended transform
+ * (the inverse transpose of the blended matrix for LBS, the rotation of
+ * the blended dual quaternion for DQS), which needs no pass over the faces
+ * but only approximates the true normals where the surface stretches.
+ *
+ * For posing, where a frame usually moves one or two bones, give the
+ * context the weights with setInfluences: it then indexes which vertex
+ * ranges every bone moves (and whose recomputed normals it changes) and
+ * setTransforms works out the ranges its changed bones touch, so that
+ * skinChanged only redoes those.
+ */
+class PINOCCHIO_API SkinningContext {
+  public:
+    SkinningContext() : minParallel(defaultParallelThreshold), normals(RECOMPUTED_NORMALS),
+      indexVertices(-1), allChanged(true) {}
+    explicit SkinningContext(const std::vector<Transform<> > &inTransforms)
+      : minParallel(defaultParallelThreshold), normals(RECOMPUTED_NORMALS),
+      indexVertices(-1), allChanged(true) { setTransforms(inTransforms); }
+
+    enum { skinningChunk = 1024, defaultParallelThreshold = 8192 };
+    //how normals are computed
+    enum { RECOMPUTED_NORMALS = 0, SKINNED_NORMALS = 1 };
+
+    //also finds the bones whose transforms differ from the previous call
+    void setTransforms(const std::vector<Transform<> > &inTransforms);
+    //for poses kept in float; the palettes are worked out in double anyway
+    void setTransforms(const std::vector<Transform<float> > &inTransforms);
+    //builds the bone to vertex index for these weights of rest, after which
+    //the next setTransforms counts every bone as changed
+    void setInfluences(const Mesh &rest, const SkinWeights &weights);
+
+    //0 always splits the vertices across the pool, INT_MAX never does
+    void setParallelThreshold(int vertices) { minParallel = vertices; }
+    int parallelThreshold() const { return minParallel; }
+    void setNormalMode(int mode) { normals = mode; }
+    int normalMode() const { return normals; }
+
+    int size() const { return (int)transforms.size(); }
+    const Transform<> &transform(int bone) const { return transforms[bone]; }
+    const Tbx::Dual_quat_cu &dualQuat(int bone) const { return dualQuats[bone]; }
+    //the columns of the linear part of the transform (rotation times scale)
+    const Vector3 *linearPart(int bone) const { return &axes[bone * 3]; }
+    const float *packedMatrices() const { return matrices.empty() ? NULL : &matrices[0]; }
+    const float *packedDualQuats() const { return floatDualQuats.empty() ? NULL : &floatDualQuats[0]; }
+
+    //bones changed by the last setTransforms
+    const std::vector<int> &changedBones() const { return changed; }
+    //vertex count of the index, -1 without one
+    int influenceIndexSize() const { return indexVertices; }
+    //what the changed bones touch, as [begin, end) pairs of vertex indices,
+    //sorted and disjoint: the vertices to skin, and those to recompute the
+    //normals of (the first ones and their neighbors)
+    const std::vector<int> &changedVertices() const { return dirtyPositions; }
+    const std::vector<int> &changedNormals() const { return dirtyNormals; }
+
+  private:
+    void findChangedRanges(bool everything);
+    //converts transforms into the double and float palettes
+    void setPalettes();
+
+    std::vector<Transform<> > transforms;
+    std::vector<Tbx::Dual_quat_cu> dualQuats;
+    std::vector<Vector3> axes;
+    std::vector<float> matrices;
+    std::vector<float> floatDualQuats;
+    int minParallel;
+    int normals;
+
+    //[begin, end) vertex ranges of bone b are entries 2 * start[b] to
+    //2 * start[b + 1] - 1
+    int indexVertices;
+    std::vector<int> positionStart, positionRanges;
+    std::vector<int> normalStart, normalRanges;
+    bool allChanged;
+    std::vector<int> changed;
+    std::vector<int> dirtyPositions, dirtyNormals;
+    std::vector<std::pair<int, int> > mergeScratch;
+};
+
+/**
+ * A rest pose and its weights laid out for the vectorized kernels: float
+ * positions as a structure of arrays, and every vertex given the same
+ * number of influence slots (the most any vertex has, so cap the
+ * influences first) stored slot by slot, with unused slots at weight 0.
+ * Vertices are padded to a multiple of 8 for the AVX2 kernel, which
+ * skins 8 vertices per iteration with gathers from the packed palette.
+ * The scalar kernel runs on CPUs without AVX2 and does the same float math.
+ * This is the float32 path: the palette, weights, rest pose and results
+ * are all float, while rigging and the other skinning functions stay in
+ * double.  Normals can be skinned along (SKINNED_NORMALS in the terms of
+ * SkinningContext); there is no float version of the recomputed normals.
+ *
+ * Both kernels are compiled for each blend mode and for 1, 2, 4 and 8
+ * slots (3 is padded to 4, and 5 to 7 to 8), with a generic version for
+ * more; the one to run is picked when the skin is packed or its algorithm
+ * changes, not per vertex.
+ */
+struct PackedKernelArgs;
+
+class PINOCCHIO_API PackedSkin {
+  public:
+    //kernels
+    enum { AUTO = 0, SCALAR = 1, AVX2 = 2 };
+    typedef void (*Kernel)(const PackedKernelArgs &args, int begin, int end);
+
+    PackedSkin() : vertices(0), padded(0), slots(0), bones(0), algo(Mesh::LBS), blendWeight(1.f),
+      scalar(NULL), simd(NULL) {}
+    //takes the skinning algorithm, blend weight and normals from rest
+    PackedSkin(const Mesh &rest, const SkinWeights &weights);
+
+    int size() const { return vertices; }
+    int influenceSlots() const { return slots; }
+    void setAlgorithm(int inAlgo, float inBlendWeight = 1.f) { algo = inAlgo; blendWeight = inBlendWeight; chooseKernels(); }
+
+    //whether the AVX2 kernel can run on this CPU
+    static bool hasAVX2();
+
+    //writes the deformed positions into x, y, z (size() entries each), returns
+    //false if the context has too few bones or AVX2 is asked for without it
+    bool deform(const SkinningContext &context, float *x, float *y, float *z, int kernel = AUTO) const;
+    //also writes the skinned normals into nx, ny, nz
+    bool deform(const SkinningContext &context, float *x, float *y, float *z,
+      float *nx, float *ny, float *nz, int kernel = AUTO) const;
+    //skins instance i with poses[i] into out + 3 * i * size(): its x, then
+    //y, then z coordinates.  Tiled and spread over the pool like
+    //skinInstances, with the parallel threshold of the first pose.
+    bool deformInstances(const std::vector<SkinningContext> &poses, float *out, int kernel = AUTO) const;
+    //with the normals laid out the same way in normals
+    bool deformInstances(const std::vector<SkinningContext> &poses, float *out, float *normals,
+      int kernel = AUTO) const;
+
+  private:
+    int vertices, padded, slots, bones;
+    int algo;
+    float blendWeight;
+    std::vector<float> restX, restY, restZ;
+    std::vector<float> restNX, restNY, restNZ;
+    //slot k of vertex i is at k * padded + i
+    std::vector<int> boneIds;
+    std::vector<float> weights;
+    Kernel scalar, simd; //simd is NULL without AVX2
+
+    void chooseKernels();
+};
+
+//Deforms the rest mesh with the weights into target, with the skinning
+//algorithm and blend weight of the rest mesh.  Skinned normals start from
+//the normals of the rest mesh.  Returns false if the weights are for a
+//different number of vertices.
+PINOCCHIO_API bool skin(const Mesh &rest, const SkinWeights &weights,
+  const SkinningContext &context, const DeformTarget &target);
+
+//Skins many instances of the same character, each with its own pose, into
+//targets[i] with poses[i].  Chunks of vertices are deformed for a group of
+//instances in a row, so the rest mesh and the weights are read once per
+//group rather than once per instance, and the tiles are spread over the
+//pool when the total vertex count reaches the parallel threshold of the
+//first pose.  Recomputed normals are done one instance per task.
+//Returns false if there aren't as many targets as poses or a pose has too
+//few bones.
+PINOCCHIO_API bool skinInstances(const Mesh &rest, const SkinWeights &weights,
+  const std::vector<SkinningContext> &poses, const std::vector<DeformTarget> &targets);
+
+//Like skin, but only for what the bones changed by the last setTransforms
+//of context move: target has to hold the result of the previous frame.
+//Needs setInfluences with the same weights, otherwise returns false.
+//Recomputed normals are summed in a different order than skin sums them
+//and can differ from its normals in the last bit.
+PINOCCHIO_API bool skinChanged(const Mesh &rest, const SkinWeights &weights,
+  const SkinningContext &context, const DeformTarget &target);
+
+} // namespace Pinocchio
+
+#endif // SKINNING_H_C1FFADAA_CBC0_11F1_9C63_29CF544B373E
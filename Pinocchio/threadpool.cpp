@@ -0,0 +1,129 @@
+/*  This file is part of the Pinocchio automatic rigging library.
+    Copyright (C) 2007 Ilya Baran (ibaran@mit.edu)
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <stdlib.h>
+#include "threadpool.h"
+
+namespace Pinocchio {
+
+//set while a thread is running part of a job, so nested calls run serially
+static thread_local bool inJob = false;
+
+ThreadPool::ThreadPool(int threads)
+  : job(NULL), jobSize(0), next(0), busy(0), generation(0), quit(false)
+{
+  int i;
+  for(i = 1; i < threads; ++i)
+    workers.push_back(std::thread(&ThreadPool::workerLoop, this));
+}
+
+
+ThreadPool::~ThreadPool()
+{
+  int i;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    quit = true;
+  }
+  wake.notify_all();
+  for(i = 0; i < (int)workers.size(); ++i)
+    workers[i].join();
+}
+
+
+ThreadPool &ThreadPool::global()
+{
+  static ThreadPool pool(defaultSize());
+  return pool;
+}
+
+
+int ThreadPool::defaultSize()
+{
+  const char *env = getenv("PINOCCHIO_THREADS");
+  int threads = env ? atoi(env) : (int)std::thread::hardware_concurrency();
+  return std::max(1, threads);
+}
+
+
+void ThreadPool::parallelFor(int n, const std::function<void(int)> &f)
+{
+  int i;
+  if(n <= 0)
+    return;
+
+  if(workers.empty() || n == 1 || inJob)
+  {
+    for(i = 0; i < n; ++i)
+      f(i);
+    return;
+  }
+
+  std::lock_guard<std::mutex> callLock(callMutex);
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    job = &f;
+    jobSize = n;
+    next = 0;
+    busy = workers.size();
+    ++generation;
+  }
+  wake.notify_all();
+
+  runJob();
+
+  std::unique_lock<std::mutex> lock(mutex);
+  done.wait(lock, [this] { return busy == 0; });
+  job = NULL;
+}
+
+
+void ThreadPool::runJob()
+{
+  inJob = true;
+  int i;
+  while((i = next++) < jobSize)
+    (*job)(i);
+  inJob = false;
+}
+
+
+void ThreadPool::workerLoop()
+{
+  unsigned int seen = 0;
+  for(;;)
+  {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      wake.wait(lock, [&] { return quit || generation != seen; });
+      if(quit)
+        return;
+      seen = generation;
+    }
+
+    runJob();
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      --busy;
+    }
+    done.notify_one();
+  }
+}
+
+} // namespace Pinocchio
@@ -0,0 +1,80 @@
+/*  This file is part of the Pinocchio automatic rigging library.
+    Copyright (C) 2007 Ilya Baran (ibaran@mit.edu)
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef THREADPOOL_H_C1FFA9DC_CBC0_11F1_9D0C_9F319C67B8E5
+#define THREADPOOL_H_C1FFA9DC_CBC0_11F1_9D0C_9F319C67B8E5
+
+#include <vector>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <algorithm>
+
+#include "Pinocchio.h"
+
+namespace Pinocchio {
+
+/**
+ * A fixed set of worker threads that stay alive between jobs.  The only
+ * operation is parallelFor, which runs f(0) ... f(n - 1) on the workers and
+ * the calling thread and returns when all of them are done.  Indices are handed
+ * out dynamically, so f must not depend on which thread runs it.  A
+ * parallelFor called from inside f runs serially on the calling thread.
+ */
+class PINOCCHIO_API ThreadPool {
+  public:
+    //threads counts the calling thread, so 1 means everything runs serially
+    explicit ThreadPool(int threads);
+    ~ThreadPool();
+
+    //shared pool sized by the PINOCCHIO_THREADS environment variable, or by
+    //the number of hardware threads if that is not set
+    static ThreadPool &global();
+
+    int size() const { return (int)workers.size() + 1; }
+
+    void parallelFor(int n, const std::function<void(int)> &f);
+
+  private:
+    ThreadPool(const ThreadPool &);
+    ThreadPool &operator=(const ThreadPool &);
+
+    static int defaultSize();
+    void workerLoop();
+    void runJob();
+
+    std::vector<std::thread> workers;
+
+    std::mutex callMutex; //one job at a time
+    std::mutex mutex;
+    std::condition_variable wake, done;
+
+    //current job
+    const std::function<void(int)> *job;
+    int jobSize;
+    std::atomic<int> next;
+    int busy; //workers that have not finished the current job
+    unsigned int generation;
+    bool quit;
+};
+
+} // namespace Pinocchio
+
+#endif // THREADPOOL_H_C1FFA9DC_CBC0_11F1_9D0C_9F319C67B8E5
@@ -99,6 +99,7 @@ template<class Real = double> class Quaternion { // Normalized quaternion for re
     }
 
   private:
+    template<class R> friend class Quaternion;
     Quaternion(const Real &inR, const Vector<Real, 3> &inV) : r(inR), v(inV) {}
 
     Real r;
@@ -114,6 +115,7 @@ template<class Real = double> class Transform { // T(v) = (rot * v * scale) + tr
     explicit Transform(const Vec &inTrans) : scale(1.), trans(inTrans) {}
     Transform(const Quaternion<Real> &inRot, Real inScale = Real(1.), Vec inTrans = Vec()) : rot(inRot), scale(inScale), trans(inTrans) {}
     Transform(const Transform &t) : rot(t.rot), scale(t.scale), trans(t.trans) {}
+    template<class R> Transform(const Transform<R> &t) : rot(t.getRot()), scale(t.getScale()), trans(t.getTrans()) {} //Convert transforms of other types
 
     Transform operator*(const Transform &t) const { return Transform(rot * t.rot, scale * t.scale, trans + rot * (scale * t.trans)); }
     Vec operator*(const Vec &v) const { return rot * (v * scale) + trans; }
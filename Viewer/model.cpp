@@ -317,7 +317,7 @@ void AnimatedModel::loadObject(std::string obj_filename, std::string motion_file
     std::string weightOutName("attachment.out");
     std::ofstream astrm(weightOutName.c_str());
     for (int i = 0; i < (int)m.vertices.size(); ++i) {
-        Vector<double, -1> v = o.attachment->getWeights(i);
+        WeightRow v = o.attachment->getWeights(i);
         for (int j = 0; j < v.size(); ++j) {
             double d = ::floor(0.5 + v[j] * 10000.0) / 10000.0;
             astrm << d << " ";